@@ -78,7 +78,9 @@ int main(int argc, char* argv[]) {
         port = std::stoi(port_str);
     }
 
-    
+    // Whether the model only depends on its inputs and config, so that identical requests in flight may be coalesced
+    bool deterministic = get_arg(args, "deterministic") == "true";
+
     // Assemble job manager
     std::unique_ptr<JobSubmitter> job_submitter;
     std::filesystem::path script_dir;
@@ -116,7 +118,7 @@ int main(int argc, char* argv[]) {
     // Prepare models and serve via network
     std::vector<LoadBalancer> LB_vector;
     for (auto model_name : model_names) {
-        LB_vector.emplace_back(model_name, job_manager);
+        LB_vector.emplace_back(model_name, job_manager, deterministic);
     }
 
     // umbridge::serveModels currently only accepts raw pointers.
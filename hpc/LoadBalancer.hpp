@@ -422,6 +422,14 @@ public:
         return model->Gradient(outWrt, inWrt, inputs, sens, config_json);
     }
 
+    std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>> &inputs,
+                                 const std::vector<double> &sens,
+                                 json config_json = json::parse("{}")) override {
+        return model->EvaluateAndGradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
     std::vector<double> ApplyJacobian(unsigned int outWrt,
                                       unsigned int inWrt,
                                       const std::vector<std::vector<double>> &inputs,
@@ -440,6 +448,31 @@ public:
         return model->ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
     }
 
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>> &inputs,
+                                      const std::vector<std::vector<double>> &vecs,
+                                      json config_json = json::parse("{}")) override {
+        return model->ApplyJacobianBlock(outWrt, inWrt, inputs, vecs, config_json);
+    }
+
+    std::vector<std::vector<double>> ApplyHessianBlock(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>> &inputs,
+                                     const std::vector<double> &sens,
+                                     const std::vector<std::vector<double>> &vecs,
+                                     json config_json = json::parse("{}")) override {
+        return model->ApplyHessianBlock(outWrt, inWrt1, inWrt2, inputs, sens, vecs, config_json);
+    }
+
+    umbridge::JacobianMatrix Jacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>> &inputs,
+                                      json config_json = json::parse("{}")) override {
+        return model->Jacobian(outWrt, inWrt, inputs, config_json);
+    }
+
     bool SupportsEvaluate() override {
         return model->SupportsEvaluate();
     }
@@ -452,6 +485,9 @@ public:
     bool SupportsApplyHessian() override {
         return model->SupportsApplyHessian();
     }
+    void CloseSession() override {
+        model->CloseSession();
+    }
 
 private:
     std::unique_ptr<Job> job;
@@ -500,8 +536,10 @@ private:
 // redirected to models running in a job allocation of an HPC system.
 class LoadBalancer : public umbridge::Model {
 public:
-    LoadBalancer(std::string name, std::shared_ptr<JobManager> job_manager) 
-    : umbridge::Model(name), job_manager(job_manager) {}
+    // Set deterministic only if the model's evaluations depend on nothing but inputs and config, so that identical
+    // requests in flight may share a job
+    LoadBalancer(std::string name, std::shared_ptr<JobManager> job_manager, bool deterministic = false)
+    : umbridge::Model(name), job_manager(job_manager), deterministic(deterministic) {}
 
     std::vector<std::size_t> GetInputSizes(const json &config_json = json::parse("{}")) const override {
         auto model = job_manager->requestModelAccess(name);
@@ -515,7 +553,7 @@ public:
 
     std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>> &inputs, 
                                               json config_json = json::parse("{}")) override {
-        auto model = job_manager->requestModelAccess(name);
+        auto model = acquire_model();
         return model->Evaluate(inputs, config_json);
     }
 
@@ -524,16 +562,25 @@ public:
                                  const std::vector<std::vector<double>> &inputs,
                                  const std::vector<double> &sens,
                                  json config_json = json::parse("{}")) override {
-        auto model = job_manager->requestModelAccess(name);
+        auto model = acquire_model();
         return model->Gradient(outWrt, inWrt, inputs, sens, config_json);
     }
 
+    std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>> &inputs,
+                                 const std::vector<double> &sens,
+                                 json config_json = json::parse("{}")) override {
+        auto model = acquire_model();
+        return model->EvaluateAndGradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
     std::vector<double> ApplyJacobian(unsigned int outWrt,
                                       unsigned int inWrt,
                                       const std::vector<std::vector<double>> &inputs,
                                       const std::vector<double> &vec,
                                       json config_json = json::parse("{}")) override {
-        auto model = job_manager->requestModelAccess(name);
+        auto model = acquire_model();
         return model->ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
     }
 
@@ -544,10 +591,38 @@ public:
                                      const std::vector<double> &sens,
                                      const std::vector<double> &vec,
                                      json config_json = json::parse("{}")) override {
-        auto model = job_manager->requestModelAccess(name);
+        auto model = acquire_model();
         return model->ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
     }
 
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>> &inputs,
+                                      const std::vector<std::vector<double>> &vecs,
+                                      json config_json = json::parse("{}")) override {
+        auto model = acquire_model();
+        return model->ApplyJacobianBlock(outWrt, inWrt, inputs, vecs, config_json);
+    }
+
+    std::vector<std::vector<double>> ApplyHessianBlock(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>> &inputs,
+                                     const std::vector<double> &sens,
+                                     const std::vector<std::vector<double>> &vecs,
+                                     json config_json = json::parse("{}")) override {
+        auto model = acquire_model();
+        return model->ApplyHessianBlock(outWrt, inWrt1, inWrt2, inputs, sens, vecs, config_json);
+    }
+
+    umbridge::JacobianMatrix Jacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>> &inputs,
+                                      json config_json = json::parse("{}")) override {
+        auto model = acquire_model();
+        return model->Jacobian(outWrt, inWrt, inputs, config_json);
+    }
+
     bool SupportsEvaluate() override {
         auto model = job_manager->requestModelAccess(name);
         return model->SupportsEvaluate();
@@ -564,7 +639,45 @@ public:
         auto model = job_manager->requestModelAccess(name);
         return model->SupportsApplyHessian();
     }
+    bool IsDeterministic() const override {
+        return deterministic;
+    }
+
+    // Close the session on the backend serving it, before its instance is released
+    void CloseSession() override {
+        umbridge::Session* session = umbridge::CurrentSession();
+        if (session && session->Get<SessionModel>().model) {
+            session->Get<SessionModel>().model->CloseSession();
+        }
+    }
 
 private:
+    // Model state of a session is kept on the backend that served its first call
+    struct SessionModel {
+        std::shared_ptr<umbridge::Model> model;
+    };
+
+    // Calls of a session all go to the same model instance, so that the backend can warm-start from the session's
+    // previous calls (the session id is passed on to it). The instance is released once the session is closed or expires.
+    // Other calls get a fresh instance, released right after the call.
+    // Calls cancelled (or past their deadline) while waiting for a job are not passed on. Otherwise, the backend
+    // receives their deadline and is asked to cancel them along with the incoming call.
+    std::shared_ptr<umbridge::Model> acquire_model() const {
+        umbridge::CurrentCancellation().ThrowIfCancelled();
+        umbridge::Session* session = umbridge::CurrentSession();
+        if (!session) {
+            std::shared_ptr<umbridge::Model> model = job_manager->requestModelAccess(name);
+            umbridge::CurrentCancellation().ThrowIfCancelled();
+            return model;
+        }
+        std::shared_ptr<umbridge::Model>& model = session->Get<SessionModel>().model;
+        if (!model) {
+            model = job_manager->requestModelAccess(name);
+        }
+        umbridge::CurrentCancellation().ThrowIfCancelled();
+        return model;
+    }
+
     std::shared_ptr<JobManager> job_manager;
+    bool deterministic;
 };
@@ -4,6 +4,10 @@
 //  Copyright (c) 2021 Yuji Hirose. All rights reserved.
 //  MIT License
 //
+//  UM-Bridge local patches, each marked "UM-Bridge local patch" below:
+//  - Unix domain sockets (AF_UNIX) in create_socket, as supported by later
+//    upstream releases. Drop once the bundled version is updated.
+//
 
 #ifndef CPPHTTPLIB_HTTPLIB_H
 #define CPPHTTPLIB_HTTPLIB_H
@@ -175,6 +179,7 @@ using socket_t = SOCKET;
 #include <pthread.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h> // UM-Bridge local patch: AF_UNIX sockets
 #include <unistd.h>
 
 using socket_t = int;
@@ -2469,6 +2474,35 @@ socket_t create_socket(const char *host, const char *ip, int port,
   hints.ai_flags = socket_flags;
   hints.ai_protocol = 0;
 
+  // UM-Bridge local patch: AF_UNIX sockets. The host is the socket path.
+#ifndef _WIN32
+  if (address_family == AF_UNIX) {
+    const auto addrlen = strlen(host);
+    if (addrlen >= sizeof(sockaddr_un::sun_path)) { return INVALID_SOCKET; }
+
+    auto sock = socket(address_family, SOCK_STREAM, 0);
+    if (sock != INVALID_SOCKET) {
+      sockaddr_un addr{};
+      addr.sun_family = AF_UNIX;
+      std::copy(host, host + addrlen, addr.sun_path);
+
+      hints.ai_addr = reinterpret_cast<sockaddr *>(&addr);
+      hints.ai_addrlen = static_cast<socklen_t>(
+          sizeof(addr) - sizeof(addr.sun_path) + addrlen);
+
+      fcntl(sock, F_SETFD, FD_CLOEXEC);
+      if (socket_options) { socket_options(sock); }
+
+      if (!bind_or_connect(sock, hints)) {
+        close_socket(sock);
+        sock = INVALID_SOCKET;
+      }
+    }
+    return sock;
+  }
+#endif
+  // End of UM-Bridge local patch
+
   // Ask getaddrinfo to convert IP in c-string to address
   if (ip[0] != '\0') {
     hints.ai_family = AF_UNSPEC;
@@ -1,14 +1,27 @@
 #ifndef UMBRIDGE
 #define UMBRIDGE
 
-// Only enable shared memory functionality on Linux as it supports POSIX standard (Apple Mac probably too, needs testing of shared memory and pthread_self).
+// Only enable shared memory functionality on Linux as it supports POSIX standard (Apple Mac probably too, needs testing of shared memory).
 // TO-DO?: Future support for Windows will require a shared memory vector implementation using WinAPI considering different behaviour than POSIX.
 #if defined __linux__
 #define SUPPORT_POSIX_SHMEM
+// Anonymous memfd buffers passed between processes over Unix domain sockets (SCM_RIGHTS) are Linux specific.
+#define SUPPORT_MEMFD
+#endif
+// Unix domain sockets allow same-node communication without going through the TCP stack.
+#ifndef _WIN32
+#define SUPPORT_UNIX_SOCKET
 #endif
 #ifdef SUPPORT_POSIX_SHMEM
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
-#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef SUPPORT_MEMFD
+#include <sys/socket.h>
+#include <sys/un.h>
 #endif
 // #define LOGGING
 
@@ -16,7 +29,35 @@
 // This should be (to be on the safe side) significantly greater than the maximum time your model may take
 #define CPPHTTPLIB_READ_TIMEOUT_SECOND 60*60*24*365
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 
@@ -27,6 +68,382 @@ using json = nlohmann::json;
 
 namespace umbridge {
 
+  // Model inputs stored back to back in one contiguous buffer. Indexing works like for std::vector<std::vector<double>>,
+  // returning views into the buffer, but the whole block takes a single allocation.
+  class InputBlock {
+  public:
+    template <typename T>
+    class View {
+    public:
+      View(T* values, std::size_t length) : values(values), length(length) {}
+      T* data() const { return values; }
+      std::size_t size() const { return length; }
+      T* begin() const { return values; }
+      T* end() const { return values + length; }
+      T& operator[](std::size_t i) const { return values[i]; }
+      std::vector<double> ToVector() const { return std::vector<double>(begin(), end()); }
+    private:
+      T* values;
+      std::size_t length;
+    };
+
+    InputBlock() = default;
+
+    explicit InputBlock(const std::vector<std::size_t>& sizes) {
+      Resize(sizes);
+    }
+
+    explicit InputBlock(const std::vector<std::vector<double>>& vectors) {
+      for (const auto& vector : vectors)
+        Append(vector.data(), vector.size());
+    }
+
+    // Releases each vector once it has been copied, so memory use stays close to a single copy of the inputs
+    explicit InputBlock(std::vector<std::vector<double>>&& vectors) {
+      std::size_t total_size = 0;
+      for (const auto& vector : vectors)
+        total_size += vector.size();
+      values.reserve(total_size);
+      for (auto& vector : vectors) {
+        Append(vector.data(), vector.size());
+        std::vector<double>().swap(vector);
+      }
+    }
+
+    // Reshape to the given vector sizes, reusing the existing allocation where possible
+    void Resize(const std::vector<std::size_t>& sizes) {
+      offsets.assign(1, 0);
+      for (std::size_t size : sizes)
+        offsets.push_back(offsets.back() + size);
+      values.resize(offsets.back());
+    }
+
+    void Append(const double* data, std::size_t size) {
+      values.insert(values.end(), data, data + size);
+      offsets.push_back(values.size());
+    }
+
+    std::size_t size() const { return offsets.size() - 1; }
+    View<double> operator[](std::size_t i) { return View<double>(values.data() + offsets[i], offsets[i + 1] - offsets[i]); }
+    View<const double> operator[](std::size_t i) const { return View<const double>(values.data() + offsets[i], offsets[i + 1] - offsets[i]); }
+
+    // All vectors back to back
+    double* Data() { return values.data(); }
+    const double* Data() const { return values.data(); }
+    std::size_t TotalSize() const { return values.size(); }
+
+    std::vector<std::size_t> Sizes() const {
+      std::vector<std::size_t> sizes(size());
+      for (std::size_t i = 0; i < sizes.size(); i++)
+        sizes[i] = offsets[i + 1] - offsets[i];
+      return sizes;
+    }
+
+    std::vector<std::vector<double>> ToVectors() const {
+      std::vector<std::vector<double>> vectors(size());
+      for (std::size_t i = 0; i < vectors.size(); i++)
+        vectors[i] = (*this)[i].ToVector();
+      return vectors;
+    }
+
+  private:
+    std::vector<double> values;
+    std::vector<std::size_t> offsets = {0};
+  };
+
+  // State a model keeps across the calls of a client session, e.g. the previous solution of an iterative solver
+  // to warm-start from. Sessions are identified by a client-chosen id and dropped by the server once unused for a while.
+  class Session {
+  public:
+    explicit Session(std::string id) : id(std::move(id)) {}
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    const std::string& Id() const {
+      return id;
+    }
+
+    // Model specific state, default constructed on first access
+    template <typename State>
+    State& Get() {
+      if (!state) {
+        state = std::make_shared<State>();
+        state_type = typeid(State);
+      } else if (state_type != typeid(State)) {
+        throw std::runtime_error("Session state was created with a different type");
+      }
+      return *static_cast<State*>(state.get());
+    }
+
+  private:
+    friend class SessionScope;
+
+    std::string id;
+    std::shared_ptr<void> state;
+    std::type_index state_type = typeid(void);
+    std::mutex call_mutex; // Calls of a session are served one at a time
+  };
+
+  Session*& current_session() {
+    static thread_local Session* session = nullptr;
+    return session;
+  }
+
+  // Session of the call the model is serving on this thread, or nullptr for calls outside of a session
+  Session* CurrentSession() {
+    return current_session();
+  }
+
+  // Thrown to abandon a call that was cancelled or has run past its deadline
+  class CancelledError : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+  };
+
+  // Cancellation of a call, either explicitly by its client or by its deadline passing. Models may poll the token of
+  // the call they are serving through CurrentCancellation(), and give up early, e.g. by ThrowIfCancelled().
+  class CancellationToken {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit CancellationToken(Clock::time_point deadline = Clock::time_point::max()) : deadline(deadline) {}
+
+    CancellationToken(const CancellationToken&) = delete;
+    CancellationToken& operator=(const CancellationToken&) = delete;
+
+    bool Cancelled() const {
+      return cancelled.load() || (HasDeadline() && Clock::now() >= deadline);
+    }
+
+    void ThrowIfCancelled() const {
+      if (cancelled.load())
+        throw CancelledError("Call was cancelled");
+      if (HasDeadline() && Clock::now() >= deadline)
+        throw CancelledError("Call ran past its deadline");
+    }
+
+    bool HasDeadline() const {
+      return deadline != Clock::time_point::max();
+    }
+
+    Clock::time_point Deadline() const {
+      return deadline;
+    }
+
+    // Cancel explicitly, running the callbacks registered through OnCancel
+    void Cancel() {
+      std::map<std::size_t, std::function<void()>> pending;
+      {
+        std::lock_guard<std::mutex> lock(callbacks_mutex);
+        if (cancelled.exchange(true))
+          return;
+        pending.swap(callbacks);
+      }
+      for (auto& callback : pending)
+        callback.second();
+    }
+
+    // Run callback once the call is cancelled explicitly, right away if it already was. Deadlines passing do not
+    // trigger callbacks. Returns an id to remove the callback by; callbacks may still run after removal, so they
+    // should not refer to anything they do not own.
+    std::size_t OnCancel(std::function<void()> callback) {
+      {
+        std::lock_guard<std::mutex> lock(callbacks_mutex);
+        if (!cancelled.load()) {
+          callbacks.emplace(next_callback, std::move(callback));
+          return next_callback++;
+        }
+      }
+      callback();
+      return 0;
+    }
+
+    void RemoveCallback(std::size_t id) {
+      std::lock_guard<std::mutex> lock(callbacks_mutex);
+      callbacks.erase(id);
+    }
+
+  private:
+    Clock::time_point deadline;
+    std::atomic<bool> cancelled{false};
+    std::mutex callbacks_mutex;
+    std::map<std::size_t, std::function<void()>> callbacks;
+    std::size_t next_callback = 1;
+  };
+
+  CancellationToken*& current_cancellation() {
+    static thread_local CancellationToken* token = nullptr;
+    return token;
+  }
+
+  // Cancellation of the call the model is serving on this thread; outside of calls, a token that is never cancelled
+  const CancellationToken& CurrentCancellation() {
+    static const CancellationToken never;
+    CancellationToken* token = current_cancellation();
+    return token ? *token : never;
+  }
+
+  // Request headers carrying the id of a call, by which its client may cancel it through /Cancel, and the
+  // milliseconds left until its deadline
+  const char* const call_id_header = "X-UMBridge-Call";
+  const char* const deadline_header = "X-UMBridge-Deadline-Ms";
+
+  unsigned int& parallel_calls() {
+    static thread_local unsigned int calls = 1;
+    return calls;
+  }
+
+  // Whether a ParallelCallsScope, e.g. of a server serving a call, decides parallel_calls() on this thread
+  bool& parallel_calls_scoped() {
+    static thread_local bool scoped = false;
+    return scoped;
+  }
+
+  // Number of calls the model may serve at once on behalf of the call it is serving on this thread. Servers allowing
+  // parallel requests raise it for calls outside of a session, so that e.g. block Jacobian actions can spread their
+  // ApplyJacobian calls over several threads.
+  class ParallelCallsScope {
+  public:
+    explicit ParallelCallsScope(unsigned int calls) : previous(parallel_calls()), previous_scoped(parallel_calls_scoped()) {
+      parallel_calls() = std::max(1u, calls);
+      parallel_calls_scoped() = true;
+    }
+
+    ParallelCallsScope(const ParallelCallsScope&) = delete;
+    ParallelCallsScope& operator=(const ParallelCallsScope&) = delete;
+
+    ~ParallelCallsScope() {
+      parallel_calls() = previous;
+      parallel_calls_scoped() = previous_scoped;
+    }
+
+  private:
+    unsigned int previous;
+    bool previous_scoped;
+  };
+
+  // Cancellation and session of the call served on the thread it is created on, to be installed on threads working on
+  // behalf of that call
+  struct CallContext {
+    CancellationToken* cancellation = current_cancellation();
+    Session* session = current_session();
+
+    void Install() const {
+      current_cancellation() = cancellation;
+      current_session() = session;
+    }
+  };
+
+  // Call body(i) for each i in [0, count) from up to parallel_calls() threads, rethrowing the first exception thrown.
+  // The other threads serve the same call as this one, see CallContext.
+  void parallel_for(std::size_t count, const std::function<void(std::size_t)>& body) {
+    CallContext context;
+    std::atomic<std::size_t> next{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto work = [&]() {
+      try {
+        for (std::size_t i = next++; i < count; i = next++)
+          body(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        next = count;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < std::min<std::size_t>(count, parallel_calls()); i++)
+      threads.emplace_back([&]() {
+        context.Install();
+        work();
+      });
+    work();
+    for (auto& thread : threads)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // Jacobian of one model output with respect to one model input, either dense with values in row-major order, or
+  // sparse in compressed sparse row (CSR) format
+  struct JacobianMatrix {
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    bool sparse = false;
+    std::vector<double> values;
+    std::vector<std::size_t> row_offsets;    // CSR only: entries of row i are at row_offsets[i] to row_offsets[i+1]
+    std::vector<std::size_t> column_indices; // CSR only: column of each entry
+
+    // Zero-initialized dense matrix
+    static JacobianMatrix Dense(std::size_t rows, std::size_t cols) {
+      return Dense(rows, cols, std::vector<double>(rows * cols, 0.0));
+    }
+
+    static JacobianMatrix Dense(std::size_t rows, std::size_t cols, std::vector<double> values) {
+      JacobianMatrix matrix;
+      matrix.rows = rows;
+      matrix.cols = cols;
+      matrix.values = std::move(values);
+      return matrix;
+    }
+
+    static JacobianMatrix Sparse(std::size_t rows, std::size_t cols, std::vector<std::size_t> row_offsets,
+                                 std::vector<std::size_t> column_indices, std::vector<double> values) {
+      JacobianMatrix matrix;
+      matrix.rows = rows;
+      matrix.cols = cols;
+      matrix.sparse = true;
+      matrix.row_offsets = std::move(row_offsets);
+      matrix.column_indices = std::move(column_indices);
+      matrix.values = std::move(values);
+      return matrix;
+    }
+
+    // Entry at (row, col), zero if not stored in a sparse matrix
+    double At(std::size_t row, std::size_t col) const {
+      if (!sparse)
+        return values[row * cols + col];
+      for (std::size_t i = row_offsets[row]; i < row_offsets[row + 1]; i++)
+        if (column_indices[i] == col)
+          return values[i];
+      return 0.0;
+    }
+
+    // All entries in row-major order
+    std::vector<double> DenseValues() const {
+      if (!sparse)
+        return values;
+      std::vector<double> dense(rows * cols, 0.0);
+      for (std::size_t row = 0; row < rows; row++)
+        for (std::size_t i = row_offsets[row]; i < row_offsets[row + 1]; i++)
+          dense[row * cols + column_indices[i]] = values[i];
+      return dense;
+    }
+
+    // Empty if the matrix is well-formed, otherwise a description of what is wrong with it
+    std::string Validate() const {
+      if (!sparse) {
+        if (values.size() != rows * cols)
+          return "Dense Jacobian of size " + std::to_string(rows) + "x" + std::to_string(cols) + " has " + std::to_string(values.size()) + " entries";
+        return std::string();
+      }
+      if (row_offsets.size() != rows + 1 || row_offsets.front() != 0 || row_offsets.back() != values.size())
+        return "Sparse Jacobian has invalid row offsets";
+      if (column_indices.size() != values.size())
+        return "Sparse Jacobian has " + std::to_string(column_indices.size()) + " column indices for " + std::to_string(values.size()) + " entries";
+      for (std::size_t row = 0; row < rows; row++)
+        if (row_offsets[row] > row_offsets[row + 1])
+          return "Sparse Jacobian has decreasing row offsets";
+      for (std::size_t col : column_indices)
+        if (col >= cols)
+          return "Sparse Jacobian has column index " + std::to_string(col) + " out of range for " + std::to_string(cols) + " columns";
+      return std::string();
+    }
+  };
+
   class Model {
   public:
     Model(std::string name) : name(name) {}
@@ -41,6 +458,28 @@ namespace umbridge {
       throw std::runtime_error("Evaluate was called, but not implemented by model!");
     }
 
+    // Like Evaluate and Gradient, but writing into existing vectors so that repeated calls may reuse their memory.
+    // A null config stands for an empty one.
+    virtual void EvaluateInto(const std::vector<std::vector<double>>& inputs, std::vector<std::vector<double>>& outputs,
+                              const json& config_json = json()) {
+      outputs = Evaluate(inputs, config_json.is_null() ? json::object() : config_json);
+    }
+
+    virtual void GradientInto(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              std::vector<double>& gradient,
+                              const json& config_json = json()) {
+      gradient = Gradient(outWrt, inWrt, inputs, sens, config_json.is_null() ? json::object() : config_json);
+    }
+
+    // Evaluate on inputs stored in one contiguous block. Models working on a single flat parameter array may override
+    // this along with PrefersInputBlock; by default the inputs are unpacked and passed on to Evaluate.
+    virtual std::vector<std::vector<double>> EvaluateBlock(const InputBlock& inputs, json config_json = json::parse("{}")) {
+      return Evaluate(inputs.ToVectors(), config_json);
+    }
+
     virtual std::vector<double> Gradient(unsigned int outWrt,
                           unsigned int inWrt,
                           const std::vector<std::vector<double>>& inputs,
@@ -70,19 +509,164 @@ namespace umbridge {
       throw std::runtime_error("ApplyHessian was called, but not implemented by model!");
     }
 
+    // Jacobian action on several vectors at the same inputs, one result per vector. Models may override this to
+    // reuse their linearization (e.g. a factorization) across the vectors. By default, the vectors are spread over
+    // parallel_calls() threads.
+    virtual std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) {
+      std::vector<std::vector<double>> results(vecs.size());
+      parallel_for(vecs.size(), [&](std::size_t i) {
+        results[i] = ApplyJacobian(outWrt, inWrt, inputs, vecs[i], config_json);
+      });
+      return results;
+    }
+
+    // Hessian action on several vectors at the same inputs and sensitivity, one result per vector
+    virtual std::vector<std::vector<double>> ApplyHessianBlock(unsigned int outWrt,
+                              unsigned int inWrt1,
+                              unsigned int inWrt2,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) {
+      std::vector<std::vector<double>> results(vecs.size());
+      parallel_for(vecs.size(), [&](std::size_t i) {
+        results[i] = ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vecs[i], config_json);
+      });
+      return results;
+    }
+
+    // Full Jacobian of output outWrt with respect to input inWrt. By default, it is assembled column by column from
+    // ApplyJacobianBlock on unit vectors.
+    virtual JacobianMatrix Jacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              json config_json = json::parse("{}")) {
+      const std::size_t rows = GetOutputSizes(config_json).at(outWrt);
+      const std::size_t cols = GetInputSizes(config_json).at(inWrt);
+      const std::size_t columns_per_call = 64; // Bounds the memory taken by unit vectors
+      JacobianMatrix jacobian = JacobianMatrix::Dense(rows, cols);
+
+      for (std::size_t begin = 0; begin < cols; begin += columns_per_call) {
+        std::size_t end = std::min(cols, begin + columns_per_call);
+        std::vector<std::vector<double>> unit_vectors(end - begin, std::vector<double>(cols, 0.0));
+        for (std::size_t col = begin; col < end; col++)
+          unit_vectors[col - begin][col] = 1.0;
+        std::vector<std::vector<double>> columns = ApplyJacobianBlock(outWrt, inWrt, inputs, unit_vectors, config_json);
+        if (columns.size() != end - begin)
+          throw std::runtime_error("ApplyJacobianBlock returned " + std::to_string(columns.size()) + " results for " + std::to_string(end - begin) + " vectors");
+        for (std::size_t col = begin; col < end; col++) {
+          if (columns[col - begin].size() != rows)
+            throw std::runtime_error("Jacobian action has size " + std::to_string(columns[col - begin].size()) + ", expected " + std::to_string(rows));
+          for (std::size_t row = 0; row < rows; row++)
+            jacobian.values[row * cols + col] = columns[col - begin][row];
+        }
+      }
+      return jacobian;
+    }
+
+    // Model output along with the gradient of Gradient(outWrt, inWrt, inputs, sens) at the same inputs.
+    // Models computing gradients by adjoints may override this to reuse the forward solve.
+    virtual std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              json config_json = json::parse("{}")) {
+      std::vector<std::vector<double>> outputs = Evaluate(inputs, config_json);
+      return {std::move(outputs), Gradient(outWrt, inWrt, inputs, sens, config_json)};
+    }
+
     virtual bool SupportsEvaluate() {return false;}
     virtual bool SupportsGradient() {return false;}
     virtual bool SupportsApplyJacobian() {return false;}
     virtual bool SupportsApplyHessian() {return false;}
 
+    // Whether servers should call EvaluateBlock rather than Evaluate
+    virtual bool PrefersInputBlock() const {return false;}
+
+    // Whether Evaluate only depends on its inputs and config. Servers then evaluate identical requests arriving
+    // while one of them is still being evaluated only once. Stochastic models and models with hidden state must
+    // not claim this.
+    virtual bool IsDeterministic() const {return false;}
+
+    // Called by servers when a client closes the current session (see CurrentSession), before its state is released.
+    // Models passing calls on to other servers, e.g. a load balancer, close the session there as well.
+    virtual void CloseSession() {}
+
     std::string GetName() const {return name;}
 
   protected:
     std::string name;
   };
 
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+  // When built with CPPHTTPLIB_ZLIB_SUPPORT (and linked against zlib), requests of at least this many bytes are gzip
+  // compressed if the server advertises that it accepts them. Smaller ones are sent as they are since compressing them
+  // barely saves any time.
+  const std::size_t request_compression_min_bytes = 16384;
+
+  // gzip compress data at the fastest level, which shrinks text encoded doubles nearly as much as the default one at
+  // about four times the speed. Returns false, leaving compressed empty, if zlib fails.
+  bool gzip_compress(const std::string& data, std::string& compressed) {
+    const std::size_t chunk_size = 1 << 20; // Keeps zlib's 32 bit counters in range for large bodies
+    compressed.clear();
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    std::size_t position = 0;
+    int flush = Z_NO_FLUSH;
+    int result = Z_OK;
+    while (flush != Z_FINISH && result != Z_STREAM_ERROR) {
+      std::size_t length = std::min(chunk_size, data.size() - position);
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + position));
+      stream.avail_in = static_cast<uInt>(length);
+      position += length;
+      flush = position == data.size() ? Z_FINISH : Z_NO_FLUSH;
+      do {
+        std::size_t written = compressed.size();
+        compressed.resize(written + chunk_size);
+        stream.next_out = reinterpret_cast<Bytef*>(&compressed[written]);
+        stream.avail_out = static_cast<uInt>(chunk_size);
+        result = deflate(&stream, flush);
+        compressed.resize(written + chunk_size - stream.avail_out);
+      } while (stream.avail_out == 0 && result != Z_STREAM_ERROR);
+    }
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+      compressed.clear();
+    return result == Z_STREAM_END;
+  }
+#endif
+
+#ifdef SUPPORT_UNIX_SOCKET
+  // Path of the Unix domain socket addressed by a unix:///path/to/socket URL, empty for any other URL
+  std::string unix_socket_path_from_url(const std::string& host) {
+    const std::string unix_scheme = "unix://";
+    if (host.rfind(unix_scheme, 0) == 0)
+      return host.substr(unix_scheme.length());
+    return "";
+  }
+#endif
+
+  // Create an HTTP client for the given host URL.
+  // URLs of the form unix:///path/to/socket connect through a Unix domain socket instead of TCP.
+  httplib::Client create_client(const std::string& host) {
+#ifdef SUPPORT_UNIX_SOCKET
+    std::string unix_socket_path = unix_socket_path_from_url(host);
+    if (!unix_socket_path.empty()) {
+      httplib::Client cli(unix_socket_path, 80);
+      cli.set_address_family(AF_UNIX);
+      return cli;
+    }
+#endif
+    return httplib::Client(host.c_str());
+  }
+
   std::vector<std::string> SupportedModels(std::string host, httplib::Headers headers = httplib::Headers()) {
-    httplib::Client cli(host.c_str());
+    httplib::Client cli = create_client(host);
     if (auto res = cli.Get("/Info", headers)) {
       json response = json::parse(res->body);
 
@@ -96,11 +680,20 @@ namespace umbridge {
     }
   }
 
+  // Tuning of the memory backing shared memory vectors, intended for very large inputs and outputs
+  struct SharedMemoryOptions {
+    bool huge_pages = false; // Back vectors of at least huge_page_size bytes by huge pages, falling back to regular pages if none are available
+    bool populate = false;   // Pre-fault mappings (MAP_POPULATE) rather than paying for page faults on first access
+  };
+
+  // Vectors below this size gain nothing from huge pages
+  const std::size_t huge_page_size = 2 * 1024 * 1024;
+
 #ifdef SUPPORT_POSIX_SHMEM
   class SharedMemoryVector
   {
   public:
-    SharedMemoryVector(std::size_t size, std::string shmem_name, bool create)
+    SharedMemoryVector(std::size_t size, std::string shmem_name, bool create, SharedMemoryOptions options = SharedMemoryOptions())
         : length(size * sizeof(double)), shmem_name(shmem_name) {
       int oflags = O_RDWR;
       if (create) {
@@ -114,436 +707,5033 @@ namespace umbridge {
         throw std::runtime_error("Shared Memory object could not be created or found by name");
       }
 
-      ptr = (u_char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); // Map shared memory to process
+      Map(fd, options);
       close(fd);
-
-      assert(ptr);
     }
 
-    SharedMemoryVector(const std::vector<double>& vector, std::string shmem_name)
-        : SharedMemoryVector(vector.size(), shmem_name, true) {
+    SharedMemoryVector(const std::vector<double>& vector, std::string shmem_name, SharedMemoryOptions options = SharedMemoryOptions())
+        : SharedMemoryVector(vector.size(), shmem_name, true, options) {
       SetVector(vector);
     }
 
+#ifdef SUPPORT_MEMFD
+    // Anonymous shared memory, to be handed to another process by passing GetFd() over a Unix domain socket.
+    // Freed by the kernel once no process holds a descriptor or mapping anymore, even if a process crashes.
+    explicit SharedMemoryVector(std::size_t size, SharedMemoryOptions options = SharedMemoryOptions())
+        : length(size * sizeof(double)) {
+      if (options.huge_pages && static_cast<std::size_t>(length) >= huge_page_size) {
+        // Explicit huge pages need a reserved pool (vm.nr_hugepages); mapping fails right away if it is exhausted
+        fd = memfd_create("umbridge", MFD_CLOEXEC | MFD_HUGETLB);
+        struct stat fd_stat;
+        if (fd >= 0 && (fstat(fd, &fd_stat) != 0 || ftruncate(fd, RoundUp(length, fd_stat.st_blksize)) != 0 || !TryMap(fd, options))) {
+          close(fd);
+          fd = -1;
+        }
+      }
+      if (fd < 0) {
+        fd = memfd_create("umbridge", MFD_CLOEXEC);
+        if (fd < 0) {
+          throw std::runtime_error("memfd could not be created");
+        }
+        if (ftruncate(fd, length) != 0) {
+          close(fd);
+          throw std::runtime_error("memfd could not be resized");
+        }
+        Map(fd, options);
+      }
+    }
+
+    // Map a file descriptor received from another process. Takes ownership of the descriptor.
+    SharedMemoryVector(std::size_t size, int received_fd, SharedMemoryOptions options = SharedMemoryOptions())
+        : length(size * sizeof(double)) {
+      try {
+        Map(received_fd, options);
+      } catch (...) {
+        close(received_fd);
+        throw;
+      }
+      close(received_fd);
+    }
+
+    int GetFd() const {
+      return fd;
+    }
+#endif
+
     std::vector<double> GetVector() {
       std::vector<double> vector(length / sizeof(double));
-      memcpy(vector.data(), ptr, length);
+      Read(vector.data());
       return vector;
     }
 
     void SetVector(const std::vector<double>& vector) {
-      memcpy(ptr, vector.data(), length);
+      Write(vector.data());
+    }
+
+    // Copy the contents to or from a buffer of matching size
+    void Read(double* destination) const {
+      if (length > 0)
+        memcpy(destination, ptr, length);
+    }
+
+    void Write(const double* source) {
+      if (length > 0)
+        memcpy(ptr, source, length);
     }
 
     ~SharedMemoryVector() {
-      munmap(ptr, length);
+      if (ptr)
+        munmap(ptr, mapped_length);
+      if (fd >= 0)
+        close(fd);
       if (created)
         shm_unlink(shmem_name.c_str());
     }
 
   private:
+    static off_t RoundUp(off_t value, off_t granularity) {
+      return (value + granularity - 1) / granularity * granularity;
+    }
+
+    void Map(int map_fd, const SharedMemoryOptions& options) {
+      if (!TryMap(map_fd, options)) {
+        throw std::runtime_error("Shared Memory object could not be mapped");
+      }
+    }
+
+    bool TryMap(int map_fd, const SharedMemoryOptions& options) {
+      if (length == 0) // mmap rejects empty mappings; empty vectors need no memory
+        return true;
+      // Files on hugetlbfs can only be mapped in whole huge pages, which their block size reflects
+      struct stat fd_stat;
+      mapped_length = length;
+      if (fstat(map_fd, &fd_stat) == 0 && fd_stat.st_blksize > 0)
+        mapped_length = RoundUp(length, fd_stat.st_blksize);
+
+      int flags = MAP_SHARED;
+      if (options.populate)
+        flags |= MAP_POPULATE;
+      void* mapping = mmap(NULL, mapped_length, PROT_READ | PROT_WRITE, flags, map_fd, 0); // Map shared memory to process
+      if (mapping == MAP_FAILED)
+        return false;
+      // Transparent huge pages as fallback for regular shared memory. Best effort, depends on the shmem_enabled setting of the kernel.
+      if (options.huge_pages && static_cast<std::size_t>(length) >= huge_page_size)
+        madvise(mapping, mapped_length, MADV_HUGEPAGE);
+      ptr = static_cast<u_char *>(mapping);
+      return true;
+    }
+
     bool created = false;
     u_char *ptr = nullptr;
     off_t length = 0;
+    off_t mapped_length = 0;
+    int fd = -1;
     std::string shmem_name;
   };
-#endif
-
-  // Client-side Model connecting to a server for the actual evaluations etc.
-  class HTTPModel : public Model {
-  public:
 
-    HTTPModel(std::string host, std::string name, bool useShMem = false, httplib::Headers headers = httplib::Headers())
-    : Model(name), cli(host.c_str()), headers(headers)
-    {
-      // Check if requested model is available on server
-      std::vector<std::string> models = SupportedModels(host, headers);
-      if (std::find(models.begin(), models.end(), name) == models.end()) {
-        std::string model_names = "";
-        for (auto& m : models) {
-          model_names += "'" + m + "' ";
-        }
-        throw std::runtime_error("Model " + name + " not found on server! Available models: " + model_names + ".");
-      }
+  // Process-wide call counter, so that concurrent calls never share shared memory segment names
+  unsigned long next_shmem_sequence() {
+    static std::atomic<unsigned long> sequence{0};
+    return sequence++;
+  }
 
-      json request_body;
-      request_body["name"] = name;
+  // Namespace for the shared memory segments of one client: process id plus random nonce.
+  // Keeps clients in different processes on the same node (or sharing a PID namespace) apart.
+  std::string unique_shmem_prefix() {
+    std::random_device rd;
+    unsigned long long nonce = (static_cast<unsigned long long>(rd()) << 32) | rd();
+    std::ostringstream prefix;
+    prefix << "/umbridge_" << getpid() << "_" << std::hex << nonce;
+    return prefix.str();
+  }
 
-      if (auto res = cli.Post("/ModelInfo", headers, request_body.dump(), "application/json")) {
-        json response = json::parse(res->body);
+#ifdef SUPPORT_MEMFD
+  // SCM_RIGHTS messages are limited in the number of descriptors they may carry (SCM_MAX_FD)
+  const std::size_t max_fds_per_message = 250;
+
+  // Send a token plus file descriptors as one message on a SOCK_SEQPACKET Unix domain socket
+  bool send_fds(int sock, const std::string& token, const std::vector<int>& fds) {
+    iovec iov;
+    iov.iov_base = const_cast<char*>(token.data());
+    iov.iov_len = token.size();
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+      msg.msg_control = control.data();
+      msg.msg_controllen = control.size();
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+      memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(token.size());
+  }
 
-        json supported_features = response.at("support");
-        supportsEvaluate = supported_features.value("Evaluate", false);
-        supportsGradient = supported_features.value("Gradient", false);
-        supportsApplyJacobian = supported_features.value("ApplyJacobian", false);
-        supportsApplyHessian = supported_features.value("ApplyHessian", false);
-        
-      } else {
-        throw std::runtime_error("POST ModelInfo failed with error type '" + to_string(res.error()) + "'");
-      }
-#ifdef SUPPORT_POSIX_SHMEM
-      // Test whether client and server are able to communicate through shared memory. Disables ShMem if test fails.
-      if (useShMem) {
-        unsigned long int tid = pthread_self();
-        request_body["tid"] = std::to_string(tid);
-        std::vector<double> testvec = {12345.0};
-        SharedMemoryVector shmem_input(testvec, "/umbridge_test_shmem_in_" + std::to_string(tid));
-        SharedMemoryVector shmem_output(1, "/umbridge_test_shmem_out_" + std::to_string(tid), true);
-        auto res = cli.Post("/TestShMem", headers, request_body.dump(), "application/json");
-
-        if (shmem_output.GetVector()[0] != testvec[0]) {
-          std::cout << "Server not accessible via shared memory. Using HTTP instead." << std::endl;
-        } else {
-          supportsShMem = true;
-          std::cout << "Server accessible via shared memory" << std::endl;
-        }
+  // Receive a message sent by send_fds. Returns false once the peer closed the connection.
+  bool receive_fds(int sock, std::string& token, std::vector<int>& fds) {
+    std::vector<char> buffer(256);
+    iovec iov;
+    iov.iov_base = buffer.data();
+    iov.iov_len = buffer.size();
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * max_fds_per_message));
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (received <= 0)
+      return false;
+    token.assign(buffer.data(), received);
+
+    fds.clear();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::size_t offset = fds.size();
+        fds.resize(offset + count);
+        memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(int) * count);
       }
-#endif
     }
+    return true;
+  }
 
-    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
-
-      json request_body;
-      request_body["name"] = name;
-      if (!config_json.empty())
-        request_body["config"] = config_json;
+  // The memfd side channel of a server listening on a Unix domain socket lives next to the socket itself
+  std::string memfd_socket_path(const std::string& unix_socket_path) {
+    return unix_socket_path + ".fd";
+  }
 
-      if (auto res = cli.Post("/InputSizes", headers, request_body.dump(), "application/json")) {
-        json response_body = parse_result_with_error_handling(res);
-        std::vector<std::size_t> outputvec = response_body["inputSizes"].get<std::vector<std::size_t>>();
-        return outputvec;
-      } else {
-        throw std::runtime_error("POST InputSizes failed with error type '" + to_string(res.error()) + "'");
-        return std::vector<std::size_t>(0);
+  // Client end of the memfd side channel: hands over the buffers of a call before the HTTP request referencing them is sent.
+  class MemfdChannel {
+  public:
+    explicit MemfdChannel(const std::string& path) {
+      sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (sock < 0 || path.size() >= sizeof(addr.sun_path)) {
+        Close();
+        throw std::runtime_error("Could not create memfd channel for '" + path + "'");
+      }
+      std::copy(path.begin(), path.end(), addr.sun_path);
+      if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        Close();
+        throw std::runtime_error("Could not connect memfd channel to '" + path + "'");
       }
     }
 
-    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+    MemfdChannel(const MemfdChannel&) = delete;
+    MemfdChannel& operator=(const MemfdChannel&) = delete;
 
-      json request_body;
-      request_body["name"] = name;
-      if (!config_json.empty())
-        request_body["config"] = config_json;
+    ~MemfdChannel() {
+      Close();
+    }
 
-      if (auto res = cli.Post("/OutputSizes", headers, request_body.dump(), "application/json")) {
-        json response_body = parse_result_with_error_handling(res);
-        std::vector<std::size_t> outputvec = response_body["outputSizes"].get<std::vector<std::size_t>>();
-        return outputvec;
-      } else {
-        throw std::runtime_error("POST OutputSizes failed with error type '" + to_string(res.error()) + "'");
-        return std::vector<std::size_t>(0);
+    // Blocks until the server acknowledged receipt, so that a subsequent request can rely on the buffers being there
+    void Send(const std::string& token, const std::vector<int>& fds) {
+      std::lock_guard<std::mutex> lock(channel_mutex);
+      for (std::size_t offset = 0; offset == 0 || offset < fds.size(); offset += max_fds_per_message) {
+        std::vector<int> chunk(fds.begin() + offset, fds.begin() + std::min(fds.size(), offset + max_fds_per_message));
+        char ack = 0;
+        if (!send_fds(sock, token, chunk) || recv(sock, &ack, 1, 0) != 1)
+          throw std::runtime_error("Passing memfd buffers to server failed");
       }
     }
 
-    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
-#ifdef SUPPORT_POSIX_SHMEM
-      if (supportsShMem) {
-        unsigned int tid = pthread_self();
-        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
-        for (int i = 0; i < inputs.size(); i++) {
-          if (inputs[i].size() > 0) { // Handles edges with empty vector
-            shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(inputs[i], "/umbridge_in_" + std::to_string(tid) + "_" + std::to_string(i)));
-          }
-        }
-        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
-        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
-        for (int i = 0; i < output_sizes.size(); i++) {
-          shmem_outputs.push_back(std::make_unique<SharedMemoryVector>(output_sizes[i], "/umbridge_out_" + std::to_string(tid) + "_" + std::to_string(i), true));
-        }
+  private:
+    void Close() {
+      if (sock >= 0)
+        close(sock);
+      sock = -1;
+    }
 
-        json request_body;
-        request_body["tid"] = std::to_string(tid);
-        request_body["name"] = name;
-        request_body["config"] = config_json;
-        request_body["shmem_name"] = "/umbridge";
-        request_body["shmem_num_inputs"] = inputs.size();
-        for (int i = 0; i < inputs.size(); i++) {
-          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+    int sock = -1;
+    std::mutex channel_mutex;
+  };
+
+  // Server-side store of file descriptors received through the memfd side channel, until a request claims them by token.
+  // Descriptors not claimed within ttl, e.g. because the client gave up on the request, are closed on the next Put or
+  // Take, and along with the connection that sent them.
+  class FdMailbox {
+  public:
+    explicit FdMailbox(std::chrono::steady_clock::duration ttl = std::chrono::minutes(1)) : ttl(ttl) {}
+
+    FdMailbox(const FdMailbox&) = delete;
+    FdMailbox& operator=(const FdMailbox&) = delete;
+
+    ~FdMailbox() {
+      for (auto& [token, letter] : mailbox)
+        for (int fd : letter.fds)
+          close(fd);
+    }
+
+    void Put(const std::string& token, const std::vector<int>& fds, unsigned long connection) {
+      std::lock_guard<std::mutex> lock(mailbox_mutex);
+      DiscardExpired();
+      Letter& letter = mailbox[token];
+      letter.fds.insert(letter.fds.end(), fds.begin(), fds.end());
+      letter.connection = connection;
+      letter.received = std::chrono::steady_clock::now();
+    }
+
+    std::vector<int> Take(const std::string& token) {
+      std::lock_guard<std::mutex> lock(mailbox_mutex);
+      DiscardExpired();
+      auto it = mailbox.find(token);
+      if (it == mailbox.end())
+        throw std::runtime_error("No memfd buffers received for token '" + token + "'");
+      std::vector<int> fds = std::move(it->second.fds);
+      mailbox.erase(it);
+      return fds;
+    }
+
+    // Drop buffers a connection sent but never claimed, e.g. because the client died before sending its request
+    void DiscardConnection(unsigned long connection) {
+      std::lock_guard<std::mutex> lock(mailbox_mutex);
+      for (auto it = mailbox.begin(); it != mailbox.end();) {
+        if (it->second.connection == connection) {
+          for (int fd : it->second.fds)
+            close(fd);
+          it = mailbox.erase(it);
+        } else {
+          ++it;
         }
-        if (auto res = cli.Post("/EvaluateShMem", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+      }
+    }
 
-          std::vector<std::vector<double>> outputs(output_sizes.size());
-          for (int i = 0; i < output_sizes.size(); i++) {
-            outputs[i] = shmem_outputs[i]->GetVector();
-          }
-          return outputs;
+  private:
+    struct Letter {
+      std::vector<int> fds;
+      unsigned long connection = 0;
+      std::chrono::steady_clock::time_point received;
+    };
+
+    void DiscardExpired() {
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = mailbox.begin(); it != mailbox.end();) {
+        if (now - it->second.received >= ttl) {
+          for (int fd : it->second.fds)
+            close(fd);
+          it = mailbox.erase(it);
         } else {
-          throw std::runtime_error("POST Evaluate failed with error type '" + to_string(res.error()) + "'");
+          ++it;
         }
-      } else {
-#endif
-        json request_body;
-        request_body["name"] = name;
+      }
+    }
 
-      request_body["input"] = json::parse("[]");
-      for (std::size_t i = 0; i < inputs.size(); i++) {
-        request_body["input"][i] = inputs[i];
+    std::chrono::steady_clock::duration ttl;
+    std::map<std::string, Letter> mailbox;
+    std::mutex mailbox_mutex;
+  };
+
+  // Server end of the memfd side channel. Accepts client connections and files the received descriptors in a mailbox.
+  class MemfdListener {
+  public:
+    MemfdListener(const std::string& path, std::shared_ptr<FdMailbox> mailbox)
+        : path(path), mailbox(mailbox) {
+      listen_sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (listen_sock < 0 || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Could not create memfd socket '" + path + "'");
+      std::copy(path.begin(), path.end(), addr.sun_path);
+      unlink(path.c_str()); // Remove stale socket file left behind by a previous run
+      if (bind(listen_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_sock, SOMAXCONN) != 0) {
+        close(listen_sock);
+        throw std::runtime_error("Could not listen on memfd socket '" + path + "'");
       }
-      request_body["config"] = config_json;
+      accept_thread = std::thread([this]() { AcceptConnections(); });
+    }
 
-        if (auto res = cli.Post("/Evaluate", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+    // Shuts down all client connections and waits for their threads
+    ~MemfdListener() {
+      shutdown(listen_sock, SHUT_RDWR);
+      accept_thread.join();
+      close(listen_sock);
+      unlink(path.c_str());
+      std::lock_guard<std::mutex> lock(connections_mutex);
+      for (Connection& connection : connections)
+        shutdown(connection.sock, SHUT_RDWR);
+      while (!connections.empty())
+        Reap(connections.begin());
+    }
 
-          std::vector<std::vector<double>> outputs(response_body["output"].size());
-          for (std::size_t i = 0; i < response_body["output"].size(); i++) {
-            outputs[i] = response_body["output"][i].get<std::vector<double>>();
-          }
-          return outputs;
-        } else {
-          throw std::runtime_error("POST Evaluate failed with error type '" + to_string(res.error()) + "'");
+  private:
+    // Connections are long-lived (one per client), so each gets its own thread. Its socket is closed once the thread
+    // has been joined, so that shutting it down from the destructor cannot hit a reused descriptor.
+    struct Connection {
+      int sock;
+      std::thread thread;
+      std::atomic<bool> done{false};
+    };
+
+    void AcceptConnections() {
+      while (true) {
+        int conn = accept4(listen_sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          return; // Listening socket shut down
         }
-#ifdef SUPPORT_POSIX_SHMEM
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        for (auto it = connections.begin(); it != connections.end();)
+          it = it->done ? Reap(it) : std::next(it);
+        Connection& connection = connections.emplace_back();
+        connection.sock = conn;
+        connection.thread = std::thread([this, &connection, id = next_connection++]() {
+          std::string token;
+          std::vector<int> fds;
+          while (receive_fds(connection.sock, token, fds)) {
+            mailbox->Put(token, fds, id);
+            char ack = 1;
+            if (send(connection.sock, &ack, 1, MSG_NOSIGNAL) != 1)
+              break;
+          }
+          mailbox->DiscardConnection(id);
+          connection.done = true;
+        });
       }
+    }
+
+    std::list<Connection>::iterator Reap(std::list<Connection>::iterator connection) {
+      connection->thread.join();
+      close(connection->sock);
+      return connections.erase(connection);
+    }
+
+    std::string path;
+    std::shared_ptr<FdMailbox> mailbox;
+    int listen_sock = -1;
+    unsigned long next_connection = 0;
+    std::mutex connections_mutex;
+    std::list<Connection> connections;
+    std::thread accept_thread;
+  };
+#endif
 #endif
+
+  // Keys of the numeric arrays in request and response bodies
+  bool is_numeric_key(const std::string& key) {
+    return key == "input" || key == "output" || key == "sens" || key == "vec" || key == "vecs" || key == "gradient"
+        || key == "values" || key == "rowOffsets" || key == "columnIndices";
+  }
+
+  // Request or response body of an evaluation call. The numeric arrays (input, output, sens, vec, vecs, gradient and the
+  // entries of a Jacobian) are kept as std::vectors, all remaining fields (name, config, inWrt, error, ...) as json.
+  struct MessageBody {
+    json fields;
+    std::map<std::string, std::vector<std::vector<double>>> vectors; // Arrays of arrays, e.g. "input"
+    std::map<std::string, std::vector<double>> vector;               // Flat arrays, e.g. "sens"
+
+    // A missing list of vectors is treated as empty, in line with request_body["input"].size() == 0
+    std::vector<std::vector<double>>& Vectors(const std::string& key) {
+      return vectors[key];
     }
 
-    std::vector<double> Gradient(unsigned int outWrt,
-                  unsigned int inWrt,
-                  const std::vector<std::vector<double>>& inputs,
-                  const std::vector<double>& sens,
-                  json config_json = json::parse("{}")) override
-    {
+    std::vector<double>& Vector(const std::string& key) {
+      auto it = vector.find(key);
+      if (it == vector.end())
+        throw std::runtime_error("Message body has no numeric array '" + key + "'");
+      return it->second;
+    }
+  };
 
-#ifdef SUPPORT_POSIX_SHMEM
-      if (supportsShMem) {
-        unsigned int tid = pthread_self();
-        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
-        for (int i = 0; i < inputs.size(); i++) {
-          shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(inputs[i], "/umbridge_in_" + std::to_string(tid) + "_" + std::to_string(i)));
-        }
-        SharedMemoryVector shmem_output(inputs[inWrt].size(), "/umbridge_out_" + std::to_string(tid) + "_" + std::to_string(0), true);
+  // Jacobian written by MessageBodyWriter::Jacobian. Throws if it is malformed, e.g. with indices out of range.
+  JacobianMatrix read_jacobian(MessageBody& body) {
+    auto to_index = [](double number) {
+      if (!(number >= 0 && number <= 9007199254740992.0 && number == std::floor(number))) // Integers exact in a double
+        throw std::runtime_error("Jacobian has invalid size or index " + std::to_string(number));
+      return static_cast<std::size_t>(number);
+    };
+    auto to_indices = [&](const std::vector<double>& numbers) {
+      std::vector<std::size_t> indices(numbers.size());
+      std::transform(numbers.begin(), numbers.end(), indices.begin(), to_index);
+      return indices;
+    };
+    std::size_t rows = to_index(body.fields.at("rows").get<double>());
+    std::size_t cols = to_index(body.fields.at("cols").get<double>());
+    JacobianMatrix jacobian = body.fields.value("format", std::string("dense")) != "csr"
+      ? JacobianMatrix::Dense(rows, cols, std::move(body.Vector("values")))
+      : JacobianMatrix::Sparse(rows, cols, to_indices(body.Vector("rowOffsets")), to_indices(body.Vector("columnIndices")), std::move(body.Vector("values")));
+    std::string error = jacobian.Validate();
+    if (!error.empty())
+      throw std::runtime_error(error);
+    return jacobian;
+  }
 
-        json request_body;
-        request_body["tid"] = std::to_string(tid);
-        request_body["name"] = name;
-        request_body["config"] = config_json;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt"] = inWrt;
-        request_body["shmem_name"] = "/umbridge";
-        request_body["sens"] = sens;
-        request_body["shmem_num_inputs"] = inputs.size();
-        for (int i = 0; i < inputs.size(); i++) {
-          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
-        }
-        if (auto res = cli.Post("/GradientShMem", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+  // Builds a message body with numeric arrays formatted directly into the output string (shortest round-trip
+  // representation via std::to_chars), skipping the intermediate json tree. Other fields are dumped by json.
+  // As in json's own output, integral values keep a trailing ".0" and NaN and infinities become null.
+  class MessageBodyWriter {
+  public:
+    MessageBodyWriter() = default;
 
-          std::vector<double> output(inputs[inWrt].size());
-          output = shmem_output.GetVector();
-          return output;
-        } else {
-          throw std::runtime_error("POST Gradient failed with error type '" + to_string(res.error()) + "'");
-        }
+    // Write into the given string, reusing its memory
+    explicit MessageBodyWriter(std::string buffer) : body(std::move(buffer)) {
+      body.assign(1, '{');
+    }
+
+    // Hand the body to sink in pieces of about chunk_size bytes while it is being written, e.g. to stream a response
+    MessageBodyWriter(std::function<bool(const char*, std::size_t)> sink, std::size_t chunk_size)
+    : sink(std::move(sink)), chunk_size(chunk_size) {}
+
+    MessageBodyWriter& Field(const std::string& key, const json& value) {
+      AppendKey(key);
+      body += value.dump();
+      return *this;
+    }
+
+    MessageBodyWriter& Field(const std::string& key, const std::string& value) {
+      AppendKey(key);
+      AppendString(value);
+      return *this;
+    }
+
+    MessageBodyWriter& Field(const std::string& key, unsigned int value) {
+      AppendKey(key);
+      char buffer[16];
+      body.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+      return *this;
+    }
+
+    // Model config, or the handle it was registered under if one is given; null stands for an empty config
+    MessageBodyWriter& Config(const json& config_json, const std::string& handle = std::string()) {
+      if (!handle.empty())
+        return Field("configHandle", handle);
+      if (!config_json.is_null() && !(config_json.is_object() && config_json.empty()))
+        return Field("config", config_json);
+      AppendKey("config");
+      body += "{}";
+      return *this;
+    }
+
+    MessageBodyWriter& Vector(const std::string& key, const std::vector<double>& values) {
+      AppendKey(key);
+      AppendArray(values);
+      return *this;
+    }
+
+    // Works for std::vector<std::vector<double>> as well as InputBlock
+    template <typename VectorList>
+    MessageBodyWriter& Vectors(const std::string& key, const VectorList& values) {
+      AppendKey(key);
+      body += '[';
+      for (std::size_t i = 0; i < values.size(); i++) {
+        if (i > 0)
+          body += ',';
+        AppendArray(values[i]);
+      }
+      body += ']';
+      return *this;
+    }
+
+    // Model inputs. Those with a non-empty handle are sent as empty arrays, and their handles listed in inputHandles.
+    template <typename VectorList>
+    MessageBodyWriter& Inputs(const VectorList& inputs, const std::vector<std::string>& handles) {
+      AppendKey("input");
+      body += '[';
+      for (std::size_t i = 0; i < inputs.size(); i++) {
+        if (i > 0)
+          body += ',';
+        if (i < handles.size() && !handles[i].empty())
+          body += "[]";
+        else
+          AppendArray(inputs[i]);
+      }
+      body += ']';
+      if (handles.empty())
+        return *this;
+      AppendKey("inputHandles");
+      body += '[';
+      for (std::size_t i = 0; i < handles.size(); i++) {
+        if (i > 0)
+          body += ',';
+        if (handles[i].empty())
+          body += "null";
+        else
+          AppendString(handles[i]);
+      }
+      body += ']';
+      return *this;
+    }
+
+    // Jacobian as rows, cols, format ("dense" or "csr") and its numeric arrays
+    MessageBodyWriter& Jacobian(const JacobianMatrix& jacobian) {
+      Field("rows", json(jacobian.rows));
+      Field("cols", json(jacobian.cols));
+      Field("format", std::string(jacobian.sparse ? "csr" : "dense"));
+      Vector("values", jacobian.values);
+      if (jacobian.sparse) {
+        AppendKey("rowOffsets");
+        AppendArray(jacobian.row_offsets);
+        AppendKey("columnIndices");
+        AppendArray(jacobian.column_indices);
+      }
+      return *this;
+    }
+
+    // Session the request belongs to, omitted if empty
+    MessageBodyWriter& SessionId(const std::string& session_id) {
+      if (!session_id.empty())
+        Field("session", session_id);
+      return *this;
+    }
+
+    // Complete the body of a writer without sink and hand it out
+    std::string Str() {
+      body += '}';
+      return std::move(body);
+    }
+
+    // Close the body and pass the remainder to the sink. Returns false if the sink failed at any point.
+    bool Finish() {
+      body += '}';
+      Flush();
+      return sink_ok;
+    }
+
+  private:
+    static const std::size_t max_number_length = 32;
+    static const std::size_t block_size = 4096; // Numbers formatted between checks for a full chunk
+
+    void AppendKey(const std::string& key) {
+      if (!first_field)
+        body += ',';
+      first_field = false;
+      AppendString(key);
+      body += ':';
+    }
+
+    void AppendString(const std::string& value) {
+      // Keys and model names usually need no escaping
+      bool plain = std::all_of(value.begin(), value.end(), [](char c) {
+        return c != '"' && c != '\\' && static_cast<unsigned char>(c) >= 0x20;
+      });
+      if (plain) {
+        body += '"';
+        body += value;
+        body += '"';
       } else {
-#endif
-        json request_body;
-        request_body["name"] = name;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt"] = inWrt;
-        for (std::size_t i = 0; i < inputs.size(); i++) {
-          request_body["input"][i] = inputs[i];
+        body += json(value).dump();
+      }
+    }
+
+    template <typename Values>
+    void AppendArray(const Values& values) {
+      body += '[';
+      for (std::size_t begin = 0; begin < values.size(); begin += block_size) {
+        std::size_t end = std::min(values.size(), begin + block_size);
+        std::size_t offset = body.size();
+        body.resize(offset + (end - begin) * max_number_length);
+        char* p = &body[offset];
+        for (std::size_t i = begin; i < end; i++) {
+          if (i > 0)
+            *p++ = ',';
+          p = WriteNumber(p, values[i]);
         }
-        request_body["sens"] = sens;
-        request_body["config"] = config_json;
+        body.resize(p - body.data());
+        if (sink && body.size() >= chunk_size)
+          Flush();
+      }
+      body += ']';
+    }
 
-        if (auto res = cli.Post("/Gradient", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+    void Flush() {
+      if (sink_ok && !body.empty())
+        sink_ok = sink(body.data(), body.size());
+      body.clear();
+    }
 
-          return response_body["output"].get<std::vector<double>>();
-        } else {
-          throw std::runtime_error("POST Gradient failed with error type '" + to_string(res.error()) + "'");
-        }
-#ifdef SUPPORT_POSIX_SHMEM
+    static char* WriteNumber(char* p, std::size_t value) {
+      return std::to_chars(p, p + max_number_length, value).ptr;
+    }
+
+    static char* WriteNumber(char* p, double value) {
+      if (!std::isfinite(value)) {
+        std::memcpy(p, "null", 4);
+        return p + 4;
       }
+#ifdef __cpp_lib_to_chars
+      char* end = std::to_chars(p, p + max_number_length, value).ptr;
+#else
+      char* end = p + std::snprintf(p, max_number_length, "%.17g", value);
 #endif
+      if (std::find_if(p, end, [](char c) { return c == '.' || c == 'e'; }) == end) {
+        *end++ = '.';
+        *end++ = '0';
+      }
+      return end;
     }
 
-    std::vector<double> ApplyJacobian(unsigned int outWrt,
-                              unsigned int inWrt,
-                              const std::vector<std::vector<double>>& inputs,
-                              const std::vector<double>& vec,
-                              json config_json = json::parse("{}")) override {
+    std::function<bool(const char*, std::size_t)> sink;
+    std::size_t chunk_size = 0;
+    bool sink_ok = true;
+    bool first_field = true;
+    std::string body = "{";
+  };
 
-#ifdef SUPPORT_POSIX_SHMEM
-      if (supportsShMem) {
-        unsigned int tid = pthread_self();
-        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
-        for (int i = 0; i < inputs.size(); i++) {
-          shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(inputs[i], "/umbridge_in_" + std::to_string(tid) + "_" + std::to_string(i)));
+  // Parser for message bodies, which may arrive in chunks, e.g. through httplib's ContentReader. Numeric arrays are
+  // parsed into their final std::vectors as data comes in, so the body text is never held as a whole.
+  // Other fields are small; each is buffered on its own and handed to json::parse.
+  class MessageBodyStreamParser {
+  public:
+    void Feed(const char* data, std::size_t size) {
+      std::size_t i = 0;
+      while (i < size) {
+        position = offset + i;
+        if (state == State::Numeric)
+          i = ConsumeNumeric(data, i, size);
+        else
+          Consume(data[i++]);
+      }
+      offset += size;
+    }
+
+    MessageBody Finish() {
+      return std::move(Complete());
+    }
+
+    // Check that the body is complete and return it, leaving it in place
+    MessageBody& Complete() {
+      if (state != State::Done)
+        Fail(offset, "unexpected end of input");
+      return body;
+    }
+
+    // Parse the numeric array under key directly into the given vector(s) instead of the MessageBody.
+    // Existing vectors are overwritten in place, so a target reused across messages keeps its memory.
+    void SetTarget(const std::string& key, std::vector<std::vector<double>>& target) {
+      nested_target_key = key;
+      nested_target = &target;
+    }
+
+    void SetTarget(const std::string& key, std::vector<double>& target) {
+      flat_target_key = key;
+      flat_target = &target;
+    }
+
+    // Prepare for parsing the next message. Internal buffers keep their memory.
+    void Reset() {
+      state = State::Begin;
+      offset = position = 0;
+      if (body.fields.is_object())
+        body.fields.clear();
+      body.vectors.clear();
+      body.vector.clear();
+      nested_target = nullptr;
+      flat_target = nullptr;
+    }
+
+  private:
+    enum class State { Begin, FirstKeyOrEnd, KeyStart, Key, Colon, Value, Raw, Numeric, CommaOrEnd, Done };
+
+    static bool IsWhitespace(char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    [[noreturn]] static void Fail(std::size_t position, const std::string& message) {
+      throw json::parse_error::create(101, position, "syntax error while parsing message body - " + message);
+    }
+
+    void Consume(char c) {
+      switch (state) {
+      case State::Begin:
+        if (c == '{') {
+          if (!body.fields.is_object())
+            body.fields = json::object();
+          state = State::FirstKeyOrEnd;
+        } else if (!IsWhitespace(c)) {
+          Fail(position, "expected '{'");
         }
-        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
-        SharedMemoryVector shmem_output(output_sizes[outWrt], "/umbridge_out_" + std::to_string(tid) + "_" + std::to_string(0), true);
+        break;
+      case State::FirstKeyOrEnd:
+        if (c == '}') {
+          state = State::Done;
+          break;
+        }
+        // fall through
+      case State::KeyStart:
+        if (c == '"') {
+          key.clear();
+          key_escaped = false;
+          escape = false;
+          state = State::Key;
+        } else if (!IsWhitespace(c)) {
+          Fail(position, "expected string literal as key");
+        }
+        break;
+      case State::Key:
+        if (escape) {
+          escape = false;
+        } else if (c == '\\') {
+          escape = key_escaped = true;
+        } else if (c == '"') {
+          if (key_escaped)
+            key = json::parse("\"" + key + "\"").get<std::string>();
+          state = State::Colon;
+          break;
+        }
+        key += c;
+        break;
+      case State::Colon:
+        if (c == ':')
+          state = State::Value;
+        else if (!IsWhitespace(c))
+          Fail(position, "expected ':'");
+        break;
+      case State::Value:
+        if (IsWhitespace(c))
+          break;
+        if (c == '[' && is_numeric_key(key)) {
+          StartNumeric();
+          break;
+        }
+        raw.clear();
+        raw_depth = 0;
+        in_string = escape = false;
+        state = State::Raw;
+        // fall through
+      case State::Raw:
+        ConsumeRaw(c);
+        break;
+      case State::CommaOrEnd:
+        if (c == ',')
+          state = State::KeyStart;
+        else if (c == '}')
+          state = State::Done;
+        else if (!IsWhitespace(c))
+          Fail(position, "expected ',' or '}'");
+        break;
+      case State::Done:
+        if (!IsWhitespace(c))
+          Fail(position, "expected end of input");
+        break;
+      case State::Numeric:
+        break;
+      }
+    }
 
-        json request_body;
-        request_body["tid"] = std::to_string(tid);
-        request_body["name"] = name;
-        request_body["config"] = config_json;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt"] = inWrt;
-        request_body["vec"] = vec;
-        request_body["shmem_name"] = "/umbridge";
-        request_body["shmem_num_inputs"] = inputs.size();
-        for (int i = 0; i < inputs.size(); i++) {
-          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+    // Collect the text of a non-numeric field until the value is complete
+    void ConsumeRaw(char c) {
+      if (in_string) {
+        raw += c;
+        if (escape)
+          escape = false;
+        else if (c == '\\')
+          escape = true;
+        else if (c == '"') {
+          in_string = false;
+          if (raw_depth == 0)
+            FinishRaw();
         }
-        if (auto res = cli.Post("/ApplyJacobianShMem", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+        return;
+      }
+      if (raw_depth == 0 && (c == ',' || c == '}')) {
+        FinishRaw();
+        Consume(c);
+        return;
+      }
+      raw += c;
+      if (c == '"') {
+        in_string = true;
+      } else if (c == '{' || c == '[') {
+        raw_depth++;
+      } else if (c == '}' || c == ']') {
+        if (--raw_depth == 0)
+          FinishRaw();
+      }
+    }
 
-          std::vector<double> output(output_sizes[outWrt]);
-          output = shmem_output.GetVector();
-          return output;
+    void FinishRaw() {
+      body.fields[key] = json::parse(raw);
+      state = State::CommaOrEnd;
+    }
+
+    void StartNumeric() {
+      state = State::Numeric;
+      numeric_depth = 1;
+      nested = false;
+      after_value = false;
+      token.clear();
+      num_nested = 0;
+      // A list of vectors parsed into a target collects stray numbers in flat_scratch, only to reject them
+      nested_list = nested_target && key == nested_target_key ? nested_target : nullptr;
+      if (flat_target && key == flat_target_key)
+        flat = flat_target;
+      else if (nested_list)
+        flat = &flat_scratch;
+      else
+        flat = &body.vector[key];
+      flat->clear();
+      if (!nested_list && flat != flat_target)
+        nested_list = &body.vectors[key];
+    }
+
+    // Consume a numeric array starting at data[i], returning where it ended or size if it continues in the next chunk
+    std::size_t ConsumeNumeric(const char* data, std::size_t i, std::size_t size) {
+      for (; i < size; i++) {
+        char c = data[i];
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' ||
+            c == 'n' || c == 'u' || c == 'l') {
+          if (after_value && token.empty())
+            Fail(offset + i, "expected ',' or ']'");
+          token += c;
+          continue;
+        }
+        if (!token.empty())
+          AddNumber(offset + i);
+        if (IsWhitespace(c))
+          continue;
+        if (c == ',') {
+          if (!after_value)
+            Fail(offset + i, "unexpected ','");
+          after_value = false;
+        } else if (c == '[') {
+          if (numeric_depth != 1 || after_value || !flat->empty() || !nested_list)
+            Fail(offset + i, "numeric field is not a (list of) vector(s) of numbers");
+          nested = true;
+          numeric_depth = 2;
+          if (num_nested == nested_list->size())
+            nested_list->emplace_back();
+          current = &(*nested_list)[num_nested++];
+          current->clear();
+        } else if (c == ']') {
+          if (!after_value && (numeric_depth == 2 ? !current->empty() : (!flat->empty() || num_nested > 0)))
+            Fail(offset + i, "unexpected ']'");
+          after_value = true;
+          if (--numeric_depth == 0) {
+            if (nested_list)
+              nested_list->resize(num_nested);
+            if (flat == &flat_scratch && !flat->empty())
+              Fail(offset + i, "numeric field is not a list of vectors");
+            // An empty array may stand for either kind
+            if (nested)
+              body.vector.erase(key);
+            else if (!flat->empty())
+              body.vectors.erase(key);
+            state = State::CommaOrEnd;
+            return i + 1;
+          }
         } else {
-          throw std::runtime_error("POST ApplyJacobian failed with error type '" + to_string(res.error()) + "'");
+          Fail(offset + i, "numeric field is not a (list of) vector(s) of numbers");
         }
+      }
+      return i;
+    }
+
+    void AddNumber(std::size_t position) {
+      double value;
+      if (token == "null") {
+        value = std::numeric_limits<double>::quiet_NaN();
       } else {
+#ifdef __cpp_lib_to_chars
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (result.ec != std::errc() || result.ptr != token.data() + token.size())
+          Fail(position, "invalid number '" + token + "'");
+#else
+        char* end;
+        value = std::strtod(token.c_str(), &end);
+        if (end != token.c_str() + token.size())
+          Fail(position, "invalid number '" + token + "'");
 #endif
-        json request_body;
-        request_body["name"] = name;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt"] = inWrt;
-        for (std::size_t i = 0; i < inputs.size(); i++) {
-          request_body["input"][i] = inputs[i];
-        }
-        request_body["vec"] = vec;
-        request_body["config"] = config_json;
+      }
+      token.clear();
+      if (numeric_depth == 2) {
+        current->push_back(value);
+      } else {
+        if (nested)
+          Fail(position, "numeric field is not a (list of) vector(s) of numbers");
+        flat->push_back(value);
+      }
+      after_value = true;
+    }
 
-        if (auto res = cli.Post("/ApplyJacobian", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+    MessageBody body;
+    State state = State::Begin;
+    std::size_t offset = 0;   // Position of the current chunk within the body
+    std::size_t position = 0; // Position of the character being consumed
+
+    std::string key;
+    bool key_escaped = false;
+    bool escape = false;
+
+    std::string raw;
+    int raw_depth = 0;
+    bool in_string = false;
+
+    int numeric_depth = 0;
+    bool nested = false;
+    bool after_value = false;
+    std::string token;
+    std::vector<double>* flat = nullptr;
+    std::vector<double>* current = nullptr;
+    std::vector<std::vector<double>>* nested_list = nullptr;
+    std::size_t num_nested = 0;
+
+    std::string nested_target_key;
+    std::vector<std::vector<double>>* nested_target = nullptr;
+    std::string flat_target_key;
+    std::vector<double>* flat_target = nullptr;
+    std::vector<double> flat_scratch;
+  };
 
-          return response_body["output"].get<std::vector<double>>();
-        } else {
-          throw std::runtime_error("POST ApplyJacobian failed with error type '" + to_string(res.error()) + "'");
+  // Read a request body from httplib's ContentReader chunk by chunk
+  MessageBody read_message_body(const httplib::ContentReader& content_reader) {
+    MessageBodyStreamParser parser;
+    std::exception_ptr error;
+    content_reader([&](const char* data, std::size_t size) {
+      try {
+        parser.Feed(data, size);
+        return true;
+      } catch (...) {
+        error = std::current_exception();
+        return false;
+      }
+    });
+    if (error)
+      std::rethrow_exception(error);
+    return parser.Finish();
+  }
+
+  // Parse a complete message body; throws json::parse_error on malformed JSON like json::parse does
+  MessageBody parse_message_body(const std::string& text) {
+    MessageBodyStreamParser parser;
+    parser.Feed(text.data(), text.size());
+    return parser.Finish();
+  }
+
+  // Responses with at least this many numbers are streamed to the client in chunks rather than assembled in one string
+  const std::size_t streamed_response_min_entries = 1 << 16;
+  const std::size_t response_chunk_size = 1 << 20;
+
+  // Set a response body produced by write(MessageBodyWriter&). The write function owns the data it writes, since it
+  // may only be called after the handler has returned.
+  template <typename WriteFunction>
+  void set_message_content(httplib::Response& res, std::size_t num_entries, WriteFunction write) {
+    if (num_entries < streamed_response_min_entries) {
+      MessageBodyWriter writer;
+      write(writer);
+      res.set_content(writer.Str(), "application/json");
+      return;
+    }
+    res.set_chunked_content_provider("application/json", [write = std::move(write)](std::size_t /*offset*/, httplib::DataSink& sink) {
+      MessageBodyWriter writer(sink.write, response_chunk_size);
+      write(writer);
+      if (!writer.Finish())
+        return false;
+      sink.done();
+      return true;
+    });
+  }
+
+  class FdMailbox;
+
+  // Client-side Model connecting to a server for the actual evaluations etc.
+  // Random id for a call, by which to cancel it
+  std::string new_call_id() {
+    static thread_local std::mt19937_64 generator(std::random_device{}());
+    std::ostringstream id;
+    id << std::hex << generator();
+    return id.str();
+  }
+
+  // Ask the server at host to drop the call with the given id if it is still queued or running. Best effort, since
+  // the call may well have completed in the meantime.
+  void cancel_call(const std::string& host, const httplib::Headers& headers, const std::string& call_id) {
+    httplib::Client cli = create_client(host);
+    cli.set_connection_timeout(1);
+    cli.set_read_timeout(5);
+    json request_body;
+    request_body["call"] = call_id;
+    cli.Post("/Cancel", headers, request_body.dump(), "application/json");
+  }
+
+  class HTTPModel : public Model {
+  public:
+    HTTPModel(std::string host, std::string name, bool useShMem = false, httplib::Headers headers = httplib::Headers(),
+              SharedMemoryOptions shmem_options = SharedMemoryOptions())
+    : Model(name), host(host), cli(create_client(host)), headers(headers), shmem_options(shmem_options)
+    {
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      // Compression only pays off over the network, not through a local socket
+      bool compress = unix_socket_path_from_url(host).empty();
+      if (compress && this->headers.find("Accept-Encoding") == this->headers.end())
+        this->headers.emplace("Accept-Encoding", "gzip");
+#endif
+      // Check if requested model is available on server
+      std::vector<std::string> models = SupportedModels(host, headers);
+      if (std::find(models.begin(), models.end(), name) == models.end()) {
+        std::string model_names = "";
+        for (auto& m : models) {
+          model_names += "'" + m + "' ";
         }
+        throw std::runtime_error("Model " + name + " not found on server! Available models: " + model_names + ".");
+      }
+
+      json request_body;
+      request_body["name"] = name;
+
+      if (auto res = cli.Post("/ModelInfo", headers, request_body.dump(), "application/json")) {
+        json response = json::parse(res->body);
+
+        json supported_features = response.at("support");
+        supportsEvaluate = supported_features.value("Evaluate", false);
+        supportsGradient = supported_features.value("Gradient", false);
+        supportsApplyJacobian = supported_features.value("ApplyJacobian", false);
+        supportsApplyHessian = supported_features.value("ApplyHessian", false);
+        supportsEvaluateAndGradient = supported_features.value("EvaluateAndGradient", false);
+        supportsApplyJacobianBlock = supported_features.value("ApplyJacobianBlock", false);
+        supportsApplyHessianBlock = supported_features.value("ApplyHessianBlock", false);
+        supportsJacobian = supported_features.value("Jacobian", false);
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+        // Servers list the codings they accept for request bodies in an Accept-Encoding response header (RFC 7694)
+        compress_requests = compress && res->get_header_value("Accept-Encoding").find("gzip") != std::string::npos;
+#endif
+        
+      } else {
+        throw std::runtime_error("POST ModelInfo failed with error type '" + to_string(res.error()) + "'");
+      }
+#ifdef SUPPORT_POSIX_SHMEM
+      // Test whether client and server are able to communicate through shared memory. Disables ShMem if test fails.
+      // Servers on a Unix domain socket are tried with memfd buffers first, which need no named segments in /dev/shm.
+      if (useShMem) {
+        shmem_prefix = unique_shmem_prefix();
+#ifdef SUPPORT_MEMFD
+        std::string unix_socket_path = unix_socket_path_from_url(host);
+        if (!unix_socket_path.empty()) {
+          try {
+            memfd_channel = std::make_unique<MemfdChannel>(memfd_socket_path(unix_socket_path));
+            supportsShMem = test_shmem(request_body);
+          } catch (std::runtime_error&) {}
+          if (!supportsShMem)
+            memfd_channel.reset();
+        }
+#endif
+        if (!supportsShMem)
+          supportsShMem = test_shmem(request_body);
+
+        if (!supportsShMem) {
+          std::cout << "Server not accessible via shared memory. Using HTTP instead." << std::endl;
+        } else {
+          std::cout << "Server accessible via shared memory" << std::endl;
+        }
+      }
+#endif
+    }
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+
+      json request_body;
+      request_body["name"] = name;
+      if (!config_json.empty())
+        set_config(request_body, config_json);
+
+      if (auto res = post_json("/InputSizes", request_body)) {
+        json response_body = parse_result_with_error_handling(res);
+        std::vector<std::size_t> outputvec = response_body["inputSizes"].get<std::vector<std::size_t>>();
+        return outputvec;
+      } else {
+        throw std::runtime_error("POST InputSizes failed with error type '" + to_string(res.error()) + "'");
+        return std::vector<std::size_t>(0);
+      }
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+
+      json request_body;
+      request_body["name"] = name;
+      if (!config_json.empty())
+        set_config(request_body, config_json);
+
+      if (auto res = post_json("/OutputSizes", request_body)) {
+        json response_body = parse_result_with_error_handling(res);
+        std::vector<std::size_t> outputvec = response_body["outputSizes"].get<std::vector<std::size_t>>();
+        return outputvec;
+      } else {
+        throw std::runtime_error("POST OutputSizes failed with error type '" + to_string(res.error()) + "'");
+        return std::vector<std::size_t>(0);
+      }
+    }
+
+    // Store config_json on the server. Later calls with an identical config then only send a short handle in its place,
+    // and the server reuses the parsed config along with the model's input and output sizes for it.
+    // Returns false if the server does not support config handles, in which case configs keep being sent in full.
+    bool RegisterConfig(const json& config_json) {
+      return !config_json.empty() && !register_config(config_json).empty();
+    }
+
+    // Make subsequent calls part of the session with the given id, or of no session if empty. The server then keeps
+    // model state (e.g. for warm starts) across these calls. Calls made while serving a session, e.g. in a load
+    // balancer, carry that session on by default. Not to be changed while calls are in flight.
+    void SetSession(std::string session_id) {
+      this->session_id = std::move(session_id);
+    }
+
+    // Give each subsequent call at most timeout to complete, or no limit if zero. The deadline is sent along to the
+    // server, which drops the call once it has passed; past it, the client stops waiting and throws CancelledError.
+    // Calls made while serving a call, e.g. in a load balancer, keep to that call's deadline as well, and are
+    // cancelled on the server along with it. Not to be changed while calls are in flight.
+    void SetTimeout(std::chrono::milliseconds timeout) {
+      this->timeout = timeout;
+    }
+
+    // Release the state of the current session on the server instead of waiting for it to expire
+    void CloseSession() override {
+      std::string id = session_for_call();
+      if (id.empty())
+        return;
+      json request_body;
+      request_body["name"] = name;
+      request_body["session"] = id;
+      if (auto res = cli.Post("/CloseSession", headers, request_body.dump(), "application/json")) {
+        if (res->status != 404) // Servers without session support keep no state to release
+          parse_result_with_error_handling(res);
+      } else {
+        throw std::runtime_error("POST CloseSession failed with error type '" + to_string(res.error()) + "'");
+      }
+      session_id.clear();
+    }
+
+    // Upload a large input that stays the same across many calls (e.g. observation data) to the server once.
+    // Inputs equal to it are then sent as a short handle, which the server replaces by the stored vector.
+    // Returns false if the server does not support stored vectors, in which case inputs keep being sent in full.
+    bool StoreVector(const std::vector<double>& values) {
+      return !values.empty() && !store_vector(values).empty();
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      return evaluate_inputs(inputs, config_json);
+    }
+
+    // Inputs already stored in a block are sent without unpacking them first
+    std::vector<std::vector<double>> EvaluateBlock(const InputBlock& inputs, json config_json = json::parse("{}")) override {
+      return evaluate_inputs(inputs, config_json);
+    }
+
+    // Request and response bodies go through per-thread buffers and the response is parsed straight into outputs.
+    // Once these have grown to size, repeated calls only make httplib's per-request allocations, a few dozen for
+    // headers and a copy of the request, none of them growing with the outputs.
+    void EvaluateInto(const std::vector<std::vector<double>>& inputs, std::vector<std::vector<double>>& outputs,
+                      const json& config_json = json()) override {
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        Model::EvaluateInto(inputs, outputs, config_json);
+        return;
+      }
+#endif
+      CallBuffers& buffers = call_buffers();
+      buffers.request = MessageBodyWriter(std::move(buffers.request))
+        .Field("name", name)
+        .Inputs(inputs, input_handles(inputs))
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+      do {
+        buffers.parser.Reset();
+        buffers.parser.SetTarget("output", outputs);
+      } while (!send_message("/Evaluate", buffers));
+    }
+
+    void GradientInto(unsigned int outWrt,
+                      unsigned int inWrt,
+                      const std::vector<std::vector<double>>& inputs,
+                      const std::vector<double>& sens,
+                      std::vector<double>& gradient,
+                      const json& config_json = json()) override {
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        Model::GradientInto(outWrt, inWrt, inputs, sens, gradient, config_json);
+        return;
+      }
+#endif
+      CallBuffers& buffers = call_buffers();
+      buffers.request = MessageBodyWriter(std::move(buffers.request))
+        .Field("name", name)
+        .Field("outWrt", outWrt)
+        .Field("inWrt", inWrt)
+        .Inputs(inputs, input_handles(inputs))
+        .Vector("sens", sens)
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+      do {
+        buffers.parser.Reset();
+        buffers.parser.SetTarget("output", gradient);
+      } while (!send_message("/Gradient", buffers));
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                  unsigned int inWrt,
+                  const std::vector<std::vector<double>>& inputs,
+                  const std::vector<double>& sens,
+                  json config_json = json::parse("{}")) override
+    {
+
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        std::string tid = std::to_string(next_shmem_sequence());
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          shmem_inputs.push_back(create_shmem_vector(inputs[i].size(), "in", tid, i));
+          shmem_inputs[i]->SetVector(inputs[i]);
+        }
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+        shmem_outputs.push_back(create_shmem_vector(inputs[inWrt].size(), "out", tid, 0));
+
+        json request_body;
+        request_body["name"] = name;
+        set_config(request_body, config_json);
+        set_session(request_body);
+        request_body["outWrt"] = outWrt;
+        request_body["inWrt"] = inWrt;
+        request_body["sens"] = sens;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+        }
+        attach_shmem_buffers(request_body, tid, shmem_inputs, shmem_outputs);
+        if (auto res = post_json("/GradientShMem", request_body)) {
+          json response_body = parse_result_with_error_handling(res);
+
+          std::vector<double> output(inputs[inWrt].size());
+          output = shmem_outputs[0]->GetVector();
+          return output;
+        } else {
+          throw std::runtime_error("POST Gradient failed with error type '" + to_string(res.error()) + "'");
+        }
+      } else {
+#endif
+        std::string request_body = MessageBodyWriter()
+          .Field("name", name)
+          .Field("outWrt", outWrt)
+          .Field("inWrt", inWrt)
+          .Inputs(inputs, input_handles(inputs))
+          .Vector("sens", sens)
+          .Config(config_json, config_handle(config_json))
+          .SessionId(session_for_call())
+          .Str();
+
+        if (auto res = post_message("/Gradient", request_body)) {
+          MessageBody response_body = parse_message_with_error_handling(res);
+
+          return std::move(response_body.Vector("output"));
+        } else {
+          throw std::runtime_error("POST Gradient failed with error type '" + to_string(res.error()) + "'");
+        }
+#ifdef SUPPORT_POSIX_SHMEM
+      }
+#endif
+    }
+
+    // One round trip for all vectors if the server offers /ApplyJacobianBlock, one ApplyJacobian call per vector otherwise
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      bool block = supportsApplyJacobianBlock;
+#ifdef SUPPORT_POSIX_SHMEM
+      block = block && !supportsShMem;
+#endif
+      if (!block)
+        return Model::ApplyJacobianBlock(outWrt, inWrt, inputs, vecs, config_json);
+
+      std::string request_body = MessageBodyWriter()
+        .Field("name", name)
+        .Field("outWrt", outWrt)
+        .Field("inWrt", inWrt)
+        .Inputs(inputs, input_handles(inputs))
+        .Vectors("vecs", vecs)
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+
+      if (auto res = post_message("/ApplyJacobianBlock", request_body)) {
+        MessageBody response_body = parse_message_with_error_handling(res);
+
+        return std::move(response_body.Vectors("output"));
+      } else {
+        throw std::runtime_error("POST ApplyJacobianBlock failed with error type '" + to_string(res.error()) + "'");
+      }
+    }
+
+    std::vector<std::vector<double>> ApplyHessianBlock(unsigned int outWrt,
+                              unsigned int inWrt1,
+                              unsigned int inWrt2,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      bool block = supportsApplyHessianBlock;
+#ifdef SUPPORT_POSIX_SHMEM
+      block = block && !supportsShMem;
+#endif
+      if (!block)
+        return Model::ApplyHessianBlock(outWrt, inWrt1, inWrt2, inputs, sens, vecs, config_json);
+
+      std::string request_body = MessageBodyWriter()
+        .Field("name", name)
+        .Field("outWrt", outWrt)
+        .Field("inWrt1", inWrt1)
+        .Field("inWrt2", inWrt2)
+        .Inputs(inputs, input_handles(inputs))
+        .Vector("sens", sens)
+        .Vectors("vecs", vecs)
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+
+      if (auto res = post_message("/ApplyHessianBlock", request_body)) {
+        MessageBody response_body = parse_message_with_error_handling(res);
+
+        return std::move(response_body.Vectors("output"));
+      } else {
+        throw std::runtime_error("POST ApplyHessianBlock failed with error type '" + to_string(res.error()) + "'");
+      }
+    }
+
+    // One round trip if the server offers /Jacobian, assembled from Jacobian actions on the client otherwise
+    JacobianMatrix Jacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              json config_json = json::parse("{}")) override {
+      bool full = supportsJacobian;
+#ifdef SUPPORT_POSIX_SHMEM
+      full = full && !supportsShMem;
+#endif
+      if (!full)
+        return Model::Jacobian(outWrt, inWrt, inputs, config_json);
+
+      std::string request_body = MessageBodyWriter()
+        .Field("name", name)
+        .Field("outWrt", outWrt)
+        .Field("inWrt", inWrt)
+        .Inputs(inputs, input_handles(inputs))
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+
+      if (auto res = post_message("/Jacobian", request_body)) {
+        MessageBody response_body = parse_message_with_error_handling(res);
+
+        return read_jacobian(response_body);
+      } else {
+        throw std::runtime_error("POST Jacobian failed with error type '" + to_string(res.error()) + "'");
+      }
+    }
+
+    // One round trip if the server offers /EvaluateAndGradient, separate Evaluate and Gradient calls otherwise
+    std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                  unsigned int inWrt,
+                  const std::vector<std::vector<double>>& inputs,
+                  const std::vector<double>& sens,
+                  json config_json = json::parse("{}")) override
+    {
+      bool fused = supportsEvaluateAndGradient;
+#ifdef SUPPORT_POSIX_SHMEM
+      fused = fused && !supportsShMem;
+#endif
+      if (!fused)
+        return Model::EvaluateAndGradient(outWrt, inWrt, inputs, sens, config_json);
+
+      std::string request_body = MessageBodyWriter()
+        .Field("name", name)
+        .Field("outWrt", outWrt)
+        .Field("inWrt", inWrt)
+        .Inputs(inputs, input_handles(inputs))
+        .Vector("sens", sens)
+        .Config(config_json, config_handle(config_json))
+        .SessionId(session_for_call())
+        .Str();
+
+      if (auto res = post_message("/EvaluateAndGradient", request_body)) {
+        MessageBody response_body = parse_message_with_error_handling(res);
+
+        return {std::move(response_body.Vectors("output")), std::move(response_body.Vector("gradient"))};
+      } else {
+        throw std::runtime_error("POST EvaluateAndGradient failed with error type '" + to_string(res.error()) + "'");
+      }
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& vec,
+                              json config_json = json::parse("{}")) override {
+
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        std::string tid = std::to_string(next_shmem_sequence());
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          shmem_inputs.push_back(create_shmem_vector(inputs[i].size(), "in", tid, i));
+          shmem_inputs[i]->SetVector(inputs[i]);
+        }
+        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+        shmem_outputs.push_back(create_shmem_vector(output_sizes[outWrt], "out", tid, 0));
+
+        json request_body;
+        request_body["name"] = name;
+        set_config(request_body, config_json);
+        set_session(request_body);
+        request_body["outWrt"] = outWrt;
+        request_body["inWrt"] = inWrt;
+        request_body["vec"] = vec;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+        }
+        attach_shmem_buffers(request_body, tid, shmem_inputs, shmem_outputs);
+        if (auto res = post_json("/ApplyJacobianShMem", request_body)) {
+          json response_body = parse_result_with_error_handling(res);
+
+          std::vector<double> output(output_sizes[outWrt]);
+          output = shmem_outputs[0]->GetVector();
+          return output;
+        } else {
+          throw std::runtime_error("POST ApplyJacobian failed with error type '" + to_string(res.error()) + "'");
+        }
+      } else {
+#endif
+        std::string request_body = MessageBodyWriter()
+          .Field("name", name)
+          .Field("outWrt", outWrt)
+          .Field("inWrt", inWrt)
+          .Inputs(inputs, input_handles(inputs))
+          .Vector("vec", vec)
+          .Config(config_json, config_handle(config_json))
+          .SessionId(session_for_call())
+          .Str();
+
+        if (auto res = post_message("/ApplyJacobian", request_body)) {
+          MessageBody response_body = parse_message_with_error_handling(res);
+
+          return std::move(response_body.Vector("output"));
+        } else {
+          throw std::runtime_error("POST ApplyJacobian failed with error type '" + to_string(res.error()) + "'");
+        }
+#ifdef SUPPORT_POSIX_SHMEM
+      }
+#endif
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                      unsigned int inWrt1,
+                      unsigned int inWrt2,
+                      const std::vector<std::vector<double>>& inputs,
+                      const std::vector<double>& sens,
+                      const std::vector<double>& vec,
+                      json config_json = json::parse("{}")) override {
+
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        std::string tid = std::to_string(next_shmem_sequence());
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          shmem_inputs.push_back(create_shmem_vector(inputs[i].size(), "in", tid, i));
+          shmem_inputs[i]->SetVector(inputs[i]);
+        }
+        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
+
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+
+        shmem_outputs.push_back(create_shmem_vector(output_sizes[outWrt], "out", tid, 0));
+
+        json request_body;
+        request_body["name"] = name;
+        set_config(request_body, config_json);
+        set_session(request_body);
+        request_body["outWrt"] = outWrt;
+        request_body["inWrt1"] = inWrt1;
+        request_body["inWrt2"] = inWrt2;
+        request_body["sens"] = sens;
+        request_body["vec"] = vec;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+        }
+        attach_shmem_buffers(request_body, tid, shmem_inputs, shmem_outputs);
+        if (auto res = post_json("/ApplyHessianShMem", request_body)) {
+          json response_body = parse_result_with_error_handling(res);
+
+          std::vector<double> output(output_sizes[outWrt]);
+          output = shmem_outputs[0]->GetVector();
+          return output;
+        } else {
+          throw std::runtime_error("POST ApplyHessian failed with error type '" + to_string(res.error()) + "'");
+        }
+      } else {
+#endif
+        std::string request_body = MessageBodyWriter()
+          .Field("name", name)
+          .Field("outWrt", outWrt)
+          .Field("inWrt1", inWrt1)
+          .Field("inWrt2", inWrt2)
+          .Inputs(inputs, input_handles(inputs))
+          .Vector("sens", sens)
+          .Vector("vec", vec)
+          .Config(config_json, config_handle(config_json))
+          .SessionId(session_for_call())
+          .Str();
+
+        if (auto res = post_message("/ApplyHessian", request_body)) {
+          MessageBody response_body = parse_message_with_error_handling(res);
+
+          return std::move(response_body.Vector("output"));
+        } else {
+          throw std::runtime_error("POST ApplyHessian failed with error type '" + to_string(res.error()) + "'");
+        }
+#ifdef SUPPORT_POSIX_SHMEM
+      }
+#endif
+    }
+
+    bool SupportsEvaluate() override {
+      return supportsEvaluate;
+    }
+    bool SupportsGradient() override {
+      return supportsGradient;
+    }
+    bool SupportsApplyJacobian() override {
+      return supportsApplyJacobian;
+    }
+    bool SupportsApplyHessian() override {
+      return supportsApplyHessian;
+    }
+
+  private:
+
+    std::string host;
+    mutable httplib::Client cli;
+    httplib::Headers headers;
+    SharedMemoryOptions shmem_options;
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+    bool compress_requests = false; // Server accepts gzip compressed requests
+#endif
+
+    bool supportsEvaluate = false;
+    bool supportsGradient = false;
+    bool supportsApplyJacobian = false;
+    bool supportsApplyHessian = false;
+    bool supportsEvaluateAndGradient = false; // Server offers the fused endpoint
+    bool supportsApplyJacobianBlock = false;  // Server offers block endpoints
+    bool supportsApplyHessianBlock = false;
+    bool supportsJacobian = false;
+#ifdef SUPPORT_POSIX_SHMEM
+    bool supportsShMem = false;
+    std::string shmem_prefix;
+#endif
+#ifdef SUPPORT_MEMFD
+    std::unique_ptr<MemfdChannel> memfd_channel; // Set if the server accepts memfd buffers through its side channel
+#endif
+
+    std::string session_id;
+    std::chrono::milliseconds timeout{0};
+
+    // Deadline and cancellation of one call. Its deadline is the earlier of the model's timeout and that of the call
+    // being served on this thread, if any. Calls that may be cancelled get an id, sent along with the deadline, and
+    // are cancelled on the server through /Cancel when the call being served here is, or when the client gives up.
+    class CallControl {
+    public:
+      explicit CallControl(const HTTPModel& model) : model(model), headers(model.headers), client(model.acquire_client()) {
+        CurrentCancellation().ThrowIfCancelled();
+        deadline = CurrentCancellation().Deadline();
+        if (model.timeout.count() > 0)
+          deadline = std::min(deadline, CancellationToken::Clock::now() + model.timeout);
+        token = current_cancellation();
+        if (!token && deadline == CancellationToken::Clock::time_point::max())
+          return;
+
+        id = new_call_id();
+        headers.emplace(call_id_header, id);
+        if (deadline != CancellationToken::Clock::time_point::max()) {
+          auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - CancellationToken::Clock::now());
+          remaining = std::max(remaining, std::chrono::milliseconds(1));
+          headers.emplace(deadline_header, std::to_string(remaining.count()));
+          // Not waiting longer than that; a little slack lets the server's response to the deadline passing arrive first.
+          // The connection is this call's alone until it is released, so its timeout can be changed for the call.
+          client->set_read_timeout(remaining + std::chrono::milliseconds(100));
+        }
+        if (token)
+          callback = token->OnCancel([host = model.host, headers = model.headers, id = id]() { cancel_call(host, headers, id); });
+      }
+
+      CallControl(const CallControl&) = delete;
+      CallControl& operator=(const CallControl&) = delete;
+
+      ~CallControl() {
+        if (token)
+          token->RemoveCallback(callback);
+        if (deadline != CancellationToken::Clock::time_point::max())
+          client->set_read_timeout(CPPHTTPLIB_READ_TIMEOUT_SECOND, 0);
+        model.release_client(std::move(client));
+      }
+
+      const httplib::Headers& Headers() const {
+        return headers;
+      }
+
+      httplib::Client& Client() const {
+        return *client;
+      }
+
+      // No response arrived: cancel the call on the server, and throw CancelledError if the deadline has passed
+      void Failed() const {
+        if (id.empty())
+          return;
+        cancel_call(model.host, model.headers, id);
+        if (CancellationToken::Clock::now() >= deadline)
+          throw CancelledError("Call to model " + model.name + " ran past its deadline");
+      }
+
+    private:
+      const HTTPModel& model;
+      httplib::Headers headers;
+      std::unique_ptr<httplib::Client> client;
+      CancellationToken::Clock::time_point deadline;
+      CancellationToken* token = nullptr;
+      std::size_t callback = 0;
+      std::string id;
+    };
+
+    // Connections not in use by a call. An httplib client sends one request at a time, so each call in flight takes
+    // one of its own, and concurrent calls to the same model (e.g. from FiniteDifferenceModel) run side by side.
+    // At most max_idle_clients are kept open; connections beyond that, left over from a burst of calls, are closed.
+    static const std::size_t max_idle_clients = 32;
+    mutable std::mutex clients_mutex;
+    mutable std::vector<std::unique_ptr<httplib::Client>> idle_clients;
+
+    std::unique_ptr<httplib::Client> acquire_client() const {
+      std::lock_guard<std::mutex> lock(clients_mutex);
+      if (idle_clients.empty())
+        return std::make_unique<httplib::Client>(create_client(host));
+      std::unique_ptr<httplib::Client> client = std::move(idle_clients.back());
+      idle_clients.pop_back();
+      return client;
+    }
+
+    void release_client(std::unique_ptr<httplib::Client> client) const {
+      std::lock_guard<std::mutex> lock(clients_mutex);
+      if (idle_clients.size() < max_idle_clients)
+        idle_clients.push_back(std::move(client));
+    }
+
+    // Configs registered through RegisterConfig, by their dump and by their handle, and vectors stored through StoreVector
+    mutable std::mutex handles_mutex;
+    mutable std::map<std::string, std::string> config_handles;
+    mutable std::map<std::string, json> registered_configs;
+    mutable std::map<std::string, std::shared_ptr<const std::vector<double>>> stored_vectors;
+
+    // Evaluate for inputs given as std::vector<std::vector<double>> or InputBlock
+    template <typename Inputs>
+    std::vector<std::vector<double>> evaluate_inputs(const Inputs& inputs, const json& config_json) {
+#ifdef SUPPORT_POSIX_SHMEM
+      if (supportsShMem) {
+        std::string tid = std::to_string(next_shmem_sequence());
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          shmem_inputs.push_back(create_shmem_vector(inputs[i].size(), "in", tid, i));
+          shmem_inputs[i]->Write(inputs[i].data());
+        }
+        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
+        for (std::size_t i = 0; i < output_sizes.size(); i++) {
+          shmem_outputs.push_back(create_shmem_vector(output_sizes[i], "out", tid, i));
+        }
+
+        json request_body;
+        request_body["name"] = name;
+        set_config(request_body, config_json);
+        set_session(request_body);
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
+        }
+        attach_shmem_buffers(request_body, tid, shmem_inputs, shmem_outputs);
+        if (auto res = post_json("/EvaluateShMem", request_body)) {
+          json response_body = parse_result_with_error_handling(res);
+
+          std::vector<std::vector<double>> outputs(output_sizes.size());
+          for (std::size_t i = 0; i < output_sizes.size(); i++) {
+            outputs[i] = shmem_outputs[i]->GetVector();
+          }
+          return outputs;
+        } else {
+          throw std::runtime_error("POST Evaluate failed with error type '" + to_string(res.error()) + "'");
+        }
+      } else {
+#endif
+        std::string request_body = MessageBodyWriter()
+          .Field("name", name)
+          .Inputs(inputs, input_handles(inputs))
+          .Config(config_json, config_handle(config_json))
+          .SessionId(session_for_call())
+          .Str();
+
+        if (auto res = post_message("/Evaluate", request_body)) {
+          MessageBody response_body = parse_message_with_error_handling(res);
+
+          return std::move(response_body.Vectors("output"));
+        } else {
+          throw std::runtime_error("POST Evaluate failed with error type '" + to_string(res.error()) + "'");
+        }
+#ifdef SUPPORT_POSIX_SHMEM
+      }
+#endif
+    }
+
+#ifdef SUPPORT_POSIX_SHMEM
+    // Shared buffer for input or output i of a ShMem call: a memfd if the server accepts those, a named POSIX segment otherwise
+    std::unique_ptr<SharedMemoryVector> create_shmem_vector(std::size_t size, const std::string& direction, const std::string& tid, std::size_t i) const {
+#ifdef SUPPORT_MEMFD
+      if (memfd_channel)
+        return std::make_unique<SharedMemoryVector>(size, shmem_options);
+#endif
+      return std::make_unique<SharedMemoryVector>(size, shmem_prefix + "_" + direction + "_" + tid + "_" + std::to_string(i), true, shmem_options);
+    }
+
+    // Tell the server where to find the buffers of a ShMem call. Memfds are handed over before the request is sent.
+    void attach_shmem_buffers(json& request_body, const std::string& tid,
+                              const std::vector<std::unique_ptr<SharedMemoryVector>>& shmem_inputs,
+                              const std::vector<std::unique_ptr<SharedMemoryVector>>& shmem_outputs) const {
+      request_body["tid"] = tid;
+      request_body["shmem_name"] = shmem_prefix;
+      request_body["shmem_num_inputs"] = shmem_inputs.size();
+      // Let the server map the buffers the same way, in particular the outputs it writes first
+      if (shmem_options.huge_pages)
+        request_body["shmem_huge_pages"] = true;
+      if (shmem_options.populate)
+        request_body["shmem_populate"] = true;
+#ifdef SUPPORT_MEMFD
+      if (memfd_channel) {
+        std::vector<int> fds;
+        for (const auto& shmem_vector : shmem_inputs)
+          fds.push_back(shmem_vector->GetFd());
+        for (const auto& shmem_vector : shmem_outputs)
+          fds.push_back(shmem_vector->GetFd());
+        std::string token = shmem_prefix.substr(1) + "_" + tid;
+        memfd_channel->Send(token, fds);
+        request_body["memfd_token"] = token;
+      }
+#endif
+    }
+
+    // Round trip a test value through the kind of shared memory buffers subsequent calls will use
+    bool test_shmem(json request_body) const {
+      std::string tid = shmem_prefix.substr(1) + "_" + std::to_string(next_shmem_sequence());
+      std::vector<double> testvec = {12345.0};
+      std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
+      std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+#ifdef SUPPORT_MEMFD
+      if (memfd_channel) {
+        shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(1));
+        shmem_outputs.push_back(std::make_unique<SharedMemoryVector>(1));
+        attach_shmem_buffers(request_body, tid, shmem_inputs, shmem_outputs);
+      } else
+#endif
+      {
+        shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(1, "/umbridge_test_shmem_in_" + tid, true));
+        shmem_outputs.push_back(std::make_unique<SharedMemoryVector>(1, "/umbridge_test_shmem_out_" + tid, true));
+        request_body["tid"] = tid;
+      }
+      shmem_inputs[0]->SetVector(testvec);
+      cli.Post("/TestShMem", headers, request_body.dump(), "application/json");
+
+      return shmem_outputs[0]->GetVector()[0] == testvec[0];
+    }
+#endif
+    
+    struct CallBuffers {
+      std::string request;
+      MessageBodyStreamParser parser;
+    };
+
+    // Buffers for EvaluateInto etc., kept per thread so that concurrent calls need no locking
+    static CallBuffers& call_buffers() {
+      static thread_local CallBuffers buffers;
+      return buffers;
+    }
+
+    // POST the request held in buffers and feed the response to their parser as it arrives.
+    // Returns false if the request has to be repeated since the server had dropped its config handle.
+    bool send_message(const char* path, CallBuffers& buffers) const {
+      CallControl control(*this);
+      httplib::Request req;
+      req.method = "POST";
+      req.path = path;
+      req.headers = control.Headers();
+      req.set_header("Content-Type", "application/json");
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      if (compress_requests && buffers.request.size() >= request_compression_min_bytes && gzip_compress(buffers.request, req.body))
+        req.set_header("Content-Encoding", "gzip");
+      else
+#endif
+      req.body.swap(buffers.request);
+
+      std::exception_ptr parse_error;
+      req.content_receiver = [&](const char* data, std::size_t size, uint64_t /*offset*/, uint64_t /*length*/) {
+        try {
+          buffers.parser.Feed(data, size);
+          return true;
+        } catch (...) {
+          parse_error = std::current_exception();
+          return false;
+        }
+      };
+      httplib::Response res;
+      httplib::Error error = httplib::Error::Success;
+      bool ok = control.Client().send(req, res, error);
+      if (buffers.request.empty())
+        req.body.swap(buffers.request);
+
+      if (!ok && !parse_error)
+        control.Failed();
+      if (!ok && !parse_error)
+        throw std::runtime_error(std::string("POST ") + (path + 1) + " failed with error type '" + to_string(error) + "'");
+      const MessageBody* response_body = nullptr;
+      try {
+        if (parse_error)
+          std::rethrow_exception(parse_error);
+        response_body = &buffers.parser.Complete();
+      } catch (json::parse_error& e) {
+        throw std::runtime_error(std::string("Response JSON could not be parsed: ") + e.what());
+      }
+      if (response_body->fields.find("error") != response_body->fields.end()) {
+        if (restore_handle(response_body->fields))
+          return false;
+        throw_server_error(response_body->fields["error"]);
+      }
+      return true;
+    }
+
+    // POST a request carrying model inputs, gzip compressed if the server accepts that and it is large enough to pay off
+    httplib::Result post_message(const char* path, const std::string& body) const {
+      CallControl control(*this);
+      httplib::Client& cli = control.Client();
+      const httplib::Headers& headers = control.Headers();
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      if (compress_requests && body.size() >= request_compression_min_bytes) {
+        std::string compressed;
+        if (gzip_compress(body, compressed)) {
+          httplib::Headers compressed_headers = headers;
+          compressed_headers.emplace("Content-Encoding", "gzip");
+          httplib::Result res = cli.Post(path, compressed_headers, compressed, "application/json");
+          if (restore_handle(res))
+            res = cli.Post(path, compressed_headers, compressed, "application/json");
+          if (!res)
+            control.Failed();
+          return res;
+        }
+      }
+#endif
+      httplib::Result res = cli.Post(path, headers, body, "application/json");
+      if (restore_handle(res))
+        res = cli.Post(path, headers, body, "application/json");
+      if (!res)
+        control.Failed();
+      return res;
+    }
+
+    // POST a request body built as json, repeating it if the server had dropped its config handle
+    httplib::Result post_json(const char* path, const json& request_body) const {
+      CallControl control(*this);
+      std::string body = request_body.dump();
+      httplib::Result res = control.Client().Post(path, control.Headers(), body, "application/json");
+      if (restore_handle(res))
+        res = control.Client().Post(path, control.Headers(), body, "application/json");
+      if (!res)
+        control.Failed();
+      return res;
+    }
+
+    std::string session_for_call() const {
+      if (!session_id.empty())
+        return session_id;
+      Session* session = CurrentSession();
+      return session ? session->Id() : std::string();
+    }
+
+    void set_session(json& request_body) const {
+      std::string id = session_for_call();
+      if (!id.empty())
+        request_body["session"] = id;
+    }
+
+    // Send the handle of config_json if it was registered, the config itself otherwise
+    void set_config(json& request_body, const json& config_json) const {
+      std::string handle = config_handle(config_json);
+      if (handle.empty())
+        request_body["config"] = config_json;
+      else
+        request_body["configHandle"] = handle;
+    }
+
+    // Handle config_json was registered under, or an empty string
+    std::string config_handle(const json& config_json) const {
+      if (config_json.empty())
+        return std::string();
+      std::lock_guard<std::mutex> lock(handles_mutex);
+      if (config_handles.empty())
+        return std::string();
+      auto handle = config_handles.find(config_json.dump());
+      return handle != config_handles.end() ? handle->second : std::string();
+    }
+
+    // Returns the handle, or an empty string if the server does not support config handles
+    std::string register_config(const json& config_json) const {
+      json request_body;
+      request_body["name"] = name;
+      request_body["config"] = config_json;
+      auto res = cli.Post("/RegisterConfig", headers, request_body.dump(), "application/json");
+      if (!res || res->status != 200)
+        return std::string();
+      std::string handle = parse_result_with_error_handling(res).value("configHandle", std::string());
+      if (!handle.empty()) {
+        std::lock_guard<std::mutex> lock(handles_mutex);
+        config_handles[config_json.dump()] = handle;
+        registered_configs[handle] = config_json;
+      }
+      return handle;
+    }
+
+    // Servers drop config handles and stored vectors when running out of space or when they restart, and then answer
+    // with an UnknownConfigHandle or UnknownVectorHandle error. Register the config or upload the vector again; since
+    // handles are derived from the content, the handle stays the same and the request can be repeated as it is.
+    bool restore_handle(const json& response_body) const {
+      auto error = response_body.find("error");
+      if (error == response_body.end() || !error->is_object())
+        return false;
+      std::string type = error->value("type", std::string());
+      if (type == "UnknownConfigHandle") {
+        std::string handle = error->value("configHandle", std::string());
+        json config_json;
+        {
+          std::lock_guard<std::mutex> lock(handles_mutex);
+          auto registered = registered_configs.find(handle);
+          if (registered == registered_configs.end())
+            return false;
+          config_json = registered->second;
+        }
+        return register_config(config_json) == handle;
+      }
+      if (type == "UnknownVectorHandle") {
+        std::string handle = error->value("vectorHandle", std::string());
+        std::shared_ptr<const std::vector<double>> values;
+        {
+          std::lock_guard<std::mutex> lock(handles_mutex);
+          auto stored = stored_vectors.find(handle);
+          if (stored == stored_vectors.end())
+            return false;
+          values = stored->second;
+        }
+        return store_vector(*values) == handle;
+      }
+      return false;
+    }
+
+    bool restore_handle(const httplib::Result& res) const {
+      if (!res || res->status != 400 || res->body.find("Handle\"") == std::string::npos)
+        return false;
+      json response_body = json::parse(res->body, nullptr, false);
+      return !response_body.is_discarded() && restore_handle(response_body);
+    }
+
+    // Upload values to the server. Returns the handle, or an empty string if the server does not support stored vectors.
+    std::string store_vector(const std::vector<double>& values) const {
+      std::string body = MessageBodyWriter().Vector("vec", values).Str();
+      auto res = post_message("/StoreVector", body);
+      if (!res || res->status != 200)
+        return std::string();
+      std::string handle = parse_result_with_error_handling(res).value("vectorHandle", std::string());
+      if (!handle.empty()) {
+        std::lock_guard<std::mutex> lock(handles_mutex);
+        if (stored_vectors.find(handle) == stored_vectors.end())
+          stored_vectors.emplace(handle, std::make_shared<const std::vector<double>>(values));
+      }
+      return handle;
+    }
+
+    // Handles of inputs equal to a stored vector, empty strings for the others. Empty if no vectors are stored.
+    template <typename Inputs>
+    std::vector<std::string> input_handles(const Inputs& inputs) const {
+      std::vector<std::string> handles;
+      std::vector<std::pair<std::string, std::shared_ptr<const std::vector<double>>>> candidates;
+      {
+        std::lock_guard<std::mutex> lock(handles_mutex);
+        if (stored_vectors.empty())
+          return handles;
+        candidates.assign(stored_vectors.begin(), stored_vectors.end());
+      }
+      // Compare outside the lock, large inputs take a moment
+      for (std::size_t i = 0; i < inputs.size(); i++) {
+        for (const auto& stored : candidates) {
+          const std::vector<double>& values = *stored.second;
+          if (values.size() == inputs[i].size() && !values.empty() &&
+              std::memcmp(values.data(), inputs[i].data(), values.size() * sizeof(double)) == 0) {
+            handles.resize(inputs.size());
+            handles[i] = stored.first;
+            break;
+          }
+        }
+      }
+      return handles;
+    }
+
+    json parse_result_with_error_handling(const httplib::Result& res) const {
+      json response_body;
+      try {
+        response_body = json::parse(res->body);
+      } catch (json::parse_error& e) {
+        throw std::runtime_error("Response JSON could not be parsed. Response body: '" + res->body + "'");
+      }
+      if (response_body.find("error") != response_body.end()) {
+        throw_server_error(response_body["error"]);
+      }
+      return response_body;
+    }
+
+    // Same for responses carrying model outputs, whose numeric arrays are parsed directly into std::vectors
+    MessageBody parse_message_with_error_handling(const httplib::Result& res) const {
+      MessageBody response_body;
+      try {
+        response_body = parse_message_body(res->body);
+      } catch (json::parse_error& e) {
+        throw std::runtime_error("Response JSON could not be parsed. Response body: '" + res->body + "'");
+      }
+      if (response_body.fields.find("error") != response_body.fields.end()) {
+        throw_server_error(response_body.fields["error"]);
+      }
+      return response_body;
+    }
+
+    [[noreturn]] static void throw_server_error(const json& error_body) {
+      std::string message = "Model server returned error of type " + error_body["type"].get<std::string>() + ", message: " + error_body["message"].get<std::string>();
+      if (error_body["type"] == "Cancelled")
+        throw CancelledError(message);
+      throw std::runtime_error(message);
+    }
+
+  };
+
+  // Choice of finite difference scheme and step
+  struct FiniteDifferenceOptions {
+    bool central = true;        // Central differences, otherwise forward differences taking about half the evaluations
+    double relative_step = 0.0; // Step relative to the magnitude of the input; 0 picks a near-optimal step for the scheme
+    std::size_t concurrency = 0; // Concurrent evaluations per wrapped model; 0 for one per hardware thread, or parallel_calls() while serving a call
+  };
+
+  // Model providing Gradient, ApplyJacobian, ApplyHessian and Jacobian by finite differences of another model's
+  // Evaluate. All evaluations a derivative needs are independent, and are issued as one wave of concurrent calls,
+  // options.concurrency at once per wrapped model. By default, a wrapped model (e.g. an HTTPModel) receives one call
+  // per hardware thread; wrapped models that are not thread-safe need a concurrency of 1. Served by serveModels, the
+  // server's parallel_calls() applies instead, i.e. one call at a time unless it allows parallel requests.
+  // Each derivative starts its worker threads afresh, at some tens of microseconds per thread. That is negligible next
+  // to evaluations over HTTP, but for a cheap in-process model a concurrency of 1 avoids it.
+  class FiniteDifferenceModel : public Model {
+  public:
+    FiniteDifferenceModel(Model& model, FiniteDifferenceOptions options = FiniteDifferenceOptions())
+    : FiniteDifferenceModel(std::vector<Model*>{&model}, options) {}
+
+    FiniteDifferenceModel(std::vector<Model*> models, FiniteDifferenceOptions options = FiniteDifferenceOptions())
+    : Model(models.empty() ? std::string() : models.front()->GetName()), models(std::move(models)), options(options) {
+      if (this->models.empty())
+        throw std::runtime_error("FiniteDifferenceModel needs at least one model to evaluate");
+    }
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+      return models.front()->GetInputSizes(config_json);
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+      return models.front()->GetOutputSizes(config_json);
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      return models.front()->Evaluate(inputs, config_json);
+    }
+
+    // Column i from f(x + h e_i) and f(x) or f(x - h e_i), for all i in one wave
+    JacobianMatrix Jacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              json config_json = json::parse("{}")) override {
+      const std::vector<double>& x = inputs.at(inWrt);
+      const std::size_t n = x.size();
+      if (n == 0)
+        return JacobianMatrix::Dense(GetOutputSizes(config_json).at(outWrt), 0);
+      std::vector<double> steps(n);
+      for (std::size_t i = 0; i < n; i++)
+        steps[i] = Step(x[i], Factor(1));
+
+      // Forward: f(x), f(x + h e_0), ...; central: f(x + h e_0), f(x - h e_0), ...
+      std::vector<std::vector<double>> values = EvaluatePerturbed(options.central ? 2 * n : n + 1, outWrt, inputs, config_json,
+        [&](std::size_t point, std::vector<std::vector<double>>& perturbed) {
+          if (options.central)
+            perturbed[inWrt][point / 2] += point % 2 == 0 ? steps[point / 2] : -steps[point / 2];
+          else if (point > 0)
+            perturbed[inWrt][point - 1] += steps[point - 1];
+        });
+
+      const std::size_t m = values.front().size();
+      JacobianMatrix jacobian = JacobianMatrix::Dense(m, n);
+      for (std::size_t i = 0; i < n; i++) {
+        const std::vector<double>& plus = options.central ? values[2 * i] : values[i + 1];
+        const std::vector<double>& minus = options.central ? values[2 * i + 1] : values[0];
+        double width = options.central ? 2 * steps[i] : steps[i];
+        for (std::size_t row = 0; row < m; row++)
+          jacobian.values[row * n + i] = (plus[row] - minus[row]) / width;
+      }
+      return jacobian;
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      JacobianMatrix jacobian = Jacobian(outWrt, inWrt, inputs, config_json);
+      if (sens.size() != jacobian.rows)
+        throw std::runtime_error("Sensitivity has size " + std::to_string(sens.size()) + ", expected " + std::to_string(jacobian.rows));
+      std::vector<double> gradient(jacobian.cols, 0.0);
+      for (std::size_t row = 0; row < jacobian.rows; row++)
+        for (std::size_t col = 0; col < jacobian.cols; col++)
+          gradient[col] += sens[row] * jacobian.values[row * jacobian.cols + col];
+      return gradient;
+    }
+
+    // Directional difference along vec, taking two evaluations
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return std::move(ApplyJacobianBlock(outWrt, inWrt, inputs, {vec}, config_json).front());
+    }
+
+    // Directional differences along all vectors in one wave, sharing f(x) if using forward differences
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      const std::size_t k = vecs.size();
+      std::vector<double> steps(k);
+      for (std::size_t i = 0; i < k; i++)
+        steps[i] = DirectionalStep(inputs.at(inWrt), vecs[i], Factor(1));
+
+      // Forward: f(x + h_0 v_0), ..., f(x); central: f(x + h_0 v_0), f(x - h_0 v_0), ...
+      std::vector<std::vector<double>> values = EvaluatePerturbed(options.central ? 2 * k : k + 1, outWrt, inputs, config_json,
+        [&](std::size_t point, std::vector<std::vector<double>>& perturbed) {
+          std::size_t i = options.central ? point / 2 : point;
+          if (i == k)
+            return;
+          double t = options.central && point % 2 == 1 ? -steps[i] : steps[i];
+          for (std::size_t j = 0; j < vecs[i].size(); j++)
+            perturbed[inWrt][j] += t * vecs[i][j];
+        });
+
+      std::vector<std::vector<double>> results(k);
+      for (std::size_t i = 0; i < k; i++) {
+        const std::vector<double>& plus = options.central ? values[2 * i] : values[i];
+        const std::vector<double>& minus = options.central ? values[2 * i + 1] : values[k];
+        double width = options.central ? 2 * steps[i] : steps[i];
+        results[i].assign(plus.size(), 0.0);
+        if (width == 0.0)
+          continue;
+        for (std::size_t row = 0; row < plus.size(); row++)
+          results[i][row] = (plus[row] - minus[row]) / width;
+      }
+      return results;
+    }
+
+    // Mixed second differences of sens^T f in e_i (on inWrt1) and vec (on inWrt2) for all i in one wave
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      const std::vector<double>& x = inputs.at(inWrt1);
+      const std::size_t n = x.size();
+      if (n == 0)
+        return {};
+      double vec_step = DirectionalStep(inputs.at(inWrt2), vec, Factor(2));
+      if (vec_step == 0.0)
+        return std::vector<double>(n, 0.0);
+      std::vector<double> steps(n);
+      for (std::size_t i = 0; i < n; i++)
+        steps[i] = Step(x[i], Factor(2));
+
+      // Signs of the step along e_i and along vec at each of the points
+      const int forward_signs[4][2] = {{1, 1}, {1, 0}, {0, 1}, {0, 0}};
+      const int central_signs[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+      const int (*signs)[2] = options.central ? central_signs : forward_signs;
+      // Central: four points per i. Forward: f(x + h e_i + k v) and f(x + h e_i) per i, then the shared f(x + k v), f(x).
+      const std::size_t points_per_entry = options.central ? 4 : 2;
+      auto sign_of = [&](std::size_t point) -> const int* {
+        if (point < points_per_entry * n)
+          return signs[point % points_per_entry];
+        return signs[2 + point - points_per_entry * n];
+      };
+
+      std::vector<std::vector<double>> values = EvaluatePerturbed(points_per_entry * n + (options.central ? 0 : 2), outWrt, inputs, config_json,
+        [&](std::size_t point, std::vector<std::vector<double>>& perturbed) {
+          const int* sign = sign_of(point);
+          for (std::size_t j = 0; j < vec.size(); j++)
+            perturbed[inWrt2][j] += sign[1] * vec_step * vec[j];
+          if (point < points_per_entry * n)
+            perturbed[inWrt1][point / points_per_entry] += sign[0] * steps[point / points_per_entry];
+        });
+
+      if (sens.size() != values.front().size())
+        throw std::runtime_error("Sensitivity has size " + std::to_string(sens.size()) + ", expected " + std::to_string(values.front().size()));
+      auto objective = [&](std::size_t point) {
+        double sum = 0.0;
+        for (std::size_t row = 0; row < sens.size(); row++)
+          sum += sens[row] * values[point][row];
+        return sum;
+      };
+
+      std::vector<double> result(n);
+      for (std::size_t i = 0; i < n; i++) {
+        if (options.central) {
+          std::size_t p = 4 * i;
+          result[i] = (objective(p) - objective(p + 1) - objective(p + 2) + objective(p + 3)) / (4 * steps[i] * vec_step);
+        } else {
+          std::size_t shared = 2 * n;
+          result[i] = (objective(2 * i) - objective(2 * i + 1) - objective(shared) + objective(shared + 1)) / (steps[i] * vec_step);
+        }
+      }
+      return result;
+    }
+
+    bool SupportsEvaluate() override {
+      return models.front()->SupportsEvaluate();
+    }
+    bool SupportsGradient() override {
+      return models.front()->SupportsEvaluate();
+    }
+    bool SupportsApplyJacobian() override {
+      return models.front()->SupportsEvaluate();
+    }
+    bool SupportsApplyHessian() override {
+      return models.front()->SupportsEvaluate();
+    }
+    bool IsDeterministic() const override {
+      return models.front()->IsDeterministic();
+    }
+
+  private:
+    // Relative step for a first or second derivative. The truncation error of forward differences is O(h) and of
+    // central ones O(h^2), against a rounding error of O(eps / h^derivative); balancing both gives a step of
+    // eps^(1/(derivative+1)) and eps^(1/(derivative+2)) respectively.
+    double Factor(int derivative) const {
+      if (options.relative_step > 0.0)
+        return options.relative_step;
+      return std::pow(std::numeric_limits<double>::epsilon(), 1.0 / (derivative + (options.central ? 2 : 1)));
+    }
+
+    // Step for an entry of value x, scaled to its magnitude and rounded so that x + h is exact
+    static double Step(double x, double factor) {
+      double h = factor * std::max(std::abs(x), 1.0);
+      volatile double shifted = x + h;
+      return shifted - x;
+    }
+
+    // Step along vec for an input x, zero if vec is
+    static double DirectionalStep(const std::vector<double>& x, const std::vector<double>& vec, double factor) {
+      if (vec.size() != x.size())
+        throw std::runtime_error("Vector has size " + std::to_string(vec.size()) + ", expected " + std::to_string(x.size()));
+      double x_norm = 0.0, vec_norm = 0.0;
+      for (std::size_t i = 0; i < x.size(); i++) {
+        x_norm = std::max(x_norm, std::abs(x[i]));
+        vec_norm = std::max(vec_norm, std::abs(vec[i]));
+      }
+      return vec_norm == 0.0 ? 0.0 : factor * std::max(x_norm, 1.0) / vec_norm;
+    }
+
+    // Output outWrt at count copies of inputs, each modified by perturb(point, copy)
+    std::vector<std::vector<double>> EvaluatePerturbed(std::size_t count, unsigned int outWrt,
+                                                       const std::vector<std::vector<double>>& inputs, const json& config_json,
+                                                       const std::function<void(std::size_t, std::vector<std::vector<double>>&)>& perturb) {
+      std::vector<std::vector<double>> values(count);
+      CallContext context;
+      std::atomic<std::size_t> next_point{0};
+      std::mutex error_mutex;
+      std::exception_ptr error;
+      auto evaluate = [&](Model* model) {
+        try {
+          for (std::size_t point = next_point++; point < count; point = next_point++) {
+            std::vector<std::vector<double>> perturbed = inputs;
+            perturb(point, perturbed);
+            values[point] = std::move(model->Evaluate(perturbed, config_json).at(outWrt));
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = std::current_exception();
+          next_point = count;
+        }
+      };
+
+      std::size_t concurrency = options.concurrency;
+      if (concurrency == 0)
+        concurrency = parallel_calls_scoped() ? parallel_calls() : std::max(1u, std::thread::hardware_concurrency());
+      std::size_t num_workers = std::min<std::size_t>(count, models.size() * concurrency);
+      std::vector<std::thread> threads;
+      for (std::size_t i = 1; i < num_workers; i++)
+        threads.emplace_back([&, model = models[i % models.size()]]() {
+          context.Install();
+          evaluate(model);
+        });
+      evaluate(models.front());
+      for (auto& thread : threads)
+        thread.join();
+      if (error)
+        std::rethrow_exception(error);
+      return values;
+    }
+
+    std::vector<Model*> models;
+    FiniteDifferenceOptions options;
+  };
+
+  // Positions of the entries of a Jacobian that may be nonzero, in CSR format
+  struct SparsityPattern {
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    std::vector<std::size_t> row_offsets = {0};
+    std::vector<std::size_t> column_indices;
+
+    // Nonzero entries of the given Jacobian, with the columns of each row in ascending order
+    static SparsityPattern Of(const JacobianMatrix& jacobian) {
+      SparsityPattern pattern;
+      pattern.rows = jacobian.rows;
+      pattern.cols = jacobian.cols;
+      for (std::size_t row = 0; row < jacobian.rows; row++) {
+        if (jacobian.sparse) {
+          for (std::size_t i = jacobian.row_offsets[row]; i < jacobian.row_offsets[row + 1]; i++)
+            if (jacobian.values[i] != 0.0)
+              pattern.column_indices.push_back(jacobian.column_indices[i]);
+          std::sort(pattern.column_indices.begin() + pattern.row_offsets.back(), pattern.column_indices.end());
+        } else {
+          for (std::size_t col = 0; col < jacobian.cols; col++)
+            if (jacobian.values[row * jacobian.cols + col] != 0.0)
+              pattern.column_indices.push_back(col);
+        }
+        pattern.row_offsets.push_back(pattern.column_indices.size());
+      }
+      return pattern;
+    }
+
+    // Entries of either pattern, both of the same size and with ascending columns in each row
+    static SparsityPattern Union(const SparsityPattern& a, const SparsityPattern& b) {
+      if (a.rows != b.rows || a.cols != b.cols)
+        throw std::runtime_error("Sparsity patterns of different sizes");
+      SparsityPattern pattern;
+      pattern.rows = a.rows;
+      pattern.cols = a.cols;
+      for (std::size_t row = 0; row < a.rows; row++) {
+        std::set_union(a.column_indices.begin() + a.row_offsets[row], a.column_indices.begin() + a.row_offsets[row + 1],
+                       b.column_indices.begin() + b.row_offsets[row], b.column_indices.begin() + b.row_offsets[row + 1],
+                       std::back_inserter(pattern.column_indices));
+        pattern.row_offsets.push_back(pattern.column_indices.size());
+      }
+      return pattern;
+    }
+  };
+
+  // Colors of the columns of a sparsity pattern, such that no two columns with an entry in the same row share a color.
+  // Columns with the most entries are colored first, each with the lowest color not taken by a column sharing a row.
+  std::vector<std::size_t> color_columns(const SparsityPattern& pattern) {
+    // Rows of each column
+    std::vector<std::vector<std::size_t>> column_rows(pattern.cols);
+    for (std::size_t row = 0; row < pattern.rows; row++)
+      for (std::size_t i = pattern.row_offsets[row]; i < pattern.row_offsets[row + 1]; i++)
+        column_rows[pattern.column_indices[i]].push_back(row);
+
+    std::vector<std::size_t> order(pattern.cols);
+    for (std::size_t col = 0; col < pattern.cols; col++)
+      order[col] = col;
+    std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+      return column_rows[a].size() > column_rows[b].size();
+    });
+
+    const std::size_t uncolored = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> colors(pattern.cols, uncolored);
+    std::vector<std::size_t> taken_by; // Column that last marked each color as taken
+    for (std::size_t col : order) {
+      for (std::size_t row : column_rows[col])
+        for (std::size_t i = pattern.row_offsets[row]; i < pattern.row_offsets[row + 1]; i++) {
+          std::size_t color = colors[pattern.column_indices[i]];
+          if (color != uncolored)
+            taken_by[color] = col;
+        }
+      std::size_t color = 0;
+      while (color < taken_by.size() && taken_by[color] == col)
+        color++;
+      if (color == taken_by.size())
+        taken_by.push_back(uncolored);
+      colors[col] = color;
+    }
+    return colors;
+  }
+
+  // Model computing sparse Jacobians from one Jacobian action per column color, with all of them passed to the
+  // wrapped model's ApplyJacobianBlock at once. Jacobians follow the sparsity pattern set for the output, input and
+  // config. Otherwise, the pattern is probed on the first Jacobian: it takes in every entry that is nonzero in the full
+  // Jacobian there or at any of num_probes - 1 randomly perturbed inputs, so that entries which merely happen to
+  // vanish at one point (e.g. d(x^2)/dx at x = 0) are kept. Models whose pattern depends on the inputs need it set.
+  // Wrapping a FiniteDifferenceModel recovers sparse Jacobians from one wave of evaluations.
+  class ColoredJacobianModel : public Model {
+  public:
+    explicit ColoredJacobianModel(Model& model, std::size_t num_probes = 3)
+    : Model(model.GetName()), model(model), num_probes(std::max<std::size_t>(num_probes, 1)) {}
+
+    void SetSparsityPattern(unsigned int outWrt, unsigned int inWrt, SparsityPattern pattern, const json& config_json = json::parse("{}")) {
+      std::vector<std::size_t> colors = color_columns(pattern);
+      std::lock_guard<std::mutex> lock(patterns_mutex);
+      patterns[{ConfigKey(config_json), outWrt, inWrt}] = std::make_shared<const ColoredPattern>(ColoredPattern{std::move(pattern), std::move(colors)});
+    }
+
+    // Number of Jacobian actions a Jacobian takes, or zero if no pattern is known yet
+    std::size_t NumColors(unsigned int outWrt, unsigned int inWrt, const json& config_json = json::parse("{}")) const {
+      std::shared_ptr<const ColoredPattern> colored = FindPattern(outWrt, inWrt, config_json);
+      if (!colored || colored->colors.empty())
+        return 0;
+      return *std::max_element(colored->colors.begin(), colored->colors.end()) + 1;
+    }
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetInputSizes(config_json);
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetOutputSizes(config_json);
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      return model.Evaluate(inputs, config_json);
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      return model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+    }
+
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      return model.ApplyJacobianBlock(outWrt, inWrt, inputs, vecs, config_json);
+    }
+
+    std::vector<std::vector<double>> ApplyHessianBlock(unsigned int outWrt,
+                              unsigned int inWrt1,
+                              unsigned int inWrt2,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      return model.ApplyHessianBlock(outWrt, inWrt1, inWrt2, inputs, sens, vecs, config_json);
+    }
+
+    // Sum of the columns of each color as seed vectors; each entry of the pattern is then found in the action on
+    // the seed of its column's color
+    JacobianMatrix Jacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              json config_json = json::parse("{}")) override {
+      std::shared_ptr<const ColoredPattern> colored = FindPattern(outWrt, inWrt, config_json);
+      if (!colored) {
+        JacobianMatrix jacobian = model.Jacobian(outWrt, inWrt, inputs, config_json);
+        SetSparsityPattern(outWrt, inWrt, ProbePattern(outWrt, inWrt, inputs, config_json, jacobian), config_json);
+        return jacobian;
+      }
+      const SparsityPattern& pattern = colored->pattern;
+      if (pattern.rows != GetOutputSizes(config_json).at(outWrt) || pattern.cols != GetInputSizes(config_json).at(inWrt))
+        throw std::runtime_error("Sparsity pattern of size " + std::to_string(pattern.rows) + "x" + std::to_string(pattern.cols) + " does not match the model's Jacobian");
+
+      std::size_t num_colors = colored->colors.empty() ? 0 : *std::max_element(colored->colors.begin(), colored->colors.end()) + 1;
+      std::vector<std::vector<double>> seeds(num_colors, std::vector<double>(pattern.cols, 0.0));
+      for (std::size_t col = 0; col < pattern.cols; col++)
+        seeds[colored->colors[col]][col] = 1.0;
+      std::vector<std::vector<double>> actions = num_colors > 0 ? model.ApplyJacobianBlock(outWrt, inWrt, inputs, seeds, config_json)
+                                                                : std::vector<std::vector<double>>();
+      if (actions.size() != num_colors)
+        throw std::runtime_error("ApplyJacobianBlock returned " + std::to_string(actions.size()) + " results for " + std::to_string(num_colors) + " vectors");
+      for (const auto& action : actions)
+        if (action.size() != pattern.rows)
+          throw std::runtime_error("Jacobian action has size " + std::to_string(action.size()) + ", expected " + std::to_string(pattern.rows));
+
+      std::vector<double> values(pattern.column_indices.size());
+      for (std::size_t row = 0; row < pattern.rows; row++)
+        for (std::size_t i = pattern.row_offsets[row]; i < pattern.row_offsets[row + 1]; i++)
+          values[i] = actions[colored->colors[pattern.column_indices[i]]][row];
+      return JacobianMatrix::Sparse(pattern.rows, pattern.cols, pattern.row_offsets, pattern.column_indices, std::move(values));
+    }
+
+    bool SupportsEvaluate() override {
+      return model.SupportsEvaluate();
+    }
+    bool SupportsGradient() override {
+      return model.SupportsGradient();
+    }
+    bool SupportsApplyJacobian() override {
+      return model.SupportsApplyJacobian();
+    }
+    bool SupportsApplyHessian() override {
+      return model.SupportsApplyHessian();
+    }
+    bool IsDeterministic() const override {
+      return model.IsDeterministic();
+    }
+
+  private:
+    struct ColoredPattern {
+      SparsityPattern pattern;
+      std::vector<std::size_t> colors;
+    };
+
+    // Patterns are kept per config, which may change the model's sizes or structure; no config equals an empty one
+    static std::string ConfigKey(const json& config_json) {
+      return config_json.is_null() ? json::object().dump() : config_json.dump();
+    }
+
+    std::shared_ptr<const ColoredPattern> FindPattern(unsigned int outWrt, unsigned int inWrt, const json& config_json) const {
+      std::lock_guard<std::mutex> lock(patterns_mutex);
+      auto it = patterns.find({ConfigKey(config_json), outWrt, inWrt});
+      return it == patterns.end() ? nullptr : it->second;
+    }
+
+    // Union of the nonzeros of the given Jacobian at inputs and of full Jacobians at randomly perturbed inputs,
+    // each input entry moved by up to 1% of its magnitude (or by up to 0.01 near zero)
+    SparsityPattern ProbePattern(unsigned int outWrt, unsigned int inWrt, const std::vector<std::vector<double>>& inputs,
+                                 const json& config_json, const JacobianMatrix& jacobian) {
+      SparsityPattern pattern = SparsityPattern::Of(jacobian);
+      std::mt19937_64 generator(num_probes); // Fixed seed, so that probing is reproducible
+      std::uniform_real_distribution<double> offset(-0.01, 0.01);
+      for (std::size_t probe = 1; probe < num_probes; probe++) {
+        std::vector<std::vector<double>> perturbed = inputs;
+        for (std::vector<double>& input : perturbed)
+          for (double& value : input)
+            value += offset(generator) * std::max(std::abs(value), 1.0);
+        pattern = SparsityPattern::Union(pattern, SparsityPattern::Of(model.Jacobian(outWrt, inWrt, perturbed, config_json)));
+      }
+      return pattern;
+    }
+
+    Model& model;
+    std::size_t num_probes;
+    mutable std::mutex patterns_mutex;
+    std::map<std::tuple<std::string, unsigned int, unsigned int>, std::shared_ptr<const ColoredPattern>> patterns;
+  };
+
+  // Dual number for forward mode automatic differentiation: a value along with its derivatives in Width directions.
+  // Tangents are stored contiguously and processed in fixed-length loops the compiler can vectorize.
+  template <std::size_t Width>
+  struct Dual {
+    std::array<double, Width> tangent{};
+    double value = 0.0;
+
+    Dual() = default;
+    Dual(double value) : value(value) {}
+  };
+
+  // Dual with value f(a) and derivative f'(a) by the chain rule
+  template <std::size_t Width>
+  Dual<Width> chain(const Dual<Width>& a, double value, double derivative) {
+    Dual<Width> result(value);
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = derivative * a.tangent[i];
+    return result;
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator+(const Dual<Width>& a, const Dual<Width>& b) {
+    Dual<Width> result(a.value + b.value);
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = a.tangent[i] + b.tangent[i];
+    return result;
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator-(const Dual<Width>& a, const Dual<Width>& b) {
+    Dual<Width> result(a.value - b.value);
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = a.tangent[i] - b.tangent[i];
+    return result;
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator*(const Dual<Width>& a, const Dual<Width>& b) {
+    Dual<Width> result(a.value * b.value);
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = a.tangent[i] * b.value + a.value * b.tangent[i];
+    return result;
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator/(const Dual<Width>& a, const Dual<Width>& b) {
+    Dual<Width> result(a.value / b.value);
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = (a.tangent[i] - result.value * b.tangent[i]) / b.value;
+    return result;
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator-(const Dual<Width>& a) {
+    return chain(a, -a.value, -1.0);
+  }
+
+  template <std::size_t Width>
+  Dual<Width> operator+(const Dual<Width>& a) {
+    return a;
+  }
+
+  // Mixed with plain numbers, without the detour through a Dual with zero tangents
+  template <std::size_t Width> Dual<Width> operator+(const Dual<Width>& a, double b) { return chain(a, a.value + b, 1.0); }
+  template <std::size_t Width> Dual<Width> operator+(double a, const Dual<Width>& b) { return chain(b, a + b.value, 1.0); }
+  template <std::size_t Width> Dual<Width> operator-(const Dual<Width>& a, double b) { return chain(a, a.value - b, 1.0); }
+  template <std::size_t Width> Dual<Width> operator-(double a, const Dual<Width>& b) { return chain(b, a - b.value, -1.0); }
+  template <std::size_t Width> Dual<Width> operator*(const Dual<Width>& a, double b) { return chain(a, a.value * b, b); }
+  template <std::size_t Width> Dual<Width> operator*(double a, const Dual<Width>& b) { return chain(b, a * b.value, a); }
+  template <std::size_t Width> Dual<Width> operator/(const Dual<Width>& a, double b) { return chain(a, a.value / b, 1.0 / b); }
+  template <std::size_t Width> Dual<Width> operator/(double a, const Dual<Width>& b) { return chain(b, a / b.value, -a / (b.value * b.value)); }
+
+  template <std::size_t Width, typename Other> Dual<Width>& operator+=(Dual<Width>& a, const Other& b) { return a = a + b; }
+  template <std::size_t Width, typename Other> Dual<Width>& operator-=(Dual<Width>& a, const Other& b) { return a = a - b; }
+  template <std::size_t Width, typename Other> Dual<Width>& operator*=(Dual<Width>& a, const Other& b) { return a = a * b; }
+  template <std::size_t Width, typename Other> Dual<Width>& operator/=(Dual<Width>& a, const Other& b) { return a = a / b; }
+
+  // Comparisons act on values, so that branches in model code follow the undifferentiated evaluation
+  template <std::size_t Width> bool operator<(const Dual<Width>& a, const Dual<Width>& b) { return a.value < b.value; }
+  template <std::size_t Width> bool operator<(const Dual<Width>& a, double b) { return a.value < b; }
+  template <std::size_t Width> bool operator<(double a, const Dual<Width>& b) { return a < b.value; }
+  template <std::size_t Width> bool operator>(const Dual<Width>& a, const Dual<Width>& b) { return a.value > b.value; }
+  template <std::size_t Width> bool operator>(const Dual<Width>& a, double b) { return a.value > b; }
+  template <std::size_t Width> bool operator>(double a, const Dual<Width>& b) { return a > b.value; }
+  template <std::size_t Width> bool operator<=(const Dual<Width>& a, const Dual<Width>& b) { return a.value <= b.value; }
+  template <std::size_t Width> bool operator<=(const Dual<Width>& a, double b) { return a.value <= b; }
+  template <std::size_t Width> bool operator<=(double a, const Dual<Width>& b) { return a <= b.value; }
+  template <std::size_t Width> bool operator>=(const Dual<Width>& a, const Dual<Width>& b) { return a.value >= b.value; }
+  template <std::size_t Width> bool operator>=(const Dual<Width>& a, double b) { return a.value >= b; }
+  template <std::size_t Width> bool operator>=(double a, const Dual<Width>& b) { return a >= b.value; }
+  template <std::size_t Width> bool operator==(const Dual<Width>& a, const Dual<Width>& b) { return a.value == b.value; }
+  template <std::size_t Width> bool operator==(const Dual<Width>& a, double b) { return a.value == b; }
+  template <std::size_t Width> bool operator==(double a, const Dual<Width>& b) { return a == b.value; }
+  template <std::size_t Width> bool operator!=(const Dual<Width>& a, const Dual<Width>& b) { return a.value != b.value; }
+  template <std::size_t Width> bool operator!=(const Dual<Width>& a, double b) { return a.value != b; }
+  template <std::size_t Width> bool operator!=(double a, const Dual<Width>& b) { return a != b.value; }
+
+  // Math functions, found by argument-dependent lookup when model code calls them unqualified after using std::sin etc.
+  template <std::size_t Width> Dual<Width> sin(const Dual<Width>& a) { return chain(a, std::sin(a.value), std::cos(a.value)); }
+  template <std::size_t Width> Dual<Width> cos(const Dual<Width>& a) { return chain(a, std::cos(a.value), -std::sin(a.value)); }
+  template <std::size_t Width> Dual<Width> tan(const Dual<Width>& a) { double t = std::tan(a.value); return chain(a, t, 1.0 + t * t); }
+  template <std::size_t Width> Dual<Width> asin(const Dual<Width>& a) { return chain(a, std::asin(a.value), 1.0 / std::sqrt(1.0 - a.value * a.value)); }
+  template <std::size_t Width> Dual<Width> acos(const Dual<Width>& a) { return chain(a, std::acos(a.value), -1.0 / std::sqrt(1.0 - a.value * a.value)); }
+  template <std::size_t Width> Dual<Width> atan(const Dual<Width>& a) { return chain(a, std::atan(a.value), 1.0 / (1.0 + a.value * a.value)); }
+  template <std::size_t Width> Dual<Width> sinh(const Dual<Width>& a) { return chain(a, std::sinh(a.value), std::cosh(a.value)); }
+  template <std::size_t Width> Dual<Width> cosh(const Dual<Width>& a) { return chain(a, std::cosh(a.value), std::sinh(a.value)); }
+  template <std::size_t Width> Dual<Width> tanh(const Dual<Width>& a) { double t = std::tanh(a.value); return chain(a, t, 1.0 - t * t); }
+  template <std::size_t Width> Dual<Width> exp(const Dual<Width>& a) { double e = std::exp(a.value); return chain(a, e, e); }
+  template <std::size_t Width> Dual<Width> log(const Dual<Width>& a) { return chain(a, std::log(a.value), 1.0 / a.value); }
+  template <std::size_t Width> Dual<Width> log10(const Dual<Width>& a) { return chain(a, std::log10(a.value), 1.0 / (a.value * std::log(10.0))); }
+  template <std::size_t Width> Dual<Width> sqrt(const Dual<Width>& a) { double r = std::sqrt(a.value); return chain(a, r, 0.5 / r); }
+  template <std::size_t Width> Dual<Width> cbrt(const Dual<Width>& a) { double r = std::cbrt(a.value); return chain(a, r, 1.0 / (3.0 * r * r)); }
+  template <std::size_t Width> Dual<Width> abs(const Dual<Width>& a) { return chain(a, std::abs(a.value), a.value < 0.0 ? -1.0 : 1.0); }
+  template <std::size_t Width> Dual<Width> fabs(const Dual<Width>& a) { return abs(a); }
+  template <std::size_t Width> Dual<Width> pow(const Dual<Width>& a, double b) { return chain(a, std::pow(a.value, b), b == 0.0 ? 0.0 : b * std::pow(a.value, b - 1.0)); }
+  template <std::size_t Width> Dual<Width> pow(double a, const Dual<Width>& b) { double p = std::pow(a, b.value); return chain(b, p, p * std::log(a)); }
+  template <std::size_t Width> Dual<Width> pow(const Dual<Width>& a, const Dual<Width>& b) { return exp(b * log(a)); }
+  template <std::size_t Width> Dual<Width> atan2(const Dual<Width>& y, const Dual<Width>& x) {
+    double denominator = x.value * x.value + y.value * y.value;
+    Dual<Width> result(std::atan2(y.value, x.value));
+    for (std::size_t i = 0; i < Width; i++)
+      result.tangent[i] = (x.value * y.tangent[i] - y.value * x.tangent[i]) / denominator;
+    return result;
+  }
+
+  // Base for models whose evaluation is written once as a template over the scalar type:
+  //
+  //   template <typename Scalar>
+  //   std::vector<std::vector<Scalar>> EvaluateGeneric(const std::vector<std::vector<Scalar>>& inputs, const json& config);
+  //
+  // Evaluate instantiates it with double, and Gradient, ApplyJacobian and Jacobian with Dual<Width>, propagating Width
+  // directions per evaluation. Derivatives are exact up to rounding. A Jacobian action takes one evaluation, a
+  // gradient or Jacobian one per Width entries of the input.
+  template <typename Derived, std::size_t Width = 8>
+  class ForwardModeModel : public Model {
+  public:
+    ForwardModeModel(std::string name) : Model(name) {}
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      return derived().template EvaluateGeneric<double>(inputs, config_json);
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return std::move(ApplyJacobianBlock(outWrt, inWrt, inputs, {vec}, config_json).front());
+    }
+
+    // One evaluation per Width vectors
+    std::vector<std::vector<double>> ApplyJacobianBlock(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<std::vector<double>>& vecs,
+                              json config_json = json::parse("{}")) override {
+      for (const auto& vec : vecs)
+        if (vec.size() != inputs.at(inWrt).size())
+          throw std::runtime_error("Vector has size " + std::to_string(vec.size()) + ", expected " + std::to_string(inputs.at(inWrt).size()));
+
+      std::vector<std::vector<double>> results(vecs.size());
+      for (std::size_t begin = 0; begin < vecs.size(); begin += Width) {
+        std::size_t end = std::min(vecs.size(), begin + Width);
+        std::vector<std::vector<Dual<Width>>> outputs = Propagate(inWrt, inputs, config_json, [&](std::size_t entry, std::size_t direction) {
+          return begin + direction < end ? vecs[begin + direction][entry] : 0.0;
+        });
+        const std::vector<Dual<Width>>& output = outputs.at(outWrt);
+        for (std::size_t direction = 0; begin + direction < end; direction++) {
+          results[begin + direction].resize(output.size());
+          for (std::size_t row = 0; row < output.size(); row++)
+            results[begin + direction][row] = output[row].tangent[direction];
+        }
+      }
+      return results;
+    }
+
+    JacobianMatrix Jacobian(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              json config_json = json::parse("{}")) override {
+      const std::size_t cols = inputs.at(inWrt).size();
+      JacobianMatrix jacobian;
+      for (std::size_t begin = 0; begin < cols; begin += Width) {
+        std::vector<std::vector<Dual<Width>>> outputs = PropagateUnitVectors(inWrt, begin, inputs, config_json);
+        const std::vector<Dual<Width>>& output = outputs.at(outWrt);
+        if (begin == 0)
+          jacobian = JacobianMatrix::Dense(output.size(), cols);
+        for (std::size_t row = 0; row < output.size(); row++)
+          for (std::size_t col = begin; col < std::min(cols, begin + Width); col++)
+            jacobian.values[row * cols + col] = output[row].tangent[col - begin];
+      }
+      if (cols == 0)
+        jacobian = JacobianMatrix::Dense(GetOutputSizes(config_json).at(outWrt), 0);
+      return jacobian;
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return EvaluateAndGradient(outWrt, inWrt, inputs, sens, config_json).second;
+    }
+
+    // Outputs come with the first Width entries of the gradient
+    std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              json config_json = json::parse("{}")) override {
+      const std::size_t cols = inputs.at(inWrt).size();
+      std::pair<std::vector<std::vector<double>>, std::vector<double>> result;
+      result.second.assign(cols, 0.0);
+      for (std::size_t begin = 0; begin == 0 || begin < cols; begin += Width) {
+        std::vector<std::vector<Dual<Width>>> outputs = PropagateUnitVectors(inWrt, begin, inputs, config_json);
+        const std::vector<Dual<Width>>& output = outputs.at(outWrt);
+        if (sens.size() != output.size())
+          throw std::runtime_error("Sensitivity has size " + std::to_string(sens.size()) + ", expected " + std::to_string(output.size()));
+        if (begin == 0) {
+          result.first.resize(outputs.size());
+          for (std::size_t i = 0; i < outputs.size(); i++)
+            for (const auto& entry : outputs[i])
+              result.first[i].push_back(entry.value);
+        }
+        for (std::size_t row = 0; row < output.size(); row++)
+          for (std::size_t col = begin; col < std::min(cols, begin + Width); col++)
+            result.second[col] += sens[row] * output[row].tangent[col - begin];
+      }
+      return result;
+    }
+
+    bool SupportsEvaluate() override {
+      return true;
+    }
+    bool SupportsGradient() override {
+      return true;
+    }
+    bool SupportsApplyJacobian() override {
+      return true;
+    }
+
+  protected:
+    Derived& derived() {
+      return static_cast<Derived&>(*this);
+    }
+
+  private:
+    // Outputs for inputs carrying tangents seed(entry, direction) in input inWrt and zero tangents elsewhere
+    template <typename Seed>
+    std::vector<std::vector<Dual<Width>>> Propagate(unsigned int inWrt, const std::vector<std::vector<double>>& inputs,
+                                                    const json& config_json, Seed seed) {
+      std::vector<std::vector<Dual<Width>>> dual_inputs(inputs.size());
+      for (std::size_t i = 0; i < inputs.size(); i++)
+        dual_inputs[i].assign(inputs[i].begin(), inputs[i].end());
+      for (std::size_t entry = 0; entry < dual_inputs.at(inWrt).size(); entry++)
+        for (std::size_t direction = 0; direction < Width; direction++)
+          dual_inputs[inWrt][entry].tangent[direction] = seed(entry, direction);
+      return derived().template EvaluateGeneric<Dual<Width>>(dual_inputs, config_json);
+    }
+
+    // Directions along entries begin to begin + Width - 1 of input inWrt
+    std::vector<std::vector<Dual<Width>>> PropagateUnitVectors(unsigned int inWrt, std::size_t begin,
+                                                               const std::vector<std::vector<double>>& inputs, const json& config_json) {
+      return Propagate(inWrt, inputs, config_json, [begin](std::size_t entry, std::size_t direction) {
+        return entry == begin + direction ? 1.0 : 0.0;
+      });
+    }
+  };
+
+  // Operation tape for reverse mode automatic differentiation, recording for each operation its (up to two) arguments
+  // and the partial derivatives with respect to them. Entries live in fixed-size blocks that are kept when the tape
+  // is cleared, so that after the first evaluation on a thread recording involves no heap allocations.
+  template <typename Base>
+  class Tape {
+  public:
+    static const std::size_t no_entry = std::numeric_limits<std::size_t>::max();
+
+    // Make room for the given number of entries up front
+    void Reserve(std::size_t entries) {
+      while (blocks.size() * block_size < entries)
+        blocks.emplace_back(new Entry[block_size]);
+    }
+
+    // Record an operation, returning its position
+    std::size_t Record(std::size_t argument1 = no_entry, const Base& partial1 = Base(0.0),
+                       std::size_t argument2 = no_entry, const Base& partial2 = Base(0.0)) {
+      if (size == blocks.size() * block_size)
+        blocks.emplace_back(new Entry[block_size]);
+      Entry& entry = blocks[size / block_size][size % block_size];
+      entry.arguments[0] = argument1;
+      entry.arguments[1] = argument2;
+      entry.partials[0] = partial1;
+      entry.partials[1] = partial2;
+      return size++;
+    }
+
+    void Clear() {
+      size = 0;
+    }
+
+    std::size_t Size() const {
+      return size;
+    }
+
+    // Zero the adjoints of all entries recorded so far, before seeding those of the outputs
+    void ClearAdjoints() {
+      adjoints.assign(size, Base(0.0));
+    }
+
+    Base& Adjoint(std::size_t position) {
+      return adjoints[position];
+    }
+
+    // Propagate adjoints from the last entry back to the first
+    void Sweep() {
+      for (std::size_t position = size; position-- > 0;) {
+        const Entry& entry = blocks[position / block_size][position % block_size];
+        const Base& adjoint = adjoints[position];
+        if (entry.arguments[0] != no_entry)
+          adjoints[entry.arguments[0]] += adjoint * entry.partials[0];
+        if (entry.arguments[1] != no_entry)
+          adjoints[entry.arguments[1]] += adjoint * entry.partials[1];
+      }
+    }
+
+  private:
+    struct Entry {
+      std::size_t arguments[2];
+      Base partials[2];
+    };
+    static const std::size_t block_size = 1 << 16;
+
+    std::vector<std::unique_ptr<Entry[]>> blocks;
+    std::size_t size = 0;
+    std::vector<Base> adjoints;
+  };
+
+  // Tape that Reverse<Base> operations on this thread are recorded on
+  template <typename Base>
+  Tape<Base>& active_tape() {
+    static thread_local Tape<Base> tape;
+    return tape;
+  }
+
+  // Number recorded on the active tape for reverse mode automatic differentiation. Base is double for gradients, or
+  // Dual<1> for Hessian actions by forward-over-reverse differentiation. Constants are not recorded.
+  template <typename Base>
+  struct Reverse {
+    Base value;
+    std::size_t position = Tape<Base>::no_entry;
+
+    Reverse() : value(0.0) {}
+    Reverse(double value) : value(value) {}
+    Reverse(const Base& value, std::size_t position) : value(value), position(position) {}
+  };
+
+  // Result of an operation on a, given its value and partial derivative
+  template <typename Base>
+  Reverse<Base> record(const Reverse<Base>& a, const Base& value, const Base& partial) {
+    if (a.position == Tape<Base>::no_entry)
+      return Reverse<Base>(value, Tape<Base>::no_entry);
+    return Reverse<Base>(value, active_tape<Base>().Record(a.position, partial));
+  }
+
+  // Result of an operation on a and b, given its value and partial derivatives
+  template <typename Base>
+  Reverse<Base> record(const Reverse<Base>& a, const Base& partial_a, const Reverse<Base>& b, const Base& partial_b, const Base& value) {
+    if (a.position == Tape<Base>::no_entry)
+      return record(b, value, partial_b);
+    if (b.position == Tape<Base>::no_entry)
+      return record(a, value, partial_a);
+    return Reverse<Base>(value, active_tape<Base>().Record(a.position, partial_a, b.position, partial_b));
+  }
+
+  template <typename Base> Reverse<Base> operator+(const Reverse<Base>& a, const Reverse<Base>& b) { return record(a, Base(1.0), b, Base(1.0), a.value + b.value); }
+  template <typename Base> Reverse<Base> operator-(const Reverse<Base>& a, const Reverse<Base>& b) { return record(a, Base(1.0), b, Base(-1.0), a.value - b.value); }
+  template <typename Base> Reverse<Base> operator*(const Reverse<Base>& a, const Reverse<Base>& b) { return record(a, b.value, b, a.value, a.value * b.value); }
+  template <typename Base> Reverse<Base> operator/(const Reverse<Base>& a, const Reverse<Base>& b) {
+    Base quotient = a.value / b.value;
+    return record(a, 1.0 / b.value, b, -quotient / b.value, quotient);
+  }
+  template <typename Base> Reverse<Base> operator-(const Reverse<Base>& a) { return record(a, -a.value, Base(-1.0)); }
+  template <typename Base> Reverse<Base> operator+(const Reverse<Base>& a) { return a; }
+
+  template <typename Base> Reverse<Base> operator+(const Reverse<Base>& a, double b) { return record(a, a.value + b, Base(1.0)); }
+  template <typename Base> Reverse<Base> operator+(double a, const Reverse<Base>& b) { return record(b, a + b.value, Base(1.0)); }
+  template <typename Base> Reverse<Base> operator-(const Reverse<Base>& a, double b) { return record(a, a.value - b, Base(1.0)); }
+  template <typename Base> Reverse<Base> operator-(double a, const Reverse<Base>& b) { return record(b, a - b.value, Base(-1.0)); }
+  template <typename Base> Reverse<Base> operator*(const Reverse<Base>& a, double b) { return record(a, a.value * b, Base(b)); }
+  template <typename Base> Reverse<Base> operator*(double a, const Reverse<Base>& b) { return record(b, a * b.value, Base(a)); }
+  template <typename Base> Reverse<Base> operator/(const Reverse<Base>& a, double b) { return record(a, a.value / b, Base(1.0 / b)); }
+  template <typename Base> Reverse<Base> operator/(double a, const Reverse<Base>& b) { return record(b, a / b.value, -a / (b.value * b.value)); }
+
+  template <typename Base, typename Other> Reverse<Base>& operator+=(Reverse<Base>& a, const Other& b) { return a = a + b; }
+  template <typename Base, typename Other> Reverse<Base>& operator-=(Reverse<Base>& a, const Other& b) { return a = a - b; }
+  template <typename Base, typename Other> Reverse<Base>& operator*=(Reverse<Base>& a, const Other& b) { return a = a * b; }
+  template <typename Base, typename Other> Reverse<Base>& operator/=(Reverse<Base>& a, const Other& b) { return a = a / b; }
+
+  template <typename Base> bool operator<(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value < b.value; }
+  template <typename Base> bool operator<(const Reverse<Base>& a, double b) { return a.value < b; }
+  template <typename Base> bool operator<(double a, const Reverse<Base>& b) { return a < b.value; }
+  template <typename Base> bool operator>(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value > b.value; }
+  template <typename Base> bool operator>(const Reverse<Base>& a, double b) { return a.value > b; }
+  template <typename Base> bool operator>(double a, const Reverse<Base>& b) { return a > b.value; }
+  template <typename Base> bool operator<=(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value <= b.value; }
+  template <typename Base> bool operator<=(const Reverse<Base>& a, double b) { return a.value <= b; }
+  template <typename Base> bool operator<=(double a, const Reverse<Base>& b) { return a <= b.value; }
+  template <typename Base> bool operator>=(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value >= b.value; }
+  template <typename Base> bool operator>=(const Reverse<Base>& a, double b) { return a.value >= b; }
+  template <typename Base> bool operator>=(double a, const Reverse<Base>& b) { return a >= b.value; }
+  template <typename Base> bool operator==(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value == b.value; }
+  template <typename Base> bool operator==(const Reverse<Base>& a, double b) { return a.value == b; }
+  template <typename Base> bool operator==(double a, const Reverse<Base>& b) { return a == b.value; }
+  template <typename Base> bool operator!=(const Reverse<Base>& a, const Reverse<Base>& b) { return a.value != b.value; }
+  template <typename Base> bool operator!=(const Reverse<Base>& a, double b) { return a.value != b; }
+  template <typename Base> bool operator!=(double a, const Reverse<Base>& b) { return a != b.value; }
+
+  template <typename Base> Reverse<Base> sin(const Reverse<Base>& a) { using std::sin; using std::cos; return record(a, sin(a.value), cos(a.value)); }
+  template <typename Base> Reverse<Base> cos(const Reverse<Base>& a) { using std::sin; using std::cos; return record(a, cos(a.value), -sin(a.value)); }
+  template <typename Base> Reverse<Base> tan(const Reverse<Base>& a) { using std::tan; Base t = tan(a.value); return record(a, t, 1.0 + t * t); }
+  template <typename Base> Reverse<Base> asin(const Reverse<Base>& a) { using std::asin; using std::sqrt; return record(a, asin(a.value), 1.0 / sqrt(1.0 - a.value * a.value)); }
+  template <typename Base> Reverse<Base> acos(const Reverse<Base>& a) { using std::acos; using std::sqrt; return record(a, acos(a.value), -1.0 / sqrt(1.0 - a.value * a.value)); }
+  template <typename Base> Reverse<Base> atan(const Reverse<Base>& a) { using std::atan; return record(a, atan(a.value), 1.0 / (1.0 + a.value * a.value)); }
+  template <typename Base> Reverse<Base> sinh(const Reverse<Base>& a) { using std::sinh; using std::cosh; return record(a, sinh(a.value), cosh(a.value)); }
+  template <typename Base> Reverse<Base> cosh(const Reverse<Base>& a) { using std::sinh; using std::cosh; return record(a, cosh(a.value), sinh(a.value)); }
+  template <typename Base> Reverse<Base> tanh(const Reverse<Base>& a) { using std::tanh; Base t = tanh(a.value); return record(a, t, 1.0 - t * t); }
+  template <typename Base> Reverse<Base> exp(const Reverse<Base>& a) { using std::exp; Base e = exp(a.value); return record(a, e, e); }
+  template <typename Base> Reverse<Base> log(const Reverse<Base>& a) { using std::log; return record(a, log(a.value), 1.0 / a.value); }
+  template <typename Base> Reverse<Base> log10(const Reverse<Base>& a) { using std::log10; return record(a, log10(a.value), 1.0 / (a.value * std::log(10.0))); }
+  template <typename Base> Reverse<Base> sqrt(const Reverse<Base>& a) { using std::sqrt; Base r = sqrt(a.value); return record(a, r, 0.5 / r); }
+  template <typename Base> Reverse<Base> cbrt(const Reverse<Base>& a) { using std::cbrt; Base r = cbrt(a.value); return record(a, r, 1.0 / (3.0 * r * r)); }
+  template <typename Base> Reverse<Base> abs(const Reverse<Base>& a) { using std::abs; return record(a, abs(a.value), Base(a.value < 0.0 ? -1.0 : 1.0)); }
+  template <typename Base> Reverse<Base> fabs(const Reverse<Base>& a) { return abs(a); }
+  template <typename Base> Reverse<Base> pow(const Reverse<Base>& a, double b) { using std::pow; return record(a, pow(a.value, b), b == 0.0 ? Base(0.0) : b * pow(a.value, b - 1.0)); }
+  template <typename Base> Reverse<Base> pow(double a, const Reverse<Base>& b) { using std::pow; Base p = pow(a, b.value); return record(b, p, p * std::log(a)); }
+  template <typename Base> Reverse<Base> pow(const Reverse<Base>& a, const Reverse<Base>& b) { return exp(b * log(a)); }
+  template <typename Base> Reverse<Base> atan2(const Reverse<Base>& y, const Reverse<Base>& x) {
+    using std::atan2;
+    Base denominator = x.value * x.value + y.value * y.value;
+    return record(y, x.value / denominator, x, -y.value / denominator, atan2(y.value, x.value));
+  }
+
+  // Forward mode model additionally providing Gradient and EvaluateAndGradient by one recorded evaluation and a reverse
+  // sweep, and ApplyHessian by forward-over-reverse differentiation, i.e. the reverse sweep carrying directional
+  // derivatives along vec. Their cost is a small multiple of one evaluation, independent of the input size.
+  // EvaluateGeneric is additionally instantiated with Reverse<double> and Reverse<Dual<1>>.
+  template <typename Derived, std::size_t Width = 8>
+  class ReverseModeModel : public ForwardModeModel<Derived, Width> {
+  public:
+    ReverseModeModel(std::string name) : ForwardModeModel<Derived, Width>(name) {}
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return EvaluateAndGradient(outWrt, inWrt, inputs, sens, config_json).second;
+    }
+
+    std::pair<std::vector<std::vector<double>>, std::vector<double>> EvaluateAndGradient(unsigned int outWrt,
+                              unsigned int inWrt,
+                              const std::vector<std::vector<double>>& inputs,
+                              const std::vector<double>& sens,
+                              json config_json = json::parse("{}")) override {
+      Tape<double>& tape = active_tape<double>();
+      std::vector<std::size_t> positions;
+      std::vector<std::vector<Reverse<double>>> outputs = Record<double>(inputs, inWrt, positions, config_json, [](std::size_t, std::size_t) {
+        return 0.0;
+      });
+      Sweep(tape, outputs.at(outWrt), sens);
+
+      std::pair<std::vector<std::vector<double>>, std::vector<double>> result;
+      result.first.resize(outputs.size());
+      for (std::size_t i = 0; i < outputs.size(); i++) {
+        result.first[i].reserve(outputs[i].size());
+        for (const auto& entry : outputs[i])
+          result.first[i].push_back(entry.value);
+      }
+      result.second.reserve(positions.size());
+      for (std::size_t position : positions)
+        result.second.push_back(tape.Adjoint(position));
+      tape.Clear();
+      return result;
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      if (vec.size() != inputs.at(inWrt2).size())
+        throw std::runtime_error("Vector has size " + std::to_string(vec.size()) + ", expected " + std::to_string(inputs.at(inWrt2).size()));
+      Tape<Dual<1>>& tape = active_tape<Dual<1>>();
+      std::vector<std::size_t> positions;
+      std::vector<std::vector<Reverse<Dual<1>>>> outputs = Record<Dual<1>>(inputs, inWrt1, positions, config_json, [&](std::size_t input, std::size_t entry) {
+        return input == inWrt2 ? vec[entry] : 0.0;
+      });
+      Sweep(tape, outputs.at(outWrt), sens);
+
+      std::vector<double> result;
+      result.reserve(positions.size());
+      for (std::size_t position : positions)
+        result.push_back(tape.Adjoint(position).tangent[0]);
+      tape.Clear();
+      return result;
+    }
+
+    bool SupportsApplyHessian() override {
+      return true;
+    }
+
+  private:
+    // Outputs recorded on the active tape, with input inWrt recorded as independent variables at the given positions.
+    // Entries carry tangent(input, entry) if Base is Dual<1>.
+    template <typename Base, typename Tangent>
+    std::vector<std::vector<Reverse<Base>>> Record(const std::vector<std::vector<double>>& inputs, unsigned int inWrt,
+                                                   std::vector<std::size_t>& positions, const json& config_json, Tangent tangent) {
+      if (inWrt >= inputs.size())
+        throw std::runtime_error("Input index " + std::to_string(inWrt) + " out of range");
+      Tape<Base>& tape = active_tape<Base>();
+      tape.Clear();
+      std::vector<std::vector<Reverse<Base>>> reverse_inputs(inputs.size());
+      for (std::size_t i = 0; i < inputs.size(); i++) {
+        reverse_inputs[i].reserve(inputs[i].size());
+        for (std::size_t entry = 0; entry < inputs[i].size(); entry++) {
+          Base value(inputs[i][entry]);
+          SetTangent(value, tangent(i, entry));
+          reverse_inputs[i].emplace_back(value, i == inWrt ? tape.Record() : Tape<Base>::no_entry);
+        }
+      }
+      positions.reserve(reverse_inputs[inWrt].size());
+      for (const auto& entry : reverse_inputs[inWrt])
+        positions.push_back(entry.position);
+      return this->derived().template EvaluateGeneric<Reverse<Base>>(reverse_inputs, config_json);
+    }
+
+    static void SetTangent(double&, double) {}
+    static void SetTangent(Dual<1>& value, double tangent) {
+      value.tangent[0] = tangent;
+    }
+
+    // Seed the adjoints of output with sens and propagate them back to the inputs
+    template <typename Base>
+    static void Sweep(Tape<Base>& tape, const std::vector<Reverse<Base>>& output, const std::vector<double>& sens) {
+      if (sens.size() != output.size())
+        throw std::runtime_error("Sensitivity has size " + std::to_string(sens.size()) + ", expected " + std::to_string(output.size()));
+      tape.ClearAdjoints();
+      for (std::size_t row = 0; row < output.size(); row++)
+        if (output[row].position != Tape<Base>::no_entry)
+          tape.Adjoint(output[row].position) += Base(sens[row]);
+      tape.Sweep();
+    }
+  };
+
+  // k-d tree over points of equal dimension, supporting k nearest neighbour queries. Points are identified by the order
+  // they were inserted in, until the next Rebuild.
+  class KdTree {
+  public:
+    static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+
+    std::size_t Insert(std::vector<double> point) {
+      std::size_t id = nodes.size();
+      dimension = point.size();
+      nodes.push_back(Node{std::move(point)});
+      Node& node = nodes[id];
+      if (root == none) {
+        root = id;
+        node.split = dimension == 0 ? 0.0 : node.point[0];
+        return id;
+      }
+      for (std::size_t parent = root;;) {
+        std::size_t& child = dimension != 0 && node.point[nodes[parent].axis] < nodes[parent].split ? nodes[parent].left : nodes[parent].right;
+        if (child == none) {
+          child = id;
+          node.axis = dimension == 0 ? 0 : (nodes[parent].axis + 1) % dimension;
+          node.split = dimension == 0 ? 0.0 : node.point[node.axis];
+          return id;
+        }
+        parent = child;
+      }
+    }
+
+    // Exclude a point from queries and free its coordinates. The node itself, holding only its split value, is kept
+    // until the next Rebuild.
+    void Remove(std::size_t id) {
+      if (nodes[id].alive) {
+        nodes[id].alive = false;
+        nodes[id].point.clear();
+        nodes[id].point.shrink_to_fit();
+        removed++;
+      }
+    }
+
+    // Bytes taken by a node with a point of the given dimension, e.g. 0 for a removed one
+    static constexpr std::size_t NodeBytes(std::size_t dimension) {
+      return sizeof(Node) + dimension * sizeof(double);
+    }
+
+    // Bytes actually allocated by the tree, including spare capacity
+    std::size_t Footprint() const {
+      std::size_t bytes = nodes.capacity() * sizeof(Node);
+      for (const Node& node : nodes)
+        bytes += node.point.capacity() * sizeof(double);
+      return bytes;
+    }
+
+    const std::vector<double>& Point(std::size_t id) const {
+      return nodes[id].point;
+    }
+
+    std::size_t Size() const {
+      return nodes.size() - removed;
+    }
+
+    // Worth rebuilding once most nodes are removed, or the tree has doubled since it was last balanced
+    bool NeedsRebuild() const {
+      return removed > nodes.size() / 2 || nodes.size() > 2 * balanced_size + 1024;
+    }
+
+    // Squared distances and ids of the k points closest to query, closest first
+    std::vector<std::pair<double, std::size_t>> Nearest(const std::vector<double>& query, std::size_t k) const {
+      std::priority_queue<std::pair<double, std::size_t>> closest; // Farthest of the k closest on top
+      std::vector<std::pair<std::size_t, double>> stack;           // Nodes to visit with a lower bound on their distance
+      if (root != none && k > 0)
+        stack.emplace_back(root, 0.0);
+      while (!stack.empty()) {
+        auto [id, bound] = stack.back();
+        stack.pop_back();
+        if (id == none || (closest.size() == k && bound >= closest.top().first))
+          continue;
+        const Node& node = nodes[id];
+        if (node.alive) {
+          double distance = 0.0;
+          for (std::size_t i = 0; i < query.size(); i++)
+            distance += (query[i] - node.point[i]) * (query[i] - node.point[i]);
+          if (closest.size() < k) {
+            closest.emplace(distance, id);
+          } else if (distance < closest.top().first) {
+            closest.pop();
+            closest.emplace(distance, id);
+          }
+        }
+        if (dimension == 0)
+          continue;
+        double offset = query[node.axis] - node.split;
+        stack.emplace_back(offset < 0 ? node.right : node.left, std::max(bound, offset * offset));
+        stack.emplace_back(offset < 0 ? node.left : node.right, bound);
+      }
+      std::vector<std::pair<double, std::size_t>> result(closest.size());
+      for (std::size_t i = result.size(); i-- > 0; closest.pop())
+        result[i] = closest.top();
+      return result;
+    }
+
+    // Drop removed points and balance the tree. Returns the new id of each old one, none for removed points.
+    std::vector<std::size_t> Rebuild() {
+      std::vector<std::size_t> new_ids(nodes.size(), none);
+      std::vector<Node> old_nodes;
+      old_nodes.swap(nodes);
+      std::vector<std::size_t> order;
+      for (std::size_t id = 0; id < old_nodes.size(); id++) {
+        if (old_nodes[id].alive) {
+          new_ids[id] = order.size();
+          order.push_back(id);
+        }
+      }
+      for (std::size_t id : order)
+        nodes.push_back(Node{std::move(old_nodes[id].point)});
+      removed = 0;
+      balanced_size = nodes.size();
+      std::vector<std::size_t> ids(nodes.size());
+      for (std::size_t id = 0; id < ids.size(); id++)
+        ids[id] = id;
+      root = Build(ids.begin(), ids.end(), 0);
+      return new_ids;
+    }
+
+  private:
+    struct Node {
+      std::vector<double> point;
+      std::size_t left = none;
+      std::size_t right = none;
+      std::size_t axis = 0;
+      double split = 0.0; // Coordinate along axis, kept once the point is removed
+      bool alive = true;
+    };
+
+    // Balanced subtree over the given ids, split at the median along axis. As with Insert, points on either side may
+    // equal the median along axis, which queries allow for.
+    std::size_t Build(std::vector<std::size_t>::iterator begin, std::vector<std::size_t>::iterator end, std::size_t axis) {
+      if (begin == end)
+        return none;
+      auto median = begin + (end - begin) / 2;
+      std::nth_element(begin, median, end, [&](std::size_t a, std::size_t b) {
+        return nodes[a].point[axis] < nodes[b].point[axis];
+      });
+      Node& node = nodes[*median];
+      node.axis = axis;
+      node.split = dimension == 0 ? 0.0 : node.point[axis];
+      std::size_t next_axis = dimension == 0 ? 0 : (axis + 1) % dimension;
+      node.left = Build(begin, median, next_axis);
+      node.right = Build(median + 1, end, next_axis);
+      return *median;
+    }
+
+    std::vector<Node> nodes;
+    std::size_t root = none;
+    std::size_t removed = 0;
+    std::size_t balanced_size = 0;
+    std::size_t dimension = 0;
+  };
+
+  // Tolerance and memory bound of a CachedModel
+  struct CacheOptions {
+    double tolerance = 0.0;                     // Distance of the (flattened) inputs up to which evaluations are reused, 0 for exact matches only
+    std::size_t max_bytes = 256 * 1024 * 1024;  // Bound on the memory taken by cached inputs and outputs
+  };
+
+  struct CacheStatistics {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;      // Bytes counted against max_bytes
+    std::size_t footprint = 0;  // Bytes actually allocated for cached inputs and outputs, including spare capacity
+    std::size_t evictions = 0;
+  };
+
+  // Cached evaluation found near a query
+  struct CachedEvaluation {
+    std::vector<std::vector<double>> inputs;
+    std::vector<std::vector<double>> outputs;
+    double distance = 0.0;
+  };
+
+  // Model reusing earlier evaluations of another model, e.g. an HTTPModel, at inputs within a tolerance of the
+  // requested ones. Evaluated inputs are kept in a k-d tree per config, which also answers k nearest neighbour
+  // queries for interpolation. Least recently used evaluations are dropped beyond a memory bound. Derivatives are
+  // passed through without caching.
+  class CachedModel : public Model {
+  public:
+    CachedModel(Model& model, CacheOptions options = CacheOptions()) : Model(model.GetName()), model(model), options(options) {}
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetInputSizes(config_json);
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetOutputSizes(config_json);
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      std::string key = Key(inputs, config_json);
+      std::vector<double> point = Flatten(inputs);
+      {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto index = indices.find(key);
+        if (index != indices.end()) {
+          auto nearest = index->second.tree.Nearest(point, 1);
+          if (!nearest.empty() && nearest.front().first <= options.tolerance * options.tolerance) {
+            Entry& entry = index->second.entries[nearest.front().second];
+            lru.splice(lru.end(), lru, entry.lru_position);
+            statistics.hits++;
+            return entry.outputs;
+          }
+        }
+        statistics.misses++;
+      }
+
+      std::vector<std::vector<double>> outputs = model.Evaluate(inputs, config_json);
+
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      Insert(key, std::move(point), outputs);
+      return outputs;
+    }
+
+    // Up to k cached evaluations closest to inputs under the same config, closest first
+    std::vector<CachedEvaluation> Nearest(const std::vector<std::vector<double>>& inputs, std::size_t k, json config_json = json::parse("{}")) const {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      auto index = indices.find(Key(inputs, config_json));
+      if (index == indices.end())
+        return {};
+      std::vector<CachedEvaluation> result;
+      for (const auto& [distance, id] : index->second.tree.Nearest(Flatten(inputs), k)) {
+        CachedEvaluation evaluation;
+        const std::vector<double>& point = index->second.tree.Point(id);
+        auto begin = point.begin();
+        for (const auto& input : inputs) {
+          evaluation.inputs.emplace_back(begin, begin + input.size());
+          begin += input.size();
+        }
+        evaluation.outputs = index->second.entries[id].outputs;
+        evaluation.distance = std::sqrt(distance);
+        result.push_back(std::move(evaluation));
+      }
+      return result;
+    }
+
+    // Statistics of the cache so far. The footprint is measured by walking all cached evaluations.
+    CacheStatistics Statistics() const {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      CacheStatistics result = statistics;
+      result.entries = lru.size();
+      for (const auto& [key, index] : indices) {
+        result.footprint += key.capacity() + index.tree.Footprint() + index.entries.capacity() * sizeof(Entry);
+        for (const Entry& entry : index.entries) {
+          result.footprint += entry.outputs.capacity() * sizeof(std::vector<double>);
+          for (const auto& output : entry.outputs)
+            result.footprint += output.capacity() * sizeof(double);
+        }
+      }
+      return result;
+    }
+
+    void Clear() {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      indices.clear();
+      lru.clear();
+      statistics.bytes = 0;
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      return model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+    }
+
+    bool SupportsEvaluate() override {
+      return model.SupportsEvaluate();
+    }
+    bool SupportsGradient() override {
+      return model.SupportsGradient();
+    }
+    bool SupportsApplyJacobian() override {
+      return model.SupportsApplyJacobian();
+    }
+    bool SupportsApplyHessian() override {
+      return model.SupportsApplyHessian();
+    }
+    // Exact matches only return what the model returned for the same inputs, while answers within a tolerance depend on
+    // which evaluations happen to be cached
+    bool IsDeterministic() const override {
+      return options.tolerance == 0.0 && model.IsDeterministic();
+    }
+
+  private:
+    struct Index;
+
+    struct Entry {
+      std::vector<std::vector<double>> outputs;
+      std::list<std::pair<Index*, std::size_t>>::iterator lru_position;
+      std::size_t bytes = 0;
+    };
+
+    // Evaluations under one config and input shape; entries are indexed like the points of the tree
+    struct Index {
+      std::string key;
+      KdTree tree;
+      std::vector<Entry> entries;
+    };
+
+    // Evaluations are only comparable under the same config and input sizes
+    static std::string Key(const std::vector<std::vector<double>>& inputs, const json& config_json) {
+      std::string key = config_json.dump();
+      for (const auto& input : inputs)
+        key += "," + std::to_string(input.size());
+      return key;
+    }
+
+    static std::vector<double> Flatten(const std::vector<std::vector<double>>& inputs) {
+      std::vector<double> point;
+      for (const auto& input : inputs)
+        point.insert(point.end(), input.begin(), input.end());
+      return point;
+    }
+
+    void Insert(const std::string& key, std::vector<double> point, const std::vector<std::vector<double>>& outputs) {
+      Index& index = indices[key];
+      index.key = key;
+      Entry entry;
+      entry.outputs = outputs;
+      entry.bytes = sizeof(Entry) + KdTree::NodeBytes(point.size()) + outputs.size() * sizeof(std::vector<double>);
+      for (const auto& output : outputs)
+        entry.bytes += output.size() * sizeof(double);
+      std::size_t id = index.tree.Insert(std::move(point));
+      entry.lru_position = lru.emplace(lru.end(), &index, id);
+      statistics.bytes += entry.bytes;
+      index.entries.push_back(std::move(entry));
+      if (index.tree.NeedsRebuild())
+        Rebuild(index);
+
+      while (statistics.bytes > options.max_bytes && !lru.empty())
+        Evict();
+    }
+
+    // Drop the least recently used evaluation, freeing its inputs and outputs. Its entry and (emptied) tree node stay
+    // behind, and count towards the memory bound, until the tree is rebuilt once removed points make up half of it.
+    // An index left without evaluations is dropped altogether.
+    void Evict() {
+      auto [index, id] = lru.front();
+      lru.pop_front();
+      Entry& entry = index->entries[id];
+      entry.outputs.clear();
+      entry.outputs.shrink_to_fit();
+      statistics.bytes -= entry.bytes - removed_entry_bytes;
+      statistics.evictions++;
+      entry.bytes = removed_entry_bytes;
+      index->tree.Remove(id);
+      if (index->tree.Size() == 0) {
+        statistics.bytes -= index->entries.size() * removed_entry_bytes;
+        indices.erase(index->key);
+      } else if (index->tree.NeedsRebuild()) {
+        Rebuild(*index);
+      }
+    }
+
+    void Rebuild(Index& index) {
+      statistics.bytes -= (index.entries.size() - index.tree.Size()) * removed_entry_bytes;
+      std::vector<std::size_t> new_ids = index.tree.Rebuild();
+      std::vector<Entry> entries(index.tree.Size());
+      for (std::size_t id = 0; id < new_ids.size(); id++) {
+        if (new_ids[id] == KdTree::none)
+          continue;
+        entries[new_ids[id]] = std::move(index.entries[id]);
+        entries[new_ids[id]].lru_position->second = new_ids[id];
+      }
+      index.entries.swap(entries);
+    }
+
+    // Bytes still taken by an evicted evaluation until its tree is rebuilt
+    static constexpr std::size_t removed_entry_bytes = sizeof(Entry) + KdTree::NodeBytes(0);
+
+    Model& model;
+    CacheOptions options;
+    mutable std::mutex cache_mutex;
+    std::map<std::string, Index> indices;
+    std::list<std::pair<Index*, std::size_t>> lru; // Least recently used first
+    CacheStatistics statistics;
+  };
+
+  // Gaussian process regression with a squared exponential kernel over standardized inputs and outputs. The length
+  // scale is picked from multiples of the median distance between training points by marginal likelihood, and the
+  // kernel amplitude is set to its maximum likelihood estimate for that length scale, so that predicted deviations
+  // match the scale of the residuals rather than that of the outputs.
+  class GaussianProcess {
+  public:
+    // Fit to values[i] observed at points[i]
+    GaussianProcess(std::vector<std::vector<double>> points, const std::vector<std::vector<double>>& values) : points(std::move(points)) {
+      const std::size_t n = this->points.size();
+      if (n == 0 || values.size() != n)
+        throw std::runtime_error("Gaussian process needs one value per training point");
+      Standardize(this->points, input_shift, input_scale);
+      std::vector<std::vector<double>> targets = values;
+      Standardize(targets, output_shift, output_scale);
+
+      double median_distance = MedianDistance();
+      double best_likelihood = -std::numeric_limits<double>::infinity();
+      for (double factor : {0.25, 0.5, 1.0, 2.0, 4.0}) {
+        std::vector<double> cholesky, weights;
+        double variance = 1.0;
+        double likelihood = Fit(median_distance * factor, targets, cholesky, weights, variance);
+        if (likelihood > best_likelihood) {
+          best_likelihood = likelihood;
+          length_scale = median_distance * factor;
+          amplitude = variance;
+          lower = std::move(cholesky);
+          alpha = std::move(weights);
+        }
+      }
+      if (lower.empty())
+        throw std::runtime_error("Gaussian process could not be fitted");
+    }
+
+    // Posterior mean and standard deviation of each output at point
+    void Predict(const std::vector<double>& point, std::vector<double>& mean, std::vector<double>& deviation) const {
+      const std::size_t n = points.size(), m = output_shift.size();
+      std::vector<double> x(point.size());
+      for (std::size_t d = 0; d < point.size(); d++)
+        x[d] = (point[d] - input_shift[d]) / input_scale[d];
+      std::vector<double> k(n);
+      for (std::size_t i = 0; i < n; i++)
+        k[i] = Kernel(x, points[i], length_scale);
+
+      mean.assign(m, 0.0);
+      for (std::size_t i = 0; i < n; i++)
+        for (std::size_t j = 0; j < m; j++)
+          mean[j] += k[i] * alpha[i * m + j];
+      // Variance 1 - k^T K^-1 k, with L v = k
+      double variance = 1.0;
+      for (std::size_t i = 0; i < n; i++) {
+        double v = k[i];
+        for (std::size_t l = 0; l < i; l++)
+          v -= lower[i * n + l] * k[l];
+        k[i] = v / lower[i * n + i];
+        variance -= k[i] * k[i];
+      }
+      deviation.resize(m);
+      for (std::size_t j = 0; j < m; j++) {
+        mean[j] = mean[j] * output_scale[j] + output_shift[j];
+        deviation[j] = std::sqrt(amplitude * std::max(variance, 0.0)) * output_scale[j];
+      }
+    }
+
+  private:
+    static double Kernel(const std::vector<double>& a, const std::vector<double>& b, double length_scale) {
+      return std::exp(-0.5 * SquaredDistance(a, b) / (length_scale * length_scale));
+    }
+
+    static double SquaredDistance(const std::vector<double>& a, const std::vector<double>& b) {
+      double distance = 0.0;
+      for (std::size_t d = 0; d < a.size(); d++)
+        distance += (a[d] - b[d]) * (a[d] - b[d]);
+      return distance;
+    }
+
+    // Shift to zero mean and scale to unit deviation in each component
+    static void Standardize(std::vector<std::vector<double>>& rows, std::vector<double>& shift, std::vector<double>& scale) {
+      const std::size_t dim = rows.front().size();
+      shift.assign(dim, 0.0);
+      scale.assign(dim, 0.0);
+      for (const auto& row : rows)
+        for (std::size_t d = 0; d < dim; d++)
+          shift[d] += row.at(d) / rows.size();
+      for (const auto& row : rows)
+        for (std::size_t d = 0; d < dim; d++)
+          scale[d] += (row[d] - shift[d]) * (row[d] - shift[d]) / rows.size();
+      for (std::size_t d = 0; d < dim; d++)
+        scale[d] = scale[d] > 0.0 ? std::sqrt(scale[d]) : 1.0;
+      for (auto& row : rows)
+        for (std::size_t d = 0; d < dim; d++)
+          row[d] = (row[d] - shift[d]) / scale[d];
+    }
+
+    // Median distance between (up to 100) training points, or 1 if they coincide
+    double MedianDistance() const {
+      std::size_t count = std::min<std::size_t>(points.size(), 100);
+      std::vector<double> distances;
+      for (std::size_t i = 0; i < count; i++)
+        for (std::size_t j = i + 1; j < count; j++)
+          distances.push_back(std::sqrt(SquaredDistance(points[i], points[j])));
+      if (distances.empty())
+        return 1.0;
+      std::nth_element(distances.begin(), distances.begin() + distances.size() / 2, distances.end());
+      double median = distances[distances.size() / 2];
+      return median > 0.0 ? median : 1.0;
+    }
+
+    // Cholesky factor of the unit amplitude kernel matrix, weights K^-1 y and the maximum likelihood amplitude
+    // y^T K^-1 y / (n m) for a length scale, returning the log marginal likelihood at that amplitude, or minus infinity
+    // if the kernel matrix is not numerically positive definite
+    double Fit(double scale, const std::vector<std::vector<double>>& targets, std::vector<double>& cholesky, std::vector<double>& weights, double& variance) const {
+      const std::size_t n = points.size(), m = targets.front().size();
+      const double nugget = 1e-8; // Regularization, in units of the output variance
+      cholesky.assign(n * n, 0.0);
+      for (std::size_t i = 0; i < n; i++) {
+        for (std::size_t j = 0; j <= i; j++) {
+          double sum = Kernel(points[i], points[j], scale) + (i == j ? nugget : 0.0);
+          for (std::size_t l = 0; l < j; l++)
+            sum -= cholesky[i * n + l] * cholesky[j * n + l];
+          if (i == j) {
+            if (!(sum > 0.0))
+              return -std::numeric_limits<double>::infinity();
+            cholesky[i * n + i] = std::sqrt(sum);
+          } else {
+            cholesky[i * n + j] = sum / cholesky[j * n + j];
+          }
+        }
+      }
+      // Forward and back substitution for all outputs at once
+      weights.resize(n * m);
+      for (std::size_t i = 0; i < n; i++)
+        for (std::size_t j = 0; j < m; j++) {
+          double sum = targets[i][j];
+          for (std::size_t l = 0; l < i; l++)
+            sum -= cholesky[i * n + l] * weights[l * m + j];
+          weights[i * m + j] = sum / cholesky[i * n + i];
+        }
+      double squared_norm = 0.0;
+      for (std::size_t i = 0; i < n; i++)
+        for (std::size_t j = 0; j < m; j++)
+          squared_norm += weights[i * m + j] * weights[i * m + j];
+      // Floored, so that exactly interpolated outputs keep a positive deviation away from the training points
+      variance = std::max(squared_norm / (n * m), nugget);
+      double likelihood = -0.5 * n * m * std::log(variance);
+      for (std::size_t i = n; i-- > 0;)
+        for (std::size_t j = 0; j < m; j++) {
+          double sum = weights[i * m + j];
+          for (std::size_t l = i + 1; l < n; l++)
+            sum -= cholesky[l * n + i] * weights[l * m + j];
+          weights[i * m + j] = sum / cholesky[i * n + i];
+        }
+      for (std::size_t i = 0; i < n; i++)
+        likelihood -= m * std::log(cholesky[i * n + i]);
+      return likelihood;
+    }
+
+    std::vector<std::vector<double>> points; // Standardized
+    std::vector<double> input_shift, input_scale, output_shift, output_scale;
+    double length_scale = 1.0;
+    double amplitude = 1.0;    // Kernel variance, in units of the output variance
+    std::vector<double> lower; // Cholesky factor of the kernel matrix, row-major
+    std::vector<double> alpha; // Kernel matrix inverse applied to the standardized outputs, one row per point
+  };
+
+  // Accuracy and training of a SurrogateModel
+  struct SurrogateOptions {
+    double max_error = 1e-3;        // Largest error of any output entry to answer from the surrogate, ...
+    double confidence = 3.0;        // ... taken as this many predicted standard deviations
+    std::size_t min_points = 10;    // Model evaluations before fitting a surrogate
+    std::size_t max_points = 500;   // Most recent model evaluations to fit to
+    std::size_t refit_every = 10;   // New model evaluations to trigger a refit
+  };
+
+  struct SurrogateStatistics {
+    std::size_t surrogate_evaluations = 0;
+    std::size_t model_evaluations = 0;
+    std::size_t refits = 0;
+    std::size_t failed_refits = 0;
+    std::string last_refit_error; // Message of the most recent failed refit
+  };
+
+  // Model answering evaluations from a Gaussian process surrogate of another model, e.g. an HTTPModel, wherever
+  // confidence times the surrogate's predicted standard deviation is below max_error, and from the model itself
+  // otherwise. Surrogates are
+  // trained per config on the model's evaluations, and refitted on a background thread as new ones come in.
+  // Derivatives are passed through to the model.
+  class SurrogateModel : public Model {
+  public:
+    SurrogateModel(Model& model, SurrogateOptions options = SurrogateOptions())
+    : Model(model.GetName()), model(model), options(options), refit_thread([this] { RefitLoop(); }) {}
+
+    SurrogateModel(const SurrogateModel&) = delete;
+    SurrogateModel& operator=(const SurrogateModel&) = delete;
+
+    ~SurrogateModel() {
+      {
+        std::lock_guard<std::mutex> lock(surrogate_mutex);
+        stop = true;
+      }
+      refit_condition.notify_all();
+      refit_thread.join();
+    }
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetInputSizes(config_json);
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetOutputSizes(config_json);
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      std::string key = config_json.dump();
+      std::vector<double> point;
+      for (const auto& input : inputs)
+        point.insert(point.end(), input.begin(), input.end());
+
+      std::shared_ptr<const GaussianProcess> surrogate;
+      std::vector<std::size_t> output_sizes;
+      {
+        std::lock_guard<std::mutex> lock(surrogate_mutex);
+        auto emulator = emulators.find(key);
+        if (emulator != emulators.end() && emulator->second.dimension == point.size()) {
+          surrogate = emulator->second.surrogate;
+          output_sizes = emulator->second.output_sizes;
+        }
+      }
+      if (surrogate) {
+        std::vector<double> mean, deviation;
+        surrogate->Predict(point, mean, deviation);
+        if (options.confidence * *std::max_element(deviation.begin(), deviation.end()) <= options.max_error) {
+          std::vector<std::vector<double>> outputs;
+          auto begin = mean.begin();
+          for (std::size_t size : output_sizes) {
+            outputs.emplace_back(begin, begin + size);
+            begin += size;
+          }
+          std::lock_guard<std::mutex> lock(surrogate_mutex);
+          statistics.surrogate_evaluations++;
+          return outputs;
+        }
+      }
+
+      std::vector<std::vector<double>> outputs = model.Evaluate(inputs, config_json);
+      std::vector<double> values;
+      for (const auto& output : outputs)
+        values.insert(values.end(), output.begin(), output.end());
+
+      std::lock_guard<std::mutex> lock(surrogate_mutex);
+      statistics.model_evaluations++;
+      Emulator& emulator = emulators[key];
+      if (emulator.points.empty() || emulator.dimension != point.size()) {
+        emulator = Emulator();
+        emulator.dimension = point.size();
+        for (const auto& output : outputs)
+          emulator.output_sizes.push_back(output.size());
+      }
+      if (values.empty())
+        return outputs;
+      emulator.points.push_back(std::move(point));
+      emulator.values.push_back(std::move(values));
+      if (emulator.points.size() > options.max_points) {
+        emulator.points.pop_front();
+        emulator.values.pop_front();
+      }
+      emulator.new_points++;
+      if (emulator.points.size() >= options.min_points && (emulator.new_points >= options.refit_every || !emulator.surrogate)) {
+        emulator.refit_pending = true;
+        refit_condition.notify_all();
+      }
+      return outputs;
+    }
+
+    SurrogateStatistics Statistics() const {
+      std::lock_guard<std::mutex> lock(surrogate_mutex);
+      return statistics;
+    }
+
+    // Block until all refits triggered so far are done, e.g. to make later evaluations independent of timing
+    void WaitForRefits() {
+      std::unique_lock<std::mutex> lock(surrogate_mutex);
+      refit_condition.wait(lock, [&] {
+        return !refitting && std::none_of(emulators.begin(), emulators.end(), [](const auto& entry) { return entry.second.refit_pending; });
+      });
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      return model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+    }
+
+    bool SupportsEvaluate() override {
+      return model.SupportsEvaluate();
+    }
+    bool SupportsGradient() override {
+      return model.SupportsGradient();
+    }
+    bool SupportsApplyJacobian() override {
+      return model.SupportsApplyJacobian();
+    }
+    bool SupportsApplyHessian() override {
+      return model.SupportsApplyHessian();
+    }
+    // Answers depend on the evaluations the surrogate has been trained on so far, not only on the inputs
+    bool IsDeterministic() const override {
+      return false;
+    }
+
+  private:
+    // Training data and current surrogate for one config
+    struct Emulator {
+      std::size_t dimension = 0;
+      std::vector<std::size_t> output_sizes;
+      std::deque<std::vector<double>> points;
+      std::deque<std::vector<double>> values;
+      std::size_t new_points = 0;
+      bool refit_pending = false;
+      std::shared_ptr<const GaussianProcess> surrogate;
+    };
+
+    void RefitLoop() {
+      std::unique_lock<std::mutex> lock(surrogate_mutex);
+      while (true) {
+        auto emulator = emulators.end();
+        refit_condition.wait(lock, [&] {
+          emulator = std::find_if(emulators.begin(), emulators.end(), [](const auto& entry) { return entry.second.refit_pending; });
+          return stop || emulator != emulators.end();
+        });
+        if (stop)
+          return;
+        refitting = true;
+        emulator->second.refit_pending = false;
+        emulator->second.new_points = 0;
+        std::vector<std::vector<double>> points(emulator->second.points.begin(), emulator->second.points.end());
+        std::vector<std::vector<double>> values(emulator->second.values.begin(), emulator->second.values.end());
+        std::size_t dimension = emulator->second.dimension;
+        std::string key = emulator->first;
+
+        lock.unlock();
+        std::shared_ptr<const GaussianProcess> surrogate;
+        std::string error;
+        try {
+          surrogate = std::make_shared<const GaussianProcess>(std::move(points), values);
+        } catch (std::exception& e) {
+          error = e.what();
+        }
+        lock.lock();
+
+        auto refitted = emulators.find(key);
+        if (!surrogate) {
+          statistics.failed_refits++;
+          statistics.last_refit_error = error;
+        } else if (refitted != emulators.end() && refitted->second.dimension == dimension) {
+          refitted->second.surrogate = std::move(surrogate);
+          statistics.refits++;
+        }
+        refitting = false;
+        refit_condition.notify_all();
+      }
+    }
+
+    Model& model;
+    SurrogateOptions options;
+    mutable std::mutex surrogate_mutex;
+    std::condition_variable refit_condition;
+    std::map<std::string, Emulator> emulators;
+    SurrogateStatistics statistics;
+    bool stop = false;
+    bool refitting = false;
+    std::thread refit_thread; // Declared last, so that it starts with all other members initialized
+  };
+
+  // Identifies an evaluation by model name, config and the exact input values
+  template <typename Vectors>
+  std::string evaluation_key(const std::string& model_name, const Vectors& inputs, const json& config_json) {
+    std::string key = model_name + '\n' + config_json.dump() + '\n';
+    std::uint64_t count = inputs.size();
+    key.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+      std::uint64_t size = inputs[i].size();
+      key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+      key.append(reinterpret_cast<const char*>(inputs[i].data()), size * sizeof(double));
+    }
+    return key;
+  }
+
+  // Computes identical calls in flight at the same time only once: the first caller with a key computes, and callers
+  // arriving with the same key in the meantime wait for its outputs (or exception). Nothing is kept afterwards.
+  class SingleFlight {
+  public:
+    std::vector<std::vector<double>> Run(const std::string& key, const std::function<std::vector<std::vector<double>>()>& compute) {
+      std::promise<std::vector<std::vector<double>>> promise;
+      {
+        std::unique_lock<std::mutex> lock(flights_mutex);
+        auto flight = flights.find(key);
+        if (flight != flights.end()) {
+          coalesced++;
+          std::shared_future<std::vector<std::vector<double>>> result = flight->second;
+          lock.unlock();
+          try {
+            return result.get();
+          } catch (CancelledError&) {
+            // The first caller was cancelled, which does not mean this one is
+            CurrentCancellation().ThrowIfCancelled();
+            return Run(key, compute);
+          }
+        }
+        flights.emplace(key, promise.get_future().share());
+      }
+      std::vector<std::vector<double>> outputs;
+      try {
+        outputs = compute();
+        promise.set_value(outputs);
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+        Land(key);
+        throw;
+      }
+      Land(key);
+      return outputs;
+    }
+
+    // Number of calls that waited for another one instead of computing
+    std::size_t Coalesced() const {
+      std::lock_guard<std::mutex> lock(flights_mutex);
+      return coalesced;
+    }
+
+  private:
+    void Land(const std::string& key) {
+      std::lock_guard<std::mutex> lock(flights_mutex);
+      flights.erase(key);
+    }
+
+    mutable std::mutex flights_mutex;
+    std::map<std::string, std::shared_future<std::vector<std::vector<double>>>> flights;
+    std::size_t coalesced = 0;
+  };
+
 #ifdef SUPPORT_POSIX_SHMEM
+  struct StoreOptions {
+    bool sync = true; // Sync log and index to disk after each batch of writes, so that evaluations survive power loss as well as crashes
+  };
+
+  struct StoreStatistics {
+    std::size_t evaluations = 0;     // Written to the store
+    std::size_t discarded_bytes = 0; // Incomplete records cut off the end of the log on opening
+    std::size_t failed_writes = 0;   // Evaluations that could not be written
+    std::string last_error;          // Message of the most recent failed write
+  };
+
+  // Append-only log of model evaluations in a file, with a memory-mapped hash index next to it (path + ".index").
+  // Evaluations are keyed by model name, config and the exact input values. Put queues evaluations for a background
+  // thread to write, and Get finds them right away. The log is the only source of truth: records carry a checksum, a
+  // torn record at the end of the log is cut off on opening, and the index is brought up to date with the log, or
+  // rebuilt from it if it does not match. Lookups check the key in the log, so a stale index can only cause misses.
+  // The log is mapped read-only, so that lookups run concurrently with each other and with writes to disk; they only
+  // wait while a written batch is added to the index. Only one process may open a store at a time.
+  class EvaluationStore {
+  public:
+    explicit EvaluationStore(const std::string& path, StoreOptions options = StoreOptions()) : path(path), options(options) {
+      log_fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+      if (log_fd < 0)
+        throw std::runtime_error("Evaluation store " + path + " could not be opened");
+      if (flock(log_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(log_fd);
+        throw std::runtime_error("Evaluation store " + path + " is in use by another process");
+      }
+      struct stat status;
+      fstat(log_fd, &status);
+      log_size = status.st_size;
+      try {
+        MapLog(log_size);
+        OpenIndex();
+        Recover();
+      } catch (...) {
+        if (index)
+          munmap(index, IndexBytes(index->capacity));
+        if (log)
+          munmap(const_cast<char*>(log), mapped_bytes);
+        close(log_fd);
+        throw;
+      }
+      writer = std::thread([this] { WriteLoop(); });
+    }
+
+    EvaluationStore(const EvaluationStore&) = delete;
+    EvaluationStore& operator=(const EvaluationStore&) = delete;
+
+    // Writes all queued evaluations before closing
+    ~EvaluationStore() {
+      {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        stop = true;
+      }
+      queued_condition.notify_all();
+      writer.join();
+      munmap(index, IndexBytes(index->capacity));
+      munmap(const_cast<char*>(log), mapped_bytes);
+      close(log_fd);
+    }
+
+    // Look up an earlier evaluation, returning whether one was found
+    bool Get(const std::string& model_name, const std::vector<std::vector<double>>& inputs, const json& config_json, std::vector<std::vector<double>>& outputs) {
+      std::string key = evaluation_key(model_name, inputs, config_json);
+      std::uint64_t hash = Hash(key.data(), key.size());
+      {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        auto queued = pending.find(key);
+        if (queued != pending.end()) {
+          outputs = queued->second;
+          return true;
+        }
+      }
+      // Written evaluations are indexed before they leave pending, so a miss above is either indexed by now or not stored
+      std::shared_lock<std::shared_mutex> lock(index_mutex);
+      const std::uint64_t mask = index->capacity - 1;
+      Slot* slots = Slots();
+      RecordHeader header;
+      for (std::uint64_t i = hash & mask; slots[i].position != 0; i = (i + 1) & mask) {
+        if (slots[i].hash != hash || !ReadRecord(slots[i].position - 1, header))
+          continue;
+        const char* record_key = log + slots[i].position - 1 + sizeof(header);
+        if (header.key_length == key.size() && std::memcmp(record_key, key.data(), key.size()) == 0) {
+          outputs = DecodeOutputs(record_key + header.key_length, header.outputs_length);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Queue an evaluation to be written to the store
+    void Put(const std::string& model_name, const std::vector<std::vector<double>>& inputs, const json& config_json, const std::vector<std::vector<double>>& outputs) {
+      std::string key = evaluation_key(model_name, inputs, config_json);
+      {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        if (!pending.emplace(key, outputs).second)
+          return;
+        queue.push_back(std::move(key));
+      }
+      queued_condition.notify_one();
+    }
+
+    // Wait until all queued evaluations are written, or have failed to be
+    void Flush() {
+      std::unique_lock<std::mutex> lock(store_mutex);
+      written_condition.wait(lock, [&] { return pending.empty(); });
+    }
+
+    // Number of evaluations written to the store
+    std::size_t Size() const {
+      std::shared_lock<std::shared_mutex> lock(index_mutex);
+      return index->count;
+    }
+
+    StoreStatistics Statistics() const {
+      StoreStatistics result;
+      {
+        std::lock_guard<std::mutex> lock(store_mutex);
+        result = statistics;
+      }
+      result.evaluations = Size();
+      return result;
+    }
+
+  private:
+    static constexpr std::uint32_t record_magic = 0x554d4252;        // "UMBR"
+    static constexpr std::uint64_t index_magic = 0x554d42494e444558; // "UMBINDEX"
+
+    struct RecordHeader {
+      std::uint32_t magic;
+      std::uint32_t key_length;
+      std::uint64_t outputs_length;
+      std::uint64_t hash;     // Of the key
+      std::uint64_t checksum; // Of key and outputs
+    };
+
+    struct IndexHeader {
+      std::uint64_t magic;
+      std::uint64_t capacity; // Number of slots, a power of two
+      std::uint64_t count;
+      std::uint64_t indexed_bytes; // Log prefix covered by the index
+    };
+
+    // Open addressing with linear probing; empty slots have position 0
+    struct Slot {
+      std::uint64_t hash;
+      std::uint64_t position; // Record offset in the log plus one
+    };
+
+    static std::size_t IndexBytes(std::uint64_t capacity) {
+      return sizeof(IndexHeader) + capacity * sizeof(Slot);
+    }
+
+    Slot* Slots() const {
+      return reinterpret_cast<Slot*>(index + 1);
+    }
+
+    // FNV-1a
+    static std::uint64_t Hash(const char* data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+      for (std::size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+      }
+      return hash;
+    }
+
+    static void Append(std::string& bytes, const void* data, std::size_t size) {
+      bytes.append(static_cast<const char*>(data), size);
+    }
+
+    // Vectors as their count, followed by the size and raw values of each
+    static void AppendVectors(std::string& bytes, const std::vector<std::vector<double>>& vectors) {
+      std::uint64_t count = vectors.size();
+      Append(bytes, &count, sizeof(count));
+      for (const auto& vector : vectors) {
+        std::uint64_t size = vector.size();
+        Append(bytes, &size, sizeof(size));
+        Append(bytes, vector.data(), size * sizeof(double));
+      }
+    }
+
+    static std::vector<std::vector<double>> DecodeOutputs(const char* bytes, std::size_t length) {
+      std::size_t offset = 0;
+      auto read = [&](void* data, std::size_t size) {
+        if (size > length - offset)
+          throw std::runtime_error("Corrupt outputs in evaluation store");
+        std::memcpy(data, bytes + offset, size);
+        offset += size;
+      };
+      std::uint64_t count;
+      read(&count, sizeof(count));
+      std::vector<std::vector<double>> outputs;
+      for (std::uint64_t i = 0; i < count; i++) {
+        std::uint64_t size;
+        read(&size, sizeof(size));
+        if (size > length / sizeof(double))
+          throw std::runtime_error("Corrupt outputs in evaluation store");
+        outputs.emplace_back(size);
+        read(outputs.back().data(), size * sizeof(double));
+      }
+      return outputs;
+    }
+
+    // Map at least the first size bytes of the log, with room to grow. Pages past the end of the file are never touched.
+    void MapLog(std::uint64_t size) {
+      if (log && size <= mapped_bytes)
+        return;
+      std::size_t bytes = std::max<std::uint64_t>(2 * size, 1 << 20);
+      void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, log_fd, 0);
+      if (mapping == MAP_FAILED)
+        throw std::runtime_error("Evaluation store " + path + " could not be mapped");
+      if (log)
+        munmap(const_cast<char*>(log), mapped_bytes);
+      log = static_cast<const char*>(mapping);
+      mapped_bytes = bytes;
+    }
+
+    // Verify the record at offset in the mapped log, returning false if it is torn or corrupt. Its key and outputs
+    // follow the header.
+    bool ReadRecord(std::uint64_t offset, RecordHeader& header) const {
+      if (offset > log_size || sizeof(header) > log_size - offset)
+        return false;
+      std::memcpy(&header, log + offset, sizeof(header));
+      std::uint64_t available = log_size - offset - sizeof(header);
+      if (header.magic != record_magic || header.key_length > available || header.outputs_length > available - header.key_length)
+        return false;
+      const char* key = log + offset + sizeof(header);
+      return Hash(key, header.key_length) == header.hash && Hash(key + header.key_length, header.outputs_length, header.hash) == header.checksum;
+    }
+
+    static IndexHeader* MapIndex(int fd, std::uint64_t capacity) {
+      void* mapping = mmap(nullptr, IndexBytes(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED)
+        throw std::runtime_error("Evaluation store index could not be mapped");
+      return static_cast<IndexHeader*>(mapping);
+    }
+
+    // Map a fresh, empty index of the given capacity into the file at index_path
+    static IndexHeader* CreateIndex(const std::string& index_path, std::uint64_t capacity) {
+      int fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || ftruncate(fd, IndexBytes(capacity)) != 0) {
+        if (fd >= 0)
+          close(fd);
+        throw std::runtime_error("Evaluation store index " + index_path + " could not be created");
+      }
+      IndexHeader* header = MapIndex(fd, capacity);
+      close(fd);
+      header->magic = index_magic;
+      header->capacity = capacity;
+      header->count = 0;
+      header->indexed_bytes = 0;
+      return header;
+    }
+
+    // Map the existing index, or start a new one if it does not match the log
+    void OpenIndex() {
+      std::string index_path = path + ".index";
+      int fd = open(index_path.c_str(), O_RDWR);
+      if (fd >= 0) {
+        struct stat status;
+        IndexHeader header;
+        if (fstat(fd, &status) == 0 && status.st_size >= static_cast<off_t>(sizeof(header)) && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+            && header.magic == index_magic && header.capacity >= 16 && (header.capacity & (header.capacity - 1)) == 0
+            && static_cast<std::size_t>(status.st_size) == IndexBytes(header.capacity) && header.indexed_bytes <= log_size
+            && header.count < header.capacity)
+          index = MapIndex(fd, header.capacity);
+        close(fd);
+      }
+      if (!index)
+        index = CreateIndex(index_path, 1024);
+    }
+
+    // Index the records the index does not cover yet, and cut off a torn record at the end of the log
+    void Recover() {
+      std::uint64_t offset = index->indexed_bytes;
+      RecordHeader header;
+      while (offset < log_size && ReadRecord(offset, header)) {
+        Insert(header.hash, offset);
+        offset += sizeof(header) + header.key_length + header.outputs_length;
+      }
+      if (offset < log_size) {
+        statistics.discarded_bytes = log_size - offset;
+        if (ftruncate(log_fd, offset) != 0)
+          throw std::runtime_error("Evaluation store " + path + " could not be truncated");
+        log_size = offset;
+      }
+      index->indexed_bytes = log_size;
+    }
+
+    void Insert(std::uint64_t hash, std::uint64_t offset) {
+      if (2 * (index->count + 1) > index->capacity)
+        Grow();
+      const std::uint64_t mask = index->capacity - 1;
+      Slot* slots = Slots();
+      std::uint64_t i = hash & mask;
+      for (; slots[i].position != 0; i = (i + 1) & mask)
+        if (slots[i].position == offset + 1)
+          return;
+      slots[i].hash = hash;
+      slots[i].position = offset + 1;
+      index->count++;
+    }
+
+    // Rehash into an index of twice the capacity, replacing the old one atomically by rename
+    void Grow() {
+      std::string index_path = path + ".index";
+      IndexHeader* grown = CreateIndex(index_path + ".tmp", 2 * index->capacity);
+      const std::uint64_t mask = grown->capacity - 1;
+      Slot* grown_slots = reinterpret_cast<Slot*>(grown + 1);
+      Slot* slots = Slots();
+      for (std::uint64_t j = 0; j < index->capacity; j++) {
+        if (slots[j].position == 0)
+          continue;
+        std::uint64_t i = slots[j].hash & mask;
+        while (grown_slots[i].position != 0)
+          i = (i + 1) & mask;
+        grown_slots[i] = slots[j];
+      }
+      grown->count = index->count;
+      grown->indexed_bytes = index->indexed_bytes;
+      if (options.sync)
+        msync(grown, IndexBytes(grown->capacity), MS_SYNC);
+      if (rename((index_path + ".tmp").c_str(), index_path.c_str()) != 0) {
+        munmap(grown, IndexBytes(grown->capacity));
+        throw std::runtime_error("Evaluation store index " + index_path + " could not be replaced");
+      }
+      munmap(index, IndexBytes(index->capacity));
+      index = grown;
+    }
+
+    void WriteLoop() {
+      std::unique_lock<std::mutex> lock(store_mutex);
+      while (true) {
+        queued_condition.wait(lock, [&] { return stop || !queue.empty(); });
+        if (queue.empty())
+          return;
+
+        // Serialize the whole queue, and append it to the log outside of the lock
+        std::deque<std::string> batch;
+        batch.swap(queue);
+        std::string bytes;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> records; // Hash and offset
+        for (const std::string& key : batch) {
+          std::string outputs;
+          AppendVectors(outputs, pending.at(key));
+          RecordHeader header;
+          header.magic = record_magic;
+          header.key_length = key.size();
+          header.outputs_length = outputs.size();
+          header.hash = Hash(key.data(), key.size());
+          header.checksum = Hash(outputs.data(), outputs.size(), header.hash);
+          records.emplace_back(header.hash, log_size + bytes.size());
+          Append(bytes, &header, sizeof(header));
+          bytes += key;
+          bytes += outputs;
+        }
+        lock.unlock();
+        std::string error = appendable ? "" : "log could not be truncated after an earlier failed write";
+        if (error.empty()) {
+          try {
+            std::unique_lock<std::shared_mutex> index_lock(index_mutex);
+            MapLog(log_size + bytes.size());
+          } catch (std::exception& e) {
+            error = e.what();
+          }
+        }
+        for (std::size_t offset = 0; error.empty() && offset < bytes.size();) {
+          ssize_t count = write(log_fd, bytes.data() + offset, bytes.size() - offset);
+          if (count <= 0)
+            error = "writing to the log failed: " + std::string(std::strerror(errno));
+          offset += count > 0 ? count : 0;
+        }
+        if (error.empty() && options.sync && fdatasync(log_fd) != 0)
+          error = "syncing the log failed: " + std::string(std::strerror(errno));
+
+        if (error.empty()) {
+          // Index the batch before it leaves pending, see Get
+          {
+            std::unique_lock<std::shared_mutex> index_lock(index_mutex);
+            log_size += bytes.size();
+            for (const auto& record : records)
+              Insert(record.first, record.second);
+            index->indexed_bytes = log_size;
+          }
+          if (options.sync)
+            msync(index, IndexBytes(index->capacity), MS_SYNC);
+        } else if (appendable && ftruncate(log_fd, log_size) != 0) {
+          // Later records would land after the partial write, at offsets the index does not expect
+          appendable = false;
+        }
+        lock.lock();
+
+        if (!error.empty()) {
+          statistics.failed_writes += batch.size();
+          statistics.last_error = error;
+        }
+        for (const std::string& key : batch)
+          pending.erase(key);
+        written_condition.notify_all();
+      }
+    }
+
+    std::string path;
+    StoreOptions options;
+    int log_fd = -1;
+    bool appendable = true; // Only touched by the writer thread
+
+    // Guards the mapped log and index against remapping, and log_size against readers; the writer thread changes them
+    mutable std::shared_mutex index_mutex;
+    const char* log = nullptr;
+    std::size_t mapped_bytes = 0;
+    std::uint64_t log_size = 0; // Bytes of complete records in the log
+    IndexHeader* index = nullptr;
+
+    mutable std::mutex store_mutex;
+    std::condition_variable queued_condition, written_condition;
+    std::unordered_map<std::string, std::vector<std::vector<double>>> pending; // Queued or being written
+    std::deque<std::string> queue;
+    StoreStatistics statistics;
+    bool stop = false;
+    std::thread writer;
+  };
+
+  // Model taking evaluations from an EvaluationStore if present, and recording new ones in it, so that evaluations
+  // carry over between runs. Derivatives are passed through to the model.
+  class StoredModel : public Model {
+  public:
+    StoredModel(Model& model, EvaluationStore& store) : Model(model.GetName()), model(model), store(store) {}
+
+    std::vector<std::size_t> GetInputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetInputSizes(config_json);
+    }
+
+    std::vector<std::size_t> GetOutputSizes(const json& config_json = json::parse("{}")) const override {
+      return model.GetOutputSizes(config_json);
+    }
+
+    std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config_json = json::parse("{}")) override {
+      std::vector<std::vector<double>> outputs;
+      if (store.Get(GetName(), inputs, config_json, outputs))
+        return outputs;
+      outputs = model.Evaluate(inputs, config_json);
+      store.Put(GetName(), inputs, config_json, outputs);
+      return outputs;
+    }
+
+    std::vector<double> Gradient(unsigned int outWrt,
+                                 unsigned int inWrt,
+                                 const std::vector<std::vector<double>>& inputs,
+                                 const std::vector<double>& sens,
+                                 json config_json = json::parse("{}")) override {
+      return model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+    }
+
+    std::vector<double> ApplyJacobian(unsigned int outWrt,
+                                      unsigned int inWrt,
+                                      const std::vector<std::vector<double>>& inputs,
+                                      const std::vector<double>& vec,
+                                      json config_json = json::parse("{}")) override {
+      return model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+    }
+
+    std::vector<double> ApplyHessian(unsigned int outWrt,
+                                     unsigned int inWrt1,
+                                     unsigned int inWrt2,
+                                     const std::vector<std::vector<double>>& inputs,
+                                     const std::vector<double>& sens,
+                                     const std::vector<double>& vec,
+                                     json config_json = json::parse("{}")) override {
+      return model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+    }
+
+    bool SupportsEvaluate() override {
+      return model.SupportsEvaluate();
+    }
+    bool SupportsGradient() override {
+      return model.SupportsGradient();
+    }
+    bool SupportsApplyJacobian() override {
+      return model.SupportsApplyJacobian();
+    }
+    bool SupportsApplyHessian() override {
+      return model.SupportsApplyHessian();
+    }
+    bool IsDeterministic() const override {
+      return model.IsDeterministic();
+    }
+
+  private:
+    Model& model;
+    EvaluationStore& store;
+  };
+#endif
+
+  // Model config registered through /RegisterConfig, along with the model's input and output sizes for it
+  struct RegisteredConfig {
+    std::string model_name;
+    std::string dump;
+    json config;
+    bool has_sizes = false;
+    std::vector<std::size_t> input_sizes;
+    std::vector<std::size_t> output_sizes;
+  };
+
+  // Registered configs by handle, shared by all listeners of a server. Handles are a hash of model name and config,
+  // so a client re-registering a config after it was evicted (or the server restarted) gets the same handle back.
+  // Holds up to capacity configs, dropping the least recently used one beyond that.
+  class ConfigCache {
+  public:
+    explicit ConfigCache(std::size_t capacity = 256) : capacity(capacity) {}
+
+    // Sizes are only evaluated if with_sizes is set, since they may be expensive to obtain (e.g. from a remote model)
+    std::string Register(const Model& model, json config, bool with_sizes) {
+      auto entry = std::make_shared<RegisteredConfig>();
+      entry->model_name = model.GetName();
+      entry->dump = config.dump();
+      entry->config = std::move(config);
+      std::string handle = Hash(entry->model_name, entry->dump);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto existing = entries.find(handle);
+        if (existing != entries.end()) {
+          if (existing->second.first->model_name != entry->model_name || existing->second.first->dump != entry->dump)
+            throw std::runtime_error("Config handle collision");
+          if (existing->second.first->has_sizes || !with_sizes) {
+            recently_used.splice(recently_used.begin(), recently_used, existing->second.second);
+            return handle;
+          }
+        }
+      }
+      // Evaluate sizes without holding the lock, they may take a while
+      if (with_sizes) {
+        entry->input_sizes = model.GetInputSizes(entry->config);
+        entry->output_sizes = model.GetOutputSizes(entry->config);
+        entry->has_sizes = true;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      auto existing = entries.find(handle);
+      if (existing != entries.end()) {
+        existing->second.first = std::move(entry);
+        recently_used.splice(recently_used.begin(), recently_used, existing->second.second);
+        return handle;
+      }
+      recently_used.push_front(handle);
+      entries.emplace(handle, std::make_pair(std::move(entry), recently_used.begin()));
+      if (entries.size() > capacity) {
+        entries.erase(recently_used.back());
+        recently_used.pop_back();
+      }
+      return handle;
+    }
+
+    // Returns nullptr if the handle is unknown or belongs to a different model
+    std::shared_ptr<const RegisteredConfig> Find(const std::string& handle, const std::string& model_name) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto entry = entries.find(handle);
+      if (entry == entries.end() || entry->second.first->model_name != model_name)
+        return nullptr;
+      recently_used.splice(recently_used.begin(), recently_used, entry->second.second);
+      return entry->second.first;
+    }
+
+  private:
+    // 64 bit FNV-1a
+    static std::string Hash(const std::string& model_name, const std::string& dump) {
+      std::uint64_t hash = 14695981039346656037ull;
+      auto add = [&hash](const std::string& text) {
+        for (char c : text) {
+          hash ^= static_cast<unsigned char>(c);
+          hash *= 1099511628211ull;
+        }
+      };
+      add(model_name);
+      add(std::string(1, '\0'));
+      add(dump);
+      char buffer[17];
+      std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+      return buffer;
+    }
+
+    std::mutex mutex;
+    std::size_t capacity;
+    std::list<std::string> recently_used; // Handles, most recently used first
+    std::map<std::string, std::pair<std::shared_ptr<const RegisteredConfig>, std::list<std::string>::iterator>> entries;
+  };
+
+  // Config of a request, given either in full or as the handle of a registered config. The model's input and output
+  // sizes for it come from the registration if available, and are otherwise evaluated once when first needed.
+  class RequestConfig {
+  public:
+    RequestConfig(const json& request_body, ConfigCache& config_cache) {
+      auto handle_field = request_body.find("configHandle");
+      if (handle_field == request_body.end()) {
+        config = request_body.value("config", json());
+        return;
+      }
+      handle = handle_field->get<std::string>();
+      registered = config_cache.Find(handle, request_body.value("name", std::string()));
+    }
+
+    // False if the request referred to a config handle unknown to the server
+    bool Resolved() const {
+      return handle.empty() || registered;
+    }
+
+    const std::string& Handle() const {
+      return handle;
+    }
+
+    const json& Json() const {
+      return registered ? registered->config : config;
+    }
+
+    const std::vector<std::size_t>& InputSizes(const Model& model) {
+      if (registered && registered->has_sizes)
+        return registered->input_sizes;
+      if (!has_input_sizes) {
+        input_sizes = model.GetInputSizes(Json());
+        has_input_sizes = true;
+      }
+      return input_sizes;
+    }
+
+    const std::vector<std::size_t>& OutputSizes(const Model& model) {
+      if (registered && registered->has_sizes)
+        return registered->output_sizes;
+      if (!has_output_sizes) {
+        output_sizes = model.GetOutputSizes(Json());
+        has_output_sizes = true;
+      }
+      return output_sizes;
+    }
+
+  private:
+    json config;
+    std::string handle;
+    std::shared_ptr<const RegisteredConfig> registered;
+    bool has_input_sizes = false;
+    bool has_output_sizes = false;
+    std::vector<std::size_t> input_sizes;
+    std::vector<std::size_t> output_sizes;
+  };
+
+  // Check if a config handle given in the request is known to the server and return error in httplib response
+  bool check_config_handle(const RequestConfig& config, httplib::Response& res) {
+    if (!config.Resolved()) {
+      json response_body;
+      response_body["error"]["type"] = "UnknownConfigHandle";
+      response_body["error"]["message"] = "Config handle '" + config.Handle() + "' is not registered with this server";
+      response_body["error"]["configHandle"] = config.Handle();
+      res.set_content(response_body.dump(), "application/json");
+      res.status = 400;
+      return false;
+    }
+    return true;
+  }
+
+  // Vectors uploaded through /StoreVector, which requests may then refer to by handle in place of model inputs.
+  // Handles are a hash of the content, so re-uploading a vector after it was evicted gives the same handle.
+  // Holds up to capacity bytes of vector data, dropping the least recently used vectors beyond that.
+  class VectorStore {
+  public:
+    explicit VectorStore(std::size_t capacity = std::size_t(1) << 30) : capacity(capacity) {}
+
+    std::string Store(std::vector<double> values) {
+      std::string handle = Hash(values);
+      std::lock_guard<std::mutex> lock(mutex);
+      auto existing = entries.find(handle);
+      if (existing != entries.end()) {
+        if (*existing->second.first != values)
+          throw std::runtime_error("Vector handle collision");
+        recently_used.splice(recently_used.begin(), recently_used, existing->second.second);
+        return handle;
+      }
+      size += values.size() * sizeof(double);
+      recently_used.push_front(handle);
+      entries.emplace(handle, std::make_pair(std::make_shared<const std::vector<double>>(std::move(values)), recently_used.begin()));
+      while (size > capacity && entries.size() > 1) {
+        auto oldest = entries.find(recently_used.back());
+        size -= oldest->second.first->size() * sizeof(double);
+        entries.erase(oldest);
+        recently_used.pop_back();
+      }
+      return handle;
+    }
+
+    // Returns nullptr if the handle is unknown
+    std::shared_ptr<const std::vector<double>> Find(const std::string& handle) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto entry = entries.find(handle);
+      if (entry == entries.end())
+        return nullptr;
+      recently_used.splice(recently_used.begin(), recently_used, entry->second.second);
+      return entry->second.first;
+    }
+
+  private:
+    // 64 bit FNV-1a over the length and the 64 bit words of the values
+    static std::string Hash(const std::vector<double>& values) {
+      std::uint64_t hash = 14695981039346656037ull;
+      auto add = [&hash](std::uint64_t word) {
+        hash ^= word;
+        hash *= 1099511628211ull;
+      };
+      add(values.size());
+      for (double value : values) {
+        std::uint64_t word;
+        std::memcpy(&word, &value, sizeof(word));
+        add(word);
       }
-#endif
+      char buffer[17];
+      std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(hash));
+      return buffer;
     }
 
-    std::vector<double> ApplyHessian(unsigned int outWrt,
-                      unsigned int inWrt1,
-                      unsigned int inWrt2,
-                      const std::vector<std::vector<double>>& inputs,
-                      const std::vector<double>& sens,
-                      const std::vector<double>& vec,
-                      json config_json = json::parse("{}")) override {
+    std::mutex mutex;
+    std::size_t capacity;
+    std::size_t size = 0;
+    std::list<std::string> recently_used; // Handles, most recently used first
+    std::map<std::string, std::pair<std::shared_ptr<const std::vector<double>>, std::list<std::string>::iterator>> entries;
+  };
 
-#ifdef SUPPORT_POSIX_SHMEM
-      if (supportsShMem) {
-        unsigned int tid = pthread_self();
-        std::vector<std::unique_ptr<SharedMemoryVector>> shmem_inputs;
-        for (int i = 0; i < inputs.size(); i++) {
-          shmem_inputs.push_back(std::make_unique<SharedMemoryVector>(inputs[i], "/umbridge_in_" + std::to_string(tid) + "_" + std::to_string(i)));
-        }
-        std::vector<std::size_t> output_sizes = GetOutputSizes(config_json); // Potential optimization: Avoid this call (e.g. share output memory with appropriate dimension from server side, sync with client via POSIX semaphore)
+  // Fill in inputs the request refers to by handle (listed in inputHandles, null for inputs given literally)
+  // and return error in httplib response if a handle is unknown
+  bool resolve_input_handles(const json& request_body, std::vector<std::vector<double>>& inputs, VectorStore& vector_store, httplib::Response& res) {
+    auto handles = request_body.find("inputHandles");
+    if (handles == request_body.end())
+      return true;
+    for (std::size_t i = 0; i < handles->size() && i < inputs.size(); i++) {
+      if (!(*handles)[i].is_string())
+        continue;
+      std::string handle = (*handles)[i].get<std::string>();
+      std::shared_ptr<const std::vector<double>> stored = vector_store.Find(handle);
+      if (!stored) {
+        json response_body;
+        response_body["error"]["type"] = "UnknownVectorHandle";
+        response_body["error"]["message"] = "Vector handle '" + handle + "' is not stored on this server";
+        response_body["error"]["vectorHandle"] = handle;
+        res.set_content(response_body.dump(), "application/json");
+        res.status = 400;
+        return false;
+      }
+      inputs[i].assign(stored->begin(), stored->end());
+    }
+    return true;
+  }
 
-        SharedMemoryVector shmem_output(output_sizes[outWrt], "/umbridge_out_" + std::to_string(tid) + "_" + std::to_string(0), true);
+  // Sessions of a server by model name and id. A background thread drops sessions unused for longer than ttl,
+  // along with their state.
+  class SessionStore {
+  public:
+    explicit SessionStore(std::chrono::steady_clock::duration ttl = std::chrono::minutes(10))
+    : ttl(ttl), sweeper([this]() { Sweep(); }) {}
 
-        json request_body;
-        request_body["tid"] = std::to_string(tid);
-        request_body["name"] = name;
-        request_body["config"] = config_json;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt1"] = inWrt1;
-        request_body["inWrt2"] = inWrt2;
-        request_body["shmem_name"] = "/umbridge";
-        request_body["sens"] = sens;
-        request_body["vec"] = vec;
-        request_body["shmem_num_inputs"] = inputs.size();
-        for (int i = 0; i < inputs.size(); i++) {
-          request_body["shmem_size_" + std::to_string(i)] = inputs[i].size();
-        }
-        if (auto res = cli.Post("/ApplyHessianShMem", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
 
-          std::vector<double> output(output_sizes[outWrt]);
-          output = shmem_output.GetVector();
-          return output;
-        } else {
-          throw std::runtime_error("POST ApplyHessian failed with error type '" + to_string(res.error()) + "'");
-        }
+    ~SessionStore() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      stop.notify_all();
+      sweeper.join();
+    }
+
+    // Existing session, or a new one if there is none with that id
+    std::shared_ptr<Session> Get(const std::string& model_name, const std::string& id) {
+      std::string key = model_name + '\0' + id;
+      std::lock_guard<std::mutex> lock(mutex);
+      auto entry = entries.find(key);
+      if (entry == entries.end()) {
+        recently_used.push_front(key);
+        entry = entries.emplace(key, Entry{std::make_shared<Session>(id), recently_used.begin(), {}}).first;
       } else {
-#endif
-        json request_body;
-        request_body["name"] = name;
-        request_body["outWrt"] = outWrt;
-        request_body["inWrt1"] = inWrt1;
-        request_body["inWrt2"] = inWrt2;
-        for (std::size_t i = 0; i < inputs.size(); i++) {
-          request_body["input"][i] = inputs[i];
-        }
-        request_body["sens"] = sens;
-        request_body["vec"] = vec;
-        request_body["config"] = config_json;
+        recently_used.splice(recently_used.begin(), recently_used, entry->second.position);
+      }
+      entry->second.last_used = std::chrono::steady_clock::now();
+      return entry->second.session;
+    }
 
-        if (auto res = cli.Post("/ApplyHessian", headers, request_body.dump(), "application/json")) {
-          json response_body = parse_result_with_error_handling(res);
+    void Close(const std::string& model_name, const std::string& id) {
+      std::shared_ptr<Session> closed; // Released outside the lock, freeing state may take a while
+      std::lock_guard<std::mutex> lock(mutex);
+      auto entry = entries.find(model_name + '\0' + id);
+      if (entry == entries.end())
+        return;
+      closed = std::move(entry->second.session);
+      recently_used.erase(entry->second.position);
+      entries.erase(entry);
+    }
 
-          return response_body["output"].get<std::vector<double>>();
-        } else {
-          throw std::runtime_error("POST ApplyHessian failed with error type '" + to_string(res.error()) + "'");
+  private:
+    struct Entry {
+      std::shared_ptr<Session> session;
+      std::list<std::string>::iterator position;
+      std::chrono::steady_clock::time_point last_used;
+    };
+
+    void Sweep() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping) {
+        stop.wait_for(lock, std::max<std::chrono::steady_clock::duration>(ttl / 4, std::chrono::milliseconds(10)));
+        std::vector<std::shared_ptr<Session>> expired;
+        auto now = std::chrono::steady_clock::now();
+        for (std::size_t unchecked = entries.size(); unchecked > 0; unchecked--) {
+          auto oldest = entries.find(recently_used.back());
+          if (now - oldest->second.last_used < ttl)
+            break;
+          // A session serving a call counts as used. Dropping it would let the next call of that id start a new session
+          // alongside it. Only SessionScope holds further references, and it takes them under the lock in Get.
+          if (oldest->second.session.use_count() > 1) {
+            oldest->second.last_used = now;
+            recently_used.splice(recently_used.begin(), recently_used, oldest->second.position);
+            continue;
+          }
+          expired.push_back(std::move(oldest->second.session));
+          entries.erase(oldest);
+          recently_used.pop_back();
         }
-#ifdef SUPPORT_POSIX_SHMEM
+        lock.unlock();
+        expired.clear();
+        lock.lock();
       }
-#endif
     }
 
-    bool SupportsEvaluate() override {
-      return supportsEvaluate;
+    std::chrono::steady_clock::duration ttl;
+    std::mutex mutex;
+    std::condition_variable stop;
+    bool stopping = false;
+    std::list<std::string> recently_used; // Keys, most recently used first
+    std::map<std::string, Entry> entries;
+    std::thread sweeper;
+  };
+
+  // Calls in flight that sent an id, by which their clients may cancel them through /Cancel
+  class CallRegistry {
+  public:
+    void Add(const std::string& id, std::shared_ptr<CancellationToken> token) {
+      std::lock_guard<std::mutex> lock(mutex);
+      calls.emplace(id, std::move(token));
     }
-    bool SupportsGradient() override {
-      return supportsGradient;
+
+    void Remove(const std::string& id, const CancellationToken* token) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto range = calls.equal_range(id);
+      for (auto call = range.first; call != range.second; ++call) {
+        if (call->second.get() == token) {
+          calls.erase(call);
+          return;
+        }
+      }
     }
-    bool SupportsApplyJacobian() override {
-      return supportsApplyJacobian;
+
+    // Cancel the calls in flight under id, returning how many there were. Their cancellation callbacks run outside of
+    // the registry's lock, and the tokens are kept alive for them even if the calls finish meanwhile.
+    std::size_t Cancel(const std::string& id) {
+      std::vector<std::shared_ptr<CancellationToken>> tokens;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = calls.equal_range(id);
+        for (auto call = range.first; call != range.second; ++call)
+          tokens.push_back(call->second);
+      }
+      for (const auto& token : tokens)
+        token->Cancel();
+      return tokens.size();
     }
-    bool SupportsApplyHessian() override {
-      return supportsApplyHessian;
+
+  private:
+    std::mutex mutex;
+    std::multimap<std::string, std::shared_ptr<CancellationToken>> calls;
+  };
+
+  // Makes the cancellation token of a request current while the model serves it. Its deadline is counted from when
+  // the server starts handling the request; handlers drop calls whose token is cancelled before the model gets them.
+  class CancellationScope {
+  public:
+    CancellationScope(const httplib::Request& req, CallRegistry& calls)
+    : token(std::make_shared<CancellationToken>(DeadlineOf(req))), calls(calls), id(req.get_header_value(call_id_header)),
+      previous(current_cancellation()) {
+      if (!id.empty())
+        calls.Add(id, token);
+      current_cancellation() = token.get();
+    }
+
+    CancellationScope(const CancellationScope&) = delete;
+    CancellationScope& operator=(const CancellationScope&) = delete;
+
+    ~CancellationScope() {
+      current_cancellation() = previous;
+      if (!id.empty())
+        calls.Remove(id, token.get());
     }
 
   private:
+    // No deadline if the header is missing or not an integer, rather than one that has already passed
+    static CancellationToken::Clock::time_point DeadlineOf(const httplib::Request& req) {
+      std::string header = req.get_header_value(deadline_header);
+      long long remaining = 0;
+      auto [end, error] = std::from_chars(header.data(), header.data() + header.size(), remaining);
+      if (header.empty() || error != std::errc() || end != header.data() + header.size())
+        return CancellationToken::Clock::time_point::max();
+      // Capped, so that adding it to the current time cannot overflow
+      remaining = std::min(std::max(remaining, 0LL), 100LL * 365 * 24 * 60 * 60 * 1000);
+      return CancellationToken::Clock::now() + std::chrono::milliseconds(remaining);
+    }
 
-    mutable httplib::Client cli;
-    httplib::Headers headers;
+    std::shared_ptr<CancellationToken> token; // Shared with the registry, which may cancel it while the call finishes
+    CallRegistry& calls;
+    std::string id;
+    CancellationToken* previous;
+  };
 
-    bool supportsEvaluate = false;
-    bool supportsGradient = false;
-    bool supportsApplyJacobian = false;
-    bool supportsApplyHessian = false;
-#ifdef SUPPORT_POSIX_SHMEM
-    bool supportsShMem = false;
-#endif
-    
-    json parse_result_with_error_handling(const httplib::Result& res) const {
-      json response_body;
-      try {
-        response_body = json::parse(res->body);
-      } catch (json::parse_error& e) {
-        throw std::runtime_error("Response JSON could not be parsed. Response body: '" + res->body + "'");
-      }
-      if (response_body.find("error") != response_body.end()) {
-        throw std::runtime_error("Model server returned error of type " + response_body["error"]["type"].get<std::string>() + ", message: " + response_body["error"]["message"].get<std::string>());
-      }
-      return response_body;
+  // Makes the session a request belongs to (if any) current while the model serves it, one call at a time
+  class SessionScope {
+  public:
+    SessionScope(const json& request_body, SessionStore& sessions) {
+      auto id = request_body.find("session");
+      if (id == request_body.end() || !id->is_string())
+        return;
+      session = sessions.Get(request_body.value("name", std::string()), id->get<std::string>());
+      call_lock = std::unique_lock<std::mutex>(session->call_mutex);
+      previous = current_session();
+      current_session() = session.get();
+    }
+
+    SessionScope(const SessionScope&) = delete;
+    SessionScope& operator=(const SessionScope&) = delete;
+
+    ~SessionScope() {
+      if (session)
+        current_session() = previous;
     }
 
+  private:
+    std::shared_ptr<Session> session;
+    std::unique_lock<std::mutex> call_lock;
+    Session* previous = nullptr;
   };
 
   // Check if inputs dimensions match model's expected input size and return error in httplib response
-  bool check_input_sizes(const std::vector<std::vector<double>>& inputs, const json& config_json, const Model& model, httplib::Response& res) {
-    if (inputs.size() != model.GetInputSizes(config_json).size()) {
+  bool check_input_sizes(const std::vector<std::size_t>& input_sizes, RequestConfig& config, const Model& model, httplib::Response& res) {
+    const std::vector<std::size_t>& model_input_sizes = config.InputSizes(model);
+    if (input_sizes.size() != model_input_sizes.size()) {
       json response_body;
       response_body["error"]["type"] = "InvalidInput";
-      response_body["error"]["message"] = "Number of inputs does not match number of model inputs. Expected " + std::to_string(model.GetInputSizes(config_json).size()) + " but got " + std::to_string(inputs.size());
+      response_body["error"]["message"] = "Number of inputs does not match number of model inputs. Expected " + std::to_string(model_input_sizes.size()) + " but got " + std::to_string(input_sizes.size());
       res.set_content(response_body.dump(), "application/json");
       res.status = 400;
       return false;
     }
-    for (std::size_t i = 0; i < inputs.size(); i++) {
-      if (inputs[i].size() != model.GetInputSizes(config_json)[i]) {
+    for (std::size_t i = 0; i < input_sizes.size(); i++) {
+      if (input_sizes[i] != model_input_sizes[i]) {
         json response_body;
         response_body["error"]["type"] = "InvalidInput";
-        response_body["error"]["message"] = "Input size mismatch! In input " + std::to_string(i) + " model expected size " + std::to_string(model.GetInputSizes(config_json)[i]) + " but got " + std::to_string(inputs[i].size());
+        response_body["error"]["message"] = "Input size mismatch! In input " + std::to_string(i) + " model expected size " + std::to_string(model_input_sizes[i]) + " but got " + std::to_string(input_sizes[i]);
         res.set_content(response_body.dump(), "application/json");
         res.status = 400;
         return false;
@@ -552,12 +5742,20 @@ namespace umbridge {
     return true;
   }
 
+  bool check_input_sizes(const std::vector<std::vector<double>>& inputs, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::vector<std::size_t> input_sizes(inputs.size());
+    for (std::size_t i = 0; i < inputs.size(); i++)
+      input_sizes[i] = inputs[i].size();
+    return check_input_sizes(input_sizes, config, model, res);
+  }
+
   // Check if sensitivity vector's dimension matches correct model output size and return error in httplib response
-  bool check_sensitivity_size(const std::vector<double>& sens, int outWrt, const json& config_json, const Model& model, httplib::Response& res) {
-    if (sens.size() != model.GetOutputSizes(config_json)[outWrt]) {
+  bool check_sensitivity_size(const std::vector<double>& sens, int outWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t expected_size = config.OutputSizes(model)[outWrt];
+    if (sens.size() != expected_size) {
       json response_body;
       response_body["error"]["type"] = "InvalidInput";
-      response_body["error"]["message"] = "Sensitivity vector size mismatch! Expected " + std::to_string(model.GetOutputSizes(config_json)[outWrt]) + " but got " + std::to_string(sens.size());
+      response_body["error"]["message"] = "Sensitivity vector size mismatch! Expected " + std::to_string(expected_size) + " but got " + std::to_string(sens.size());
       res.set_content(response_body.dump(), "application/json");
       res.status = 400;
       return false;
@@ -566,11 +5764,12 @@ namespace umbridge {
   }
 
   // Check if vector's dimension matches correct model output size and return error in httplib response
-  bool check_vector_size(const std::vector<double>& vec, int inWrt, const json& config_json, const Model& model, httplib::Response& res) {
-    if (vec.size() != model.GetInputSizes(config_json)[inWrt]) {
+  bool check_vector_size(const std::vector<double>& vec, int inWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t expected_size = config.InputSizes(model)[inWrt];
+    if (vec.size() != expected_size) {
       json response_body;
       response_body["error"]["type"] = "InvalidInput";
-      response_body["error"]["message"] = "Vector size mismatch! Expected " + std::to_string(model.GetInputSizes(config_json)[inWrt]) + " but got " + std::to_string(vec.size());
+      response_body["error"]["message"] = "Vector size mismatch! Expected " + std::to_string(expected_size) + " but got " + std::to_string(vec.size());
       res.set_content(response_body.dump(), "application/json");
       res.status = 400;
       return false;
@@ -578,21 +5777,30 @@ namespace umbridge {
     return true;
   }
 
+  // Check each of a block of vectors like check_vector_size
+  bool check_vector_sizes(const std::vector<std::vector<double>>& vecs, int inWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    for (const auto& vec : vecs)
+      if (!check_vector_size(vec, inWrt, config, model, res))
+        return false;
+    return true;
+  }
+
   // Check if outputs dimensions match model's expected output size and return error in httplib response
-  bool check_output_sizes(const std::vector<std::vector<double>>& outputs, const json& config_json, const Model& model, httplib::Response& res) {
-    if (outputs.size() != model.GetOutputSizes(config_json).size()) {
+  bool check_output_sizes(const std::vector<std::vector<double>>& outputs, RequestConfig& config, const Model& model, httplib::Response& res) {
+    const std::vector<std::size_t>& model_output_sizes = config.OutputSizes(model);
+    if (outputs.size() != model_output_sizes.size()) {
       json response_body;
       response_body["error"]["type"] = "InvalidOutput";
-      response_body["error"]["message"] = "Number of outputs declared by model does not match number of outputs returned by model. Model declared " + std::to_string(model.GetOutputSizes(config_json).size()) + " but returned " + std::to_string(outputs.size());
+      response_body["error"]["message"] = "Number of outputs declared by model does not match number of outputs returned by model. Model declared " + std::to_string(model_output_sizes.size()) + " but returned " + std::to_string(outputs.size());
       res.set_content(response_body.dump(), "application/json");
       res.status = 500;
       return false;
     }
     for (std::size_t i = 0; i < outputs.size(); i++) {
-      if (outputs[i].size() != model.GetOutputSizes(config_json)[i]) {
+      if (outputs[i].size() != model_output_sizes[i]) {
         json response_body;
         response_body["error"]["type"] = "InvalidOutput";
-        response_body["error"]["message"] = "Output size mismatch! In output " + std::to_string(i) + " model declared size " + std::to_string(model.GetOutputSizes(config_json)[i]) + " but returned " + std::to_string(outputs[i].size());
+        response_body["error"]["message"] = "Output size mismatch! In output " + std::to_string(i) + " model declared size " + std::to_string(model_output_sizes[i]) + " but returned " + std::to_string(outputs[i].size());
         res.set_content(response_body.dump(), "application/json");
         res.status = 500;
         return false;
@@ -601,12 +5809,44 @@ namespace umbridge {
     return true;
   }
 
+  // Check if a gradient returned by the model matches the size of input inWrt and return error in httplib response
+  bool check_gradient_size(const std::vector<double>& gradient, int inWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t expected_size = config.InputSizes(model)[inWrt];
+    if (gradient.size() != expected_size) {
+      json response_body;
+      response_body["error"]["type"] = "InvalidOutput";
+      response_body["error"]["message"] = "Gradient size mismatch! Model declared input size " + std::to_string(expected_size) + " but returned a gradient of size " + std::to_string(gradient.size());
+      res.set_content(response_body.dump(), "application/json");
+      res.status = 500;
+      return false;
+    }
+    return true;
+  }
+
+  // Check if a Jacobian returned by the model is well-formed and matches the sizes of output outWrt and input inWrt
+  bool check_jacobian(const JacobianMatrix& jacobian, int outWrt, int inWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t rows = config.OutputSizes(model)[outWrt];
+    std::size_t cols = config.InputSizes(model)[inWrt];
+    std::string error = jacobian.Validate();
+    if (error.empty() && (jacobian.rows != rows || jacobian.cols != cols))
+      error = "Jacobian size mismatch! Model declared " + std::to_string(rows) + "x" + std::to_string(cols) + " but returned " + std::to_string(jacobian.rows) + "x" + std::to_string(jacobian.cols);
+    if (error.empty())
+      return true;
+    json response_body;
+    response_body["error"]["type"] = "InvalidOutput";
+    response_body["error"]["message"] = error;
+    res.set_content(response_body.dump(), "application/json");
+    res.status = 500;
+    return false;
+  }
+
   // Check if inWrt is between zero and model's input size inWrt and return error in httplib response
-  bool check_input_wrt(int inWrt, const json& config_json, const Model& model, httplib::Response& res) {
-    if (inWrt < 0 || inWrt >= (int)model.GetInputSizes(config_json).size()) {
+  bool check_input_wrt(int inWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t num_inputs = config.InputSizes(model).size();
+    if (inWrt < 0 || inWrt >= (int)num_inputs) {
       json response_body;
       response_body["error"]["type"] = "InvalidInput";
-      response_body["error"]["message"] = "Input inWrt out of range! Expected between 0 and " + std::to_string(model.GetInputSizes(config_json).size() - 1) + " but got " + std::to_string(inWrt);
+      response_body["error"]["message"] = "Input inWrt out of range! Expected between 0 and " + std::to_string(num_inputs - 1) + " but got " + std::to_string(inWrt);
       res.set_content(response_body.dump(), "application/json");
       res.status = 400;
       return false;
@@ -615,11 +5855,12 @@ namespace umbridge {
   }
 
   // Check if outWrt is between zero and model's output size outWrt and return error in httplib response
-  bool check_output_wrt(int outWrt, const json& config_json, const Model& model, httplib::Response& res) {
-    if (outWrt < 0 || outWrt >= (int)model.GetOutputSizes(config_json).size()) {
+  bool check_output_wrt(int outWrt, RequestConfig& config, const Model& model, httplib::Response& res) {
+    std::size_t num_outputs = config.OutputSizes(model).size();
+    if (outWrt < 0 || outWrt >= (int)num_outputs) {
       json response_body;
       response_body["error"]["type"] = "InvalidInput";
-      response_body["error"]["message"] = "Input outWrt out of range! Expected between 0 and " + std::to_string(model.GetOutputSizes(config_json).size() - 1) + " but got " + std::to_string(outWrt);
+      response_body["error"]["message"] = "Input outWrt out of range! Expected between 0 and " + std::to_string(num_outputs - 1) + " but got " + std::to_string(outWrt);
       res.set_content(response_body.dump(), "application/json");
       res.status = 400;
       return false;
@@ -667,14 +5908,151 @@ namespace umbridge {
     return true;
   }
 
-  // Provides access to a model via network
-  void serveModels(std::vector<Model*> models, std::string host, int port, bool enable_parallel = false, bool error_checks = true) {
+#ifdef SUPPORT_POSIX_SHMEM
+  // Shared memory buffers referenced by a ShMem request. These are either named POSIX segments,
+  // or memfds the client handed over through the memfd side channel beforehand (identified by memfd_token).
+  class ShMemRequestBuffers {
+  public:
+    ShMemRequestBuffers(const json& request_body, FdMailbox* memfd_mailbox)
+        : num_inputs(request_body.value("shmem_num_inputs", 0)) {
+      options.huge_pages = request_body.value("shmem_huge_pages", false);
+      options.populate = request_body.value("shmem_populate", false);
+      if (request_body.contains("memfd_token")) {
+#ifdef SUPPORT_MEMFD
+        if (memfd_mailbox == nullptr)
+          throw std::runtime_error("Received memfd request, but server has no memfd side channel");
+        fds = memfd_mailbox->Take(request_body["memfd_token"].get<std::string>());
+#else
+        (void)memfd_mailbox;
+        throw std::runtime_error("Received memfd request, but memfd is not supported on this platform");
+#endif
+      } else {
+        shmem_name = request_body["shmem_name"].get<std::string>();
+        tid = request_body["tid"].get<std::string>();
+      }
+    }
 
-    httplib::Server svr;
-    std::mutex model_mutex; // Ensure the underlying model is only called sequentially
+    ShMemRequestBuffers(const ShMemRequestBuffers&) = delete;
+    ShMemRequestBuffers& operator=(const ShMemRequestBuffers&) = delete;
+
+    ~ShMemRequestBuffers() {
+      for (int fd : fds) // Descriptors the handler did not map
+        if (fd >= 0)
+          close(fd);
+    }
+
+    std::unique_ptr<SharedMemoryVector> Input(std::size_t i, std::size_t size) {
+      return Open(i, size, "_in_", i);
+    }
+
+    std::unique_ptr<SharedMemoryVector> Output(std::size_t i, std::size_t size) {
+      return Open(num_inputs + i, size, "_out_", i);
+    }
+
+  private:
+    // Memfds arrive as one list, inputs first and outputs after
+    std::unique_ptr<SharedMemoryVector> Open(std::size_t fd_index, std::size_t size, const std::string& direction, std::size_t i) {
+#ifdef SUPPORT_MEMFD
+      if (shmem_name.empty()) {
+        if (fd_index >= fds.size() || fds[fd_index] < 0)
+          throw std::runtime_error("Missing memfd buffer " + std::to_string(fd_index));
+        int fd = fds[fd_index];
+        fds[fd_index] = -1;
+        return std::make_unique<SharedMemoryVector>(size, fd, options);
+      }
+#endif
+      return std::make_unique<SharedMemoryVector>(size, shmem_name + direction + tid + "_" + std::to_string(i), false, options);
+    }
+
+    std::size_t num_inputs;
+    SharedMemoryOptions options;
+    std::string shmem_name;
+    std::string tid;
+    std::vector<int> fds;
+  };
+#endif
+
+  // Register the UM-Bridge protocol endpoints for the given models on an HTTP server
+  void register_model_handlers(httplib::Server& svr, std::vector<Model*>& models, std::mutex& model_mutex, ConfigCache& config_cache, VectorStore& vector_store, SessionStore& sessions, SingleFlight& single_flight, CallRegistry& calls, bool enable_parallel, bool error_checks, FdMailbox* memfd_mailbox = nullptr) {
+    // Calls abandoned through CancelledError get an error response; other exceptions are left to httplib's default handling
+    svr.set_exception_handler([](const httplib::Request&, httplib::Response& res, std::exception& e) {
+      if (dynamic_cast<CancelledError*>(&e)) {
+        json response_body;
+        response_body["error"]["type"] = "Cancelled";
+        response_body["error"]["message"] = e.what();
+        res.set_content(response_body.dump(), "application/json");
+        res.status = 503;
+      } else {
+        res.status = 500;
+        res.set_header("EXCEPTION_WHAT", e.what());
+      }
+    });
+
+    svr.Post("/Evaluate", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
+
+      if (error_checks && !model.SupportsEvaluate()) {
+        write_unsupported_feature_response(res, "Evaluate");
+        return;
+      }
 
-    svr.Post("/Evaluate", [&](const httplib::Request &req, httplib::Response &res) {
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
+
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
+        return;
+
+      InputBlock input_block;
+      if (model.PrefersInputBlock())
+        input_block = InputBlock(std::move(inputs));
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      auto evaluate = [&]() {
+        std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+        if (!enable_parallel) {
+            model_lock.lock();
+        }
+        CurrentCancellation().ThrowIfCancelled();
+        return model.PrefersInputBlock() ? model.EvaluateBlock(input_block, config.Json())
+                                         : model.Evaluate(inputs, config.Json());
+      };
+      // Identical requests in flight to deterministic models are evaluated once, except in sessions, where a call may
+      // depend on the previous ones
+      std::vector<std::vector<double>> outputs;
+      if (!model.IsDeterministic() || CurrentSession())
+        outputs = evaluate();
+      else if (model.PrefersInputBlock())
+        outputs = single_flight.Run(evaluation_key(model.GetName(), input_block, config.Json()), evaluate);
+      else
+        outputs = single_flight.Run(evaluation_key(model.GetName(), inputs, config.Json()), evaluate);
+
+      if (error_checks && !check_output_sizes(outputs, config, model, res))
+        return;
+
+      std::size_t num_entries = 0;
+      for (const auto& output : outputs)
+        num_entries += output.size();
+      set_message_content(res, num_entries, [outputs = std::move(outputs)](MessageBodyWriter& writer) {
+        writer.Vectors("output", outputs);
+      });
+    });
+#ifdef SUPPORT_POSIX_SHMEM
+    svr.Post("/EvaluateShMem", [&, enable_parallel, error_checks, memfd_mailbox](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      ShMemRequestBuffers shmem_buffers(request_body, memfd_mailbox);
       if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
@@ -684,141 +6062,300 @@ namespace umbridge {
         return;
       }
 
-      std::vector<std::vector<double>> inputs(request_body["input"].size());
-      for (std::size_t i = 0; i < inputs.size(); i++) {
-        inputs[i] = request_body["input"][i].get<std::vector<double>>();
+      std::vector<std::size_t> input_sizes;
+      for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
+        input_sizes.push_back(request_body["shmem_size_" + std::to_string(i)].get<std::size_t>());
+      }
+      // Models preferring a block get all inputs copied from shared memory into a single buffer
+      std::vector<std::vector<double>> inputs;
+      InputBlock input_block;
+      if (model.PrefersInputBlock())
+        input_block.Resize(input_sizes);
+      for (std::size_t i = 0; i < input_sizes.size(); i++) {
+        if (model.PrefersInputBlock()) {
+          if (input_sizes[i] > 0)
+            shmem_buffers.Input(i, input_sizes[i])->Read(input_block[i].data());
+        } else if (input_sizes[i] == 0) { // Handles edge case with empty vector
+          inputs.push_back(std::vector<double>{});
+        } else {
+          inputs.push_back(shmem_buffers.Input(i, input_sizes[i])->GetVector());
+        }
+      }
+      std::vector<std::size_t> output_sizes = config.OutputSizes(model);
+      std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
+      for (std::size_t i = 0; i < output_sizes.size(); i++) {
+        shmem_outputs.push_back(shmem_buffers.Output(i, output_sizes[i]));
+      }
+
+      if (error_checks && !check_input_sizes(input_sizes, config, model, res))
+        return;
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      auto evaluate = [&]() {
+        std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+        if (!enable_parallel) {
+            model_lock.lock();
+        }
+        CurrentCancellation().ThrowIfCancelled();
+        return model.PrefersInputBlock() ? model.EvaluateBlock(input_block, config.Json())
+                                         : model.Evaluate(inputs, config.Json());
+      };
+      // Identical requests in flight to deterministic models are evaluated once, except in sessions, where a call may
+      // depend on the previous ones
+      std::vector<std::vector<double>> outputs;
+      if (!model.IsDeterministic() || CurrentSession())
+        outputs = evaluate();
+      else if (model.PrefersInputBlock())
+        outputs = single_flight.Run(evaluation_key(model.GetName(), input_block, config.Json()), evaluate);
+      else
+        outputs = single_flight.Run(evaluation_key(model.GetName(), inputs, config.Json()), evaluate);
+
+      if (error_checks && !check_output_sizes(outputs, config, model, res))
+        return;
+
+      for (std::size_t i = 0; i < outputs.size(); i++) {
+        shmem_outputs[i]->SetVector(outputs[i]);
+      }
+
+      json response_body;
+      res.set_content(response_body.dump(), "application/json"); });
+#endif
+    svr.Post("/Gradient", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
+
+      if (error_checks && !model.SupportsGradient()) {
+        write_unsupported_feature_response(res, "Gradient");
+        return;
+      }
+
+      unsigned int inWrt = request_body.at("inWrt");
+      unsigned int outWrt = request_body.at("outWrt");
+
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
+
+      std::vector<double> sens = std::move(message.Vector("sens"));
+
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
+        return;
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
+        return;
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
+        return;
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
+        return;
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
+      }
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> gradient = model.Gradient(outWrt, inWrt, inputs, sens, config.Json());
+
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
+
+      set_message_content(res, gradient.size(), [gradient = std::move(gradient)](MessageBodyWriter& writer) {
+        writer.Vector("output", gradient);
+      });
+    });
+#ifdef SUPPORT_POSIX_SHMEM
+    svr.Post("/GradientShMem", [&, enable_parallel, error_checks, memfd_mailbox](const httplib::Request &req, httplib::Response &res) {
+      json request_body = json::parse(req.body);
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      ShMemRequestBuffers shmem_buffers(request_body, memfd_mailbox);
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
+
+      if (error_checks && !model.SupportsGradient()) {
+        write_unsupported_feature_response(res, "Gradient");
+        return;
+      }
+
+      unsigned int inWrt = request_body.at("inWrt");
+      unsigned int outWrt = request_body.at("outWrt");
+
+      std::vector<std::vector<double>> inputs;
+      for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
+        inputs.push_back(shmem_buffers.Input(i, request_body["shmem_size_" + std::to_string(i)].get<int>())->GetVector());
       }
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      std::vector<double> sens = request_body.at("sens");
 
-      if (error_checks && !check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
+        return;
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
+        return;
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
+        return;
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
         return;
 
+      std::unique_ptr<SharedMemoryVector> shmem_output = shmem_buffers.Output(0, inputs.at(inWrt).size());
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
       std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
       if (!enable_parallel) {
           model_lock.lock();
       }
-      std::vector<std::vector<double>> outputs = model.Evaluate(inputs, config_json);
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> gradient = model.Gradient(outWrt, inWrt, inputs, sens, config.Json());
 
       if (model_lock.owns_lock()) {
         model_lock.unlock();  // for safety, although should unlock after request finished
       }
 
-      if (error_checks && !check_output_sizes(outputs, config_json, model, res))
-        return;
-
+      shmem_output->SetVector(gradient);
       json response_body;
-      response_body["output"] = json::parse("[]");
-      for (std::size_t i = 0; i < outputs.size(); i++) {
-        response_body["output"][i] = outputs[i];
-      }
+
 
       res.set_content(response_body.dump(), "application/json");
     });
-#ifdef SUPPORT_POSIX_SHMEM
-    svr.Post("/EvaluateShMem", [&](const httplib::Request &req, httplib::Response &res) {
-      json request_body = json::parse(req.body);
-      if (!check_model_exists(models, request_body["name"], res))
+#endif
+
+    svr.Post("/EvaluateAndGradient", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (!model.SupportsEvaluate()) {
-        write_unsupported_feature_response(res, "Evaluate");
+      if (error_checks && !(model.SupportsEvaluate() && model.SupportsGradient())) {
+        write_unsupported_feature_response(res, "EvaluateAndGradient");
         return;
       }
 
-      std::vector<std::vector<double>> inputs;
-      for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
-        if (request_body["shmem_size_" + std::to_string(i)] == 0) { // Handles edge case with empty vector
-        inputs.push_back(std::vector<double>{});
-        }
-        else{
-          SharedMemoryVector shmem_input(request_body["shmem_size_" + std::to_string(i)].get<int>(), request_body["shmem_name"].get<std::string>() + "_in_" + request_body["tid"].get<std::string>() + "_" + std::to_string(i), false);
-          inputs.push_back(shmem_input.GetVector());
-        }
-      }
-      std::vector<std::unique_ptr<SharedMemoryVector>> shmem_outputs;
-      for (int i = 0; i < model.GetOutputSizes().size(); i++) {
-        shmem_outputs.push_back(std::make_unique<SharedMemoryVector>(model.GetOutputSizes()[i], request_body["shmem_name"].get<std::string>() + "_out_" + request_body["tid"].get<std::string>() + "_" + std::to_string(i), false));
-      }
-
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      unsigned int inWrt = request_body.at("inWrt");
+      unsigned int outWrt = request_body.at("outWrt");
 
-      if (!check_input_sizes(inputs, config_json, model, res))
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
         return;
 
-      const std::lock_guard<std::mutex> model_lock(model_mutex);
-      std::vector<std::vector<double>> outputs = model.Evaluate(inputs, config_json);
+      std::vector<double> sens = std::move(message.Vector("sens"));
 
-      if (!check_output_sizes(outputs, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
+        return;
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
+        return;
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
+        return;
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
         return;
 
-      for (std::size_t i = 0; i < outputs.size(); i++) {
-        shmem_outputs[i]->SetVector(outputs[i]);
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
       }
+      CurrentCancellation().ThrowIfCancelled();
+      std::pair<std::vector<std::vector<double>>, std::vector<double>> result = model.EvaluateAndGradient(outWrt, inWrt, inputs, sens, config.Json());
 
-      json response_body;
-      res.set_content(response_body.dump(), "application/json"); });
-#endif
-    svr.Post("/Gradient", [&](const httplib::Request &req, httplib::Response &res) {
-      json request_body = json::parse(req.body);
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
+
+      if (error_checks && !check_output_sizes(result.first, config, model, res))
+        return;
+      if (error_checks && !check_gradient_size(result.second, inWrt, config, model, res))
+        return;
+
+      std::size_t num_entries = result.second.size();
+      for (const auto& output : result.first)
+        num_entries += output.size();
+      set_message_content(res, num_entries, [result = std::move(result)](MessageBodyWriter& writer) {
+        writer.Vectors("output", result.first);
+        writer.Vector("gradient", result.second);
+      });
+    });
+
+    svr.Post("/ApplyJacobian", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
       if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (error_checks && !model.SupportsGradient()) {
-        write_unsupported_feature_response(res, "Gradient");
+      if (error_checks && !model.SupportsApplyJacobian()) {
+        write_unsupported_feature_response(res, "ApplyJacobian");
         return;
       }
 
       unsigned int inWrt = request_body.at("inWrt");
       unsigned int outWrt = request_body.at("outWrt");
 
-      std::vector<std::vector<double>> inputs(request_body["input"].size());
-      for (std::size_t i = 0; i < inputs.size(); i++) {
-        inputs[i] = request_body["input"][i].get<std::vector<double>>();
-      }
-
-      std::vector<double> sens = request_body.at("sens");
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      std::vector<double> vec = std::move(message.Vector("vec"));
 
-      if (error_checks && !check_input_wrt(inWrt, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
         return;
-      if (error_checks && !check_output_wrt(outWrt, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (error_checks && !check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
-      if (error_checks && !check_sensitivity_size(sens, outWrt, config_json, model, res))
+      if (error_checks && !check_vector_size(vec, inWrt, config, model, res))
         return;
 
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
       std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
       if (!enable_parallel) {
           model_lock.lock();
       }
-      std::vector<double> gradient = model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> jacobian_action = model.ApplyJacobian(outWrt, inWrt, inputs, vec, config.Json());
 
       if (model_lock.owns_lock()) {
         model_lock.unlock();  // for safety, although should unlock after request finished
       }
 
-      json response_body;
-      response_body["output"] = gradient;
-
-      res.set_content(response_body.dump(), "application/json");
-    });
+      set_message_content(res, jacobian_action.size(), [jacobian_action = std::move(jacobian_action)](MessageBodyWriter& writer) {
+        writer.Vector("output", jacobian_action);
+      }); });
 #ifdef SUPPORT_POSIX_SHMEM
-    svr.Post("/GradientShMem", [&](const httplib::Request &req, httplib::Response &res) {
+    svr.Post("/ApplyJacobianShMem", [&, enable_parallel, error_checks, memfd_mailbox](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
-      if (!check_model_exists(models, request_body["name"], res))
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      ShMemRequestBuffers shmem_buffers(request_body, memfd_mailbox);
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (!model.SupportsGradient()) {
-        write_unsupported_feature_response(res, "Gradient");
+      if (error_checks && !model.SupportsApplyJacobian()) {
+        write_unsupported_feature_response(res, "ApplyJacobian");
         return;
       }
 
@@ -827,187 +6364,273 @@ namespace umbridge {
 
       std::vector<std::vector<double>> inputs;
       for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
-        SharedMemoryVector shmem_input(request_body["shmem_size_" + std::to_string(i)].get<int>(), request_body["shmem_name"].get<std::string>() + "_in_" + request_body["tid"].get<std::string>() + "_" + std::to_string(i), false);
-        inputs.push_back(shmem_input.GetVector());
+        inputs.push_back(shmem_buffers.Input(i, request_body["shmem_size_" + std::to_string(i)].get<int>())->GetVector());
       }
-      SharedMemoryVector shmem_output(inputs[inWrt].size(), request_body["shmem_name"].get<std::string>() + "_out_" + request_body["tid"].get<std::string>() + "_" + std::to_string(0), false);
-
-      std::vector<double> sens = request_body.at("sens");
-
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      std::vector<double> vec = request_body.at("vec");
 
-      if (!check_input_wrt(inWrt, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
         return;
-      if (!check_output_wrt(outWrt, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (!check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
-      if (!check_sensitivity_size(sens, outWrt, config_json, model, res))
+      if (error_checks && !check_vector_size(vec, inWrt, config, model, res))
         return;
 
-      const std::lock_guard<std::mutex> model_lock(model_mutex);
-      std::vector<double> gradient = model.Gradient(outWrt, inWrt, inputs, sens, config_json);
+      std::unique_ptr<SharedMemoryVector> shmem_output = shmem_buffers.Output(0, config.OutputSizes(model).at(outWrt));
 
-      shmem_output.SetVector(gradient);
-      json response_body;
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
+      }
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> jacobian_action = model.ApplyJacobian(outWrt, inWrt, inputs, vec, config.Json());
 
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
 
-      res.set_content(response_body.dump(), "application/json");
-    });
-#endif
+      json response_body;
+      shmem_output->SetVector(jacobian_action);
 
-    svr.Post("/ApplyJacobian", [&](const httplib::Request &req, httplib::Response &res) {
-      json request_body = json::parse(req.body);
+      res.set_content(response_body.dump(), "application/json"); });
+#endif
+    svr.Post("/ApplyHessian", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
       if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (error_checks && !model.SupportsApplyJacobian()) {
-        write_unsupported_feature_response(res, "ApplyJacobian");
+      if (error_checks && !model.SupportsApplyHessian()) {
+        write_unsupported_feature_response(res, "ApplyHessian");
         return;
       }
 
-      unsigned int inWrt = request_body.at("inWrt");
       unsigned int outWrt = request_body.at("outWrt");
+      unsigned int inWrt1 = request_body.at("inWrt1");
+      unsigned int inWrt2 = request_body.at("inWrt2");
 
-      std::vector<std::vector<double>> inputs(request_body["input"].size());
-      for (std::size_t i = 0; i < inputs.size(); i++) {
-        inputs[i] = request_body["input"][i].get<std::vector<double>>();
-      }
-
-      std::vector<double> vec = request_body.at("vec");
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      std::vector<double> sens = std::move(message.Vector("sens"));
+      std::vector<double> vec = std::move(message.Vector("vec"));
 
-      if (error_checks && !check_input_wrt(inWrt, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt1, config, model, res))
+        return;
+      if (error_checks && !check_input_wrt(inWrt2, config, model, res))
         return;
-      if (error_checks && !check_output_wrt(outWrt, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (error_checks && !check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
-      if (error_checks && !check_vector_size(vec, inWrt, config_json, model, res))
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
         return;
 
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
       std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
       if (!enable_parallel) {
           model_lock.lock();
       }
-      std::vector<double> jacobian_action = model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> hessian_action = model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config.Json());
 
       if (model_lock.owns_lock()) {
         model_lock.unlock();  // for safety, although should unlock after request finished
       }
 
-      json response_body;
-      response_body["output"] = jacobian_action;
-
-      res.set_content(response_body.dump(), "application/json"); });
+      set_message_content(res, hessian_action.size(), [hessian_action = std::move(hessian_action)](MessageBodyWriter& writer) {
+        writer.Vector("output", hessian_action);
+      });
+    });
 #ifdef SUPPORT_POSIX_SHMEM
-    svr.Post("/ApplyJacobianShMem", [&](const httplib::Request &req, httplib::Response &res) {
+    svr.Post("/ApplyHessianShMem", [&, enable_parallel, error_checks, memfd_mailbox](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
-      if (!check_model_exists(models, request_body["name"], res))
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      ShMemRequestBuffers shmem_buffers(request_body, memfd_mailbox);
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (!model.SupportsApplyJacobian()) {
-        write_unsupported_feature_response(res, "ApplyJacobian");
+      if (error_checks && !model.SupportsApplyHessian()) {
+        write_unsupported_feature_response(res, "ApplyHessian");
         return;
       }
 
-      unsigned int inWrt = request_body.at("inWrt");
       unsigned int outWrt = request_body.at("outWrt");
+      unsigned int inWrt1 = request_body.at("inWrt1");
+      unsigned int inWrt2 = request_body.at("inWrt2");
 
       std::vector<std::vector<double>> inputs;
       for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
-        SharedMemoryVector shmem_input(request_body["shmem_size_" + std::to_string(i)].get<int>(), request_body["shmem_name"].get<std::string>() + "_in_" + request_body["tid"].get<std::string>() + "_" + std::to_string(i), false);
-        inputs.push_back(shmem_input.GetVector());
+        inputs.push_back(shmem_buffers.Input(i, request_body["shmem_size_" + std::to_string(i)].get<int>())->GetVector());
       }
-      SharedMemoryVector shmem_output(model.GetOutputSizes()[outWrt], request_body["shmem_name"].get<std::string>() + "_out_" + request_body["tid"].get<std::string>() + "_" + std::to_string(0), false);
-
+      std::vector<double> sens = request_body.at("sens");
       std::vector<double> vec = request_body.at("vec");
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
-
-      if (!check_input_wrt(inWrt, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt1, config, model, res))
         return;
-      if (!check_output_wrt(outWrt, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt2, config, model, res))
         return;
-      if (!check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (!check_vector_size(vec, inWrt, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
+        return;
+
+      std::unique_ptr<SharedMemoryVector> shmem_output = shmem_buffers.Output(0, config.OutputSizes(model).at(outWrt));
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
+      }
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<double> hessian_action = model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config.Json());
 
-      const std::lock_guard<std::mutex> model_lock(model_mutex);
-      std::vector<double> jacobian_action = model.ApplyJacobian(outWrt, inWrt, inputs, vec, config_json);
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
 
       json response_body;
-      shmem_output.SetVector(jacobian_action);
+      shmem_output->SetVector(hessian_action);
 
-      res.set_content(response_body.dump(), "application/json"); });
+      res.set_content(response_body.dump(), "application/json");
+    });
 #endif
-    svr.Post("/ApplyHessian", [&](const httplib::Request &req, httplib::Response &res) {
-      json request_body = json::parse(req.body);
+    svr.Post("/ApplyJacobianBlock", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
       if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (error_checks && !model.SupportsApplyHessian()) {
-        write_unsupported_feature_response(res, "ApplyHessian");
+      if (error_checks && !model.SupportsApplyJacobian()) {
+        write_unsupported_feature_response(res, "ApplyJacobian");
         return;
       }
 
+      unsigned int inWrt = request_body.at("inWrt");
       unsigned int outWrt = request_body.at("outWrt");
-      unsigned int inWrt1 = request_body.at("inWrt1");
-      unsigned int inWrt2 = request_body.at("inWrt2");
 
-      std::vector<std::vector<double>> inputs(request_body["input"].size());
-      for (std::size_t i = 0; i < inputs.size(); i++) {
-        inputs[i] = request_body["input"][i].get<std::vector<double>>();
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
+
+      std::vector<std::vector<double>> vecs = std::move(message.Vectors("vecs"));
+
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
+        return;
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
+        return;
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
+        return;
+      if (error_checks && !check_vector_sizes(vecs, inWrt, config, model, res))
+        return;
+
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
       }
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<std::vector<double>> jacobian_actions = model.ApplyJacobianBlock(outWrt, inWrt, inputs, vecs, config.Json());
 
-      std::vector<double> sens = request_body.at("sens");
-      std::vector<double> vec = request_body.at("vec");
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
+
+      std::size_t num_entries = 0;
+      for (const auto& jacobian_action : jacobian_actions)
+        num_entries += jacobian_action.size();
+      set_message_content(res, num_entries, [jacobian_actions = std::move(jacobian_actions)](MessageBodyWriter& writer) {
+        writer.Vectors("output", jacobian_actions);
+      });
+    });
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+    svr.Post("/Jacobian", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (error_checks && !check_input_wrt(inWrt1, config_json, model, res))
+      if (error_checks && !model.SupportsApplyJacobian()) {
+        write_unsupported_feature_response(res, "ApplyJacobian");
         return;
-      if (error_checks && !check_input_wrt(inWrt2, config_json, model, res))
+      }
+
+      unsigned int inWrt = request_body.at("inWrt");
+      unsigned int outWrt = request_body.at("outWrt");
+
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
         return;
-      if (error_checks && !check_output_wrt(outWrt, config_json, model, res))
+
+      if (error_checks && !check_input_wrt(inWrt, config, model, res))
         return;
-      if (error_checks && !check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (error_checks && !check_sensitivity_size(sens, outWrt, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
 
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
       std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
       if (!enable_parallel) {
           model_lock.lock();
       }
-      std::vector<double> hessian_action = model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+      CurrentCancellation().ThrowIfCancelled();
+      JacobianMatrix jacobian = model.Jacobian(outWrt, inWrt, inputs, config.Json());
 
       if (model_lock.owns_lock()) {
         model_lock.unlock();  // for safety, although should unlock after request finished
       }
 
-      json response_body;
-      response_body["output"] = hessian_action;
+      if (error_checks && !check_jacobian(jacobian, outWrt, inWrt, config, model, res))
+        return;
 
-      res.set_content(response_body.dump(), "application/json");
+      std::size_t num_entries = jacobian.values.size() + jacobian.row_offsets.size() + jacobian.column_indices.size();
+      set_message_content(res, num_entries, [jacobian = std::move(jacobian)](MessageBodyWriter& writer) {
+        writer.Jacobian(jacobian);
+      });
     });
-#ifdef SUPPORT_POSIX_SHMEM
-    svr.Post("/ApplyHessianShMem", [&](const httplib::Request &req, httplib::Response &res) {
-      json request_body = json::parse(req.body);
-      if (!check_model_exists(models, request_body["name"], res))
+
+    svr.Post("/ApplyHessianBlock", [&, enable_parallel, error_checks](const httplib::Request &req, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+      json& request_body = message.fields;
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (error_checks && !check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      if (!model.SupportsApplyHessian()) {
+      if (error_checks && !model.SupportsApplyHessian()) {
         write_unsupported_feature_response(res, "ApplyHessian");
         return;
       }
@@ -1016,39 +6639,48 @@ namespace umbridge {
       unsigned int inWrt1 = request_body.at("inWrt1");
       unsigned int inWrt2 = request_body.at("inWrt2");
 
-      std::vector<std::vector<double>> inputs;
-      for (int i = 0; i < request_body["shmem_num_inputs"].get<int>(); i++) {
-        SharedMemoryVector shmem_input(request_body["shmem_size_" + std::to_string(i)].get<int>(), request_body["shmem_name"].get<std::string>() + "_in_" + request_body["tid"].get<std::string>() + "_" + std::to_string(i), false);
-        inputs.push_back(shmem_input.GetVector());
-      }
-      SharedMemoryVector shmem_output(model.GetOutputSizes()[outWrt], request_body["shmem_name"].get<std::string>() + "_out_" + request_body["tid"].get<std::string>() + "_" + std::to_string(0), false);
-
-      std::vector<double> sens = request_body.at("sens");
-      std::vector<double> vec = request_body.at("vec");
+      std::vector<std::vector<double>> inputs = std::move(message.Vectors("input"));
+      if (!resolve_input_handles(request_body, inputs, vector_store, res))
+        return;
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      std::vector<double> sens = std::move(message.Vector("sens"));
+      std::vector<std::vector<double>> vecs = std::move(message.Vectors("vecs"));
 
-      if (!check_input_wrt(inWrt1, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt1, config, model, res))
         return;
-      if (!check_input_wrt(inWrt2, config_json, model, res))
+      if (error_checks && !check_input_wrt(inWrt2, config, model, res))
         return;
-      if (!check_output_wrt(outWrt, config_json, model, res))
+      if (error_checks && !check_output_wrt(outWrt, config, model, res))
         return;
-      if (!check_input_sizes(inputs, config_json, model, res))
+      if (error_checks && !check_input_sizes(inputs, config, model, res))
         return;
-      if (!check_sensitivity_size(sens, outWrt, config_json, model, res))
+      if (error_checks && !check_sensitivity_size(sens, outWrt, config, model, res))
+        return;
+      if (error_checks && !check_vector_sizes(vecs, inWrt2, config, model, res))
         return;
 
-      const std::lock_guard<std::mutex> model_lock(model_mutex);
-      std::vector<double> hessian_action = model.ApplyHessian(outWrt, inWrt1, inWrt2, inputs, sens, vec, config_json);
+      CancellationScope cancellation(req, calls);
+      SessionScope session(request_body, sessions);
+      ParallelCallsScope parallel(enable_parallel && !CurrentSession() ? std::thread::hardware_concurrency() : 1);
+      std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+      if (!enable_parallel) {
+          model_lock.lock();
+      }
+      CurrentCancellation().ThrowIfCancelled();
+      std::vector<std::vector<double>> hessian_actions = model.ApplyHessianBlock(outWrt, inWrt1, inWrt2, inputs, sens, vecs, config.Json());
 
-      json response_body;
-      shmem_output.SetVector(hessian_action);
+      if (model_lock.owns_lock()) {
+        model_lock.unlock();  // for safety, although should unlock after request finished
+      }
 
-      res.set_content(response_body.dump(), "application/json");
+      std::size_t num_entries = 0;
+      for (const auto& hessian_action : hessian_actions)
+        num_entries += hessian_action.size();
+      set_message_content(res, num_entries, [hessian_actions = std::move(hessian_actions)](MessageBodyWriter& writer) {
+        writer.Vectors("output", hessian_actions);
+      });
     });
-#endif
+
     svr.Get("/Info", [&](const httplib::Request &, httplib::Response &res) {
       json response_body;
       response_body["protocolVersion"] = 1.0;
@@ -1057,6 +6689,10 @@ namespace umbridge {
         model_names.push_back(model->GetName());
       }
       response_body["models"] = model_names;
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      // httplib decompresses gzip request bodies, so clients may send them (RFC 7694)
+      res.set_header("Accept-Encoding", "gzip");
+#endif
 
       res.set_content(response_body.dump(), "application/json");
     });
@@ -1073,57 +6709,123 @@ namespace umbridge {
       response_body["support"]["Gradient"] = model.SupportsGradient();
       response_body["support"]["ApplyJacobian"] = model.SupportsApplyJacobian();
       response_body["support"]["ApplyHessian"] = model.SupportsApplyHessian();
+      response_body["support"]["EvaluateAndGradient"] = model.SupportsEvaluate() && model.SupportsGradient();
+      response_body["support"]["ApplyJacobianBlock"] = model.SupportsApplyJacobian();
+      response_body["support"]["ApplyHessianBlock"] = model.SupportsApplyHessian();
+      response_body["support"]["Jacobian"] = model.SupportsApplyJacobian();
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+      res.set_header("Accept-Encoding", "gzip");
+#endif
       res.set_content(response_body.dump(), "application/json");
     });
 
     svr.Post("/InputSizes", [&](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
       if (!check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
-
       json response_body;
-      response_body["inputSizes"] = model.GetInputSizes(config_json);
+      response_body["inputSizes"] = config.InputSizes(model);
 
       res.set_content(response_body.dump(), "application/json");
     });
 
     svr.Post("/OutputSizes", [&](const httplib::Request &req, httplib::Response &res) {
+      json request_body = json::parse(req.body);
+      RequestConfig config(request_body, config_cache);
+      if (!check_config_handle(config, res))
+        return;
+      if (!check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
+
+      json response_body;
+      response_body["outputSizes"] = config.OutputSizes(model);
+
+      res.set_content(response_body.dump(), "application/json");
+    });
+
+    // End a session before it expires, releasing its state. Waits for a call of the session in flight to complete.
+    svr.Post("/CloseSession", [&, enable_parallel](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
       if (!check_model_exists(models, request_body["name"], res))
         return;
       Model& model = get_model_from_name(models, request_body["name"]);
+      {
+        SessionScope session(request_body, sessions);
+        std::unique_lock<std::mutex> model_lock(model_mutex, std::defer_lock);
+        if (!enable_parallel) {
+            model_lock.lock();
+        }
+        model.CloseSession();
+        sessions.Close(request_body["name"], request_body.at("session").get<std::string>());
+      }
+
+      json response_body;
+      res.set_content(response_body.dump(), "application/json");
+    });
+
+    // Cancel a call in flight, identified by the id its client sent in the X-UMBridge-Call header
+    svr.Post("/Cancel", [&](const httplib::Request &req, httplib::Response &res) {
+      json request_body = json::parse(req.body);
+
+      json response_body;
+      response_body["cancelled"] = calls.Cancel(request_body.at("call").get<std::string>());
+      res.set_content(response_body.dump(), "application/json");
+    });
+
+    // Store a vector on the server and hand out a handle that later requests may send in place of model inputs equal to it
+    svr.Post("/StoreVector", [&](const httplib::Request &, httplib::Response &res, const httplib::ContentReader &content_reader) {
+      MessageBody message = read_message_body(content_reader);
+
+      json response_body;
+      response_body["vectorHandle"] = vector_store.Store(std::move(message.Vector("vec")));
 
-      json empty_default_config;
-      json config_json = request_body.value("config", empty_default_config);
+      res.set_content(response_body.dump(), "application/json");
+    });
+
+    // Store a config on the server and hand out a handle that later requests may send in place of it
+    svr.Post("/RegisterConfig", [&, error_checks](const httplib::Request &req, httplib::Response &res) {
+      json request_body = json::parse(req.body);
+      if (!check_model_exists(models, request_body["name"], res))
+        return;
+      Model& model = get_model_from_name(models, request_body["name"]);
 
       json response_body;
-      response_body["outputSizes"] = model.GetOutputSizes(config_json);
+      response_body["configHandle"] = config_cache.Register(model, request_body.value("config", json()), error_checks);
 
       res.set_content(response_body.dump(), "application/json");
     });
 #ifdef SUPPORT_POSIX_SHMEM
-    svr.Post("/TestShMem", [&](const httplib::Request &req, httplib::Response &res) {
+    svr.Post("/TestShMem", [&, memfd_mailbox](const httplib::Request &req, httplib::Response &res) {
       json request_body = json::parse(req.body);
       if (!check_model_exists(models, request_body["name"], res))
         return;
       Model &model = get_model_from_name(models, request_body["name"]);
       json response_body;
       try {
-        SharedMemoryVector shmem_input(1, "/umbridge_test_shmem_in_" + request_body["tid"].get<std::string>(), false);
-        SharedMemoryVector shmem_output(1, "/umbridge_test_shmem_out_" + request_body["tid"].get<std::string>(), false);
-        std::vector<double> value = shmem_input.GetVector();
-        shmem_output.SetVector(value);
+        std::unique_ptr<SharedMemoryVector> shmem_input;
+        std::unique_ptr<SharedMemoryVector> shmem_output;
+        if (request_body.contains("memfd_token")) {
+          ShMemRequestBuffers shmem_buffers(request_body, memfd_mailbox);
+          shmem_input = shmem_buffers.Input(0, 1);
+          shmem_output = shmem_buffers.Output(0, 1);
+        } else {
+          shmem_input = std::make_unique<SharedMemoryVector>(1, "/umbridge_test_shmem_in_" + request_body["tid"].get<std::string>(), false);
+          shmem_output = std::make_unique<SharedMemoryVector>(1, "/umbridge_test_shmem_out_" + request_body["tid"].get<std::string>(), false);
+        }
+        std::vector<double> value = shmem_input->GetVector();
+        shmem_output->SetVector(value);
         response_body["value"] = value;
       }
       catch(std::exception){}
       res.set_content(response_body.dump(), "application/json");
     });
 #endif
-    std::cout << "Listening on port " << port << "..." << std::endl;
 
 #ifdef LOGGING
     svr.set_logger([](const httplib::Request& req, const httplib::Response& res) {
@@ -1137,7 +6839,58 @@ namespace umbridge {
         log_request(req, res);
     });
 #endif
+  }
+
+  // Provides access to a model via network.
+  // If unix_socket_path is given, the models are additionally served on that Unix domain socket (clients connect via unix:///path).
+  void serveModels(std::vector<Model*> models, std::string host, int port, bool enable_parallel = false, bool error_checks = true, std::string unix_socket_path = "") {
+
+    httplib::Server svr;
+    std::mutex model_mutex; // Ensure the underlying model is only called sequentially, shared across all listeners
+    ConfigCache config_cache;
+    VectorStore vector_store;
+    SessionStore sessions;
+    SingleFlight single_flight; // Shared across all listeners, so that identical requests on either are coalesced
+    CallRegistry calls;
+#ifdef SUPPORT_MEMFD
+    // Clients on the Unix domain socket may hand over memfd buffers through a side channel next to it
+    std::shared_ptr<FdMailbox> memfd_mailbox = std::make_shared<FdMailbox>();
+    std::unique_ptr<MemfdListener> memfd_listener;
+    if (!unix_socket_path.empty())
+      memfd_listener = std::make_unique<MemfdListener>(memfd_socket_path(unix_socket_path), memfd_mailbox);
+    register_model_handlers(svr, models, model_mutex, config_cache, vector_store, sessions, single_flight, calls, enable_parallel, error_checks, memfd_mailbox.get());
+#else
+    register_model_handlers(svr, models, model_mutex, config_cache, vector_store, sessions, single_flight, calls, enable_parallel, error_checks);
+#endif
+
+#ifdef SUPPORT_UNIX_SOCKET
+    httplib::Server unix_svr;
+    std::thread unix_thread;
+    if (!unix_socket_path.empty()) {
+#ifdef SUPPORT_MEMFD
+      register_model_handlers(unix_svr, models, model_mutex, config_cache, vector_store, sessions, single_flight, calls, enable_parallel, error_checks, memfd_mailbox.get());
+#else
+      register_model_handlers(unix_svr, models, model_mutex, config_cache, vector_store, sessions, single_flight, calls, enable_parallel, error_checks);
+#endif
+      unix_svr.set_address_family(AF_UNIX);
+      unlink(unix_socket_path.c_str()); // Remove stale socket file left behind by a previous run
+      if (!unix_svr.bind_to_port(unix_socket_path.c_str(), 80))
+        throw std::runtime_error("Could not listen on Unix domain socket '" + unix_socket_path + "'");
+      std::cout << "Listening on Unix domain socket " << unix_socket_path << "..." << std::endl;
+      unix_thread = std::thread([&]() { unix_svr.listen_after_bind(); });
+    }
+#endif
+
+    std::cout << "Listening on port " << port << "..." << std::endl;
     svr.listen(host.c_str(), port);
+
+#ifdef SUPPORT_UNIX_SOCKET
+    if (unix_thread.joinable()) {
+      unix_svr.stop();
+      unix_thread.join();
+      unlink(unix_socket_path.c_str());
+    }
+#endif
     std::cout << "Quit" << std::endl;
   }
 
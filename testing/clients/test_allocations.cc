@@ -0,0 +1,80 @@
+#include "umbridge.h"
+
+// Allocation counts of the C++ client. Kept apart from test_c++.cc since it replaces the global operator new for the
+// whole binary.
+
+// Allocations made by the current thread, counted by the replacement operator new below
+thread_local std::size_t allocation_count = 0;
+thread_local std::size_t allocation_bytes = 0;
+
+void* operator new(std::size_t size) {
+  allocation_count++;
+  allocation_bytes += size;
+  if (void* pointer = std::malloc(size ? size : 1))
+    return pointer;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+
+// Bound on the allocations of a call of EvaluateInto once its buffers have grown to size
+const std::size_t max_call_allocations = 64;
+
+// Outputs a constant vector of the given size, scaled by the single input
+class ConstantModel : public umbridge::Model {
+public:
+  ConstantModel(std::string name, std::size_t output_size) : umbridge::Model(name), output_size(output_size) {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {output_size};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    return {std::vector<double>(output_size, inputs[0][0])};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+private:
+  std::size_t output_size;
+};
+
+// Steady-state EvaluateInto only makes httplib's per-request allocations, none of them growing with the output
+int main() {
+  ConstantModel small("small", 10), large("large", 100000);
+  std::thread([&]() {
+    umbridge::serveModels({&small, &large}, "127.0.0.1", 4250);
+  }).detach();
+  std::string host = "http://127.0.0.1:4250";
+  for (int attempt = 0; attempt < 100 && !httplib::Client(host.c_str()).Get("/Info"); attempt++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  auto steady_state_allocations = [&](const std::string& name) {
+    umbridge::HTTPModel client(host, name);
+    std::vector<std::vector<double>> outputs;
+    for (int i = 0; i < 2; ++i)
+      client.EvaluateInto({{1.0}}, outputs);
+    std::pair<std::size_t, std::size_t> before(allocation_count, allocation_bytes);
+    client.EvaluateInto({{2.0}}, outputs);
+    assert(outputs.size() == 1 && outputs[0].back() == 2.0);
+    return std::make_pair(allocation_count - before.first, allocation_bytes - before.second);
+  };
+  auto [small_count, small_bytes] = steady_state_allocations("small");
+  auto [large_count, large_bytes] = steady_state_allocations("large");
+  assert(small_count <= max_call_allocations);
+  assert(large_count <= max_call_allocations);
+  assert(large_bytes < small_bytes + 100000 * sizeof(double) / 10);
+  return 0;
+}
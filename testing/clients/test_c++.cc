@@ -1,4 +1,5 @@
 #include "umbridge.h"
+#include "../../hpc/LoadBalancer.hpp"
 
 void is_approx_equal(const std::vector<double>& a, const std::vector<double>& b, double tol) {
   assert(a.size() == b.size());
@@ -6,7 +7,1238 @@ void is_approx_equal(const std::vector<double>& a, const std::vector<double>& b,
     assert (std::abs(a[i] - b[i]) < tol);
 }
 
+// Serve models in-process on localhost, for the checks that do not need the external model server, optionally also
+// on a Unix domain socket
+std::string serve_locally(std::vector<umbridge::Model*> models, int port, bool enable_parallel = true, std::string unix_socket_path = "") {
+  std::thread([models, port, enable_parallel, unix_socket_path]() {
+    umbridge::serveModels(models, "127.0.0.1", port, enable_parallel, true, unix_socket_path);
+  }).detach();
+  std::string host = "http://127.0.0.1:" + std::to_string(port);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    if (httplib::Client(host.c_str()).Get("/Info"))
+      return host;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  assert(false && "Local model server did not come up");
+  return host;
+}
+
+// Outputs a constant vector of the given size, scaled by the single input
+class ConstantModel : public umbridge::Model {
+public:
+  ConstantModel(std::string name, std::size_t output_size) : umbridge::Model(name), output_size(output_size) {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {output_size};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    return {std::vector<double>(output_size, inputs[0][0])};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+private:
+  std::size_t output_size;
+};
+
+// f(x) = (scale * x0^2 * x1, sin(x0) + x1), with scale taken from the config (1 by default)
+class AnalyticModel : public umbridge::Model {
+public:
+  AnalyticModel() : umbridge::Model("analytic") {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {2};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {2};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config) override {
+    const std::vector<double>& x = inputs[0];
+    return {{Scale(config) * x[0] * x[0] * x[1], std::sin(x[0]) + x[1]}};
+  }
+
+  std::vector<double> Gradient(unsigned int, unsigned int, const std::vector<std::vector<double>>& inputs,
+                               const std::vector<double>& sens, json config) override {
+    const std::vector<double>& x = inputs[0];
+    double scale = Scale(config);
+    return {sens[0] * 2.0 * scale * x[0] * x[1] + sens[1] * std::cos(x[0]), sens[0] * scale * x[0] * x[0] + sens[1]};
+  }
+
+  std::vector<double> ApplyJacobian(unsigned int, unsigned int, const std::vector<std::vector<double>>& inputs,
+                                    const std::vector<double>& vec, json config) override {
+    const std::vector<double>& x = inputs[0];
+    double scale = Scale(config);
+    return {2.0 * scale * x[0] * x[1] * vec[0] + scale * x[0] * x[0] * vec[1], std::cos(x[0]) * vec[0] + vec[1]};
+  }
+
+  std::vector<double> ApplyHessian(unsigned int, unsigned int, unsigned int, const std::vector<std::vector<double>>& inputs,
+                                   const std::vector<double>& sens, const std::vector<double>& vec, json config) override {
+    const std::vector<double>& x = inputs[0];
+    double scale = Scale(config);
+    // Hessian of sens[0] * f0 + sens[1] * f1
+    double h00 = sens[0] * 2.0 * scale * x[1] - sens[1] * std::sin(x[0]);
+    double h01 = sens[0] * 2.0 * scale * x[0];
+    return {h00 * vec[0] + h01 * vec[1], h01 * vec[0]};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+  bool SupportsGradient() override {
+    return true;
+  }
+  bool SupportsApplyJacobian() override {
+    return true;
+  }
+  bool SupportsApplyHessian() override {
+    return true;
+  }
+
+private:
+  static double Scale(const json& config) {
+    return config.is_object() ? config.value("scale", 1.0) : 1.0;
+  }
+};
+
+// Configs registered once are sent as handles, and unknown handles are reported as such
+void test_config_handles() {
+  AnalyticModel model;
+  std::string host = serve_locally({&model}, 4251);
+
+  umbridge::HTTPModel client(host, "analytic");
+  json config = {{"scale", 3.0}};
+  assert(client.RegisterConfig(config));
+  for (int i = 0; i < 2; ++i)
+    is_approx_equal(client.Evaluate({{1.0, 2.0}}, config)[0], {6.0, std::sin(1.0) + 2.0}, 1e-14);
+
+  httplib::Client cli(host.c_str());
+  auto registered = cli.Post("/RegisterConfig", json{{"name", "analytic"}, {"config", config}}.dump(), "application/json");
+  assert(registered && registered->status == 200);
+  std::string handle = json::parse(registered->body).at("configHandle");
+  auto evaluated = cli.Post("/Evaluate", json{{"name", "analytic"}, {"input", {{1.0, 2.0}}}, {"configHandle", handle}}.dump(), "application/json");
+  assert(evaluated && evaluated->status == 200);
+  is_approx_equal(json::parse(evaluated->body).at("output")[0].get<std::vector<double>>(), {6.0, std::sin(1.0) + 2.0}, 1e-14);
+
+  auto unknown = cli.Post("/Evaluate", json{{"name", "analytic"}, {"input", {{1.0, 2.0}}}, {"configHandle", "unknown"}}.dump(), "application/json");
+  assert(unknown && unknown->status == 400);
+  json error = json::parse(unknown->body).at("error");
+  assert(error.at("type") == "UnknownConfigHandle");
+  assert(error.at("configHandle") == "unknown");
+}
+
+// Inputs stored on the server are sent as handles, and unknown handles are reported as such
+void test_vector_handles() {
+  AnalyticModel model;
+  std::string host = serve_locally({&model}, 4252);
+
+  umbridge::HTTPModel client(host, "analytic");
+  std::vector<double> stored = {1.0, 2.0};
+  assert(client.StoreVector(stored));
+  for (int i = 0; i < 2; ++i)
+    is_approx_equal(client.Evaluate({stored})[0], {2.0, std::sin(1.0) + 2.0}, 1e-14);
+
+  httplib::Client cli(host.c_str());
+  auto store = cli.Post("/StoreVector", json{{"vec", stored}}.dump(), "application/json");
+  assert(store && store->status == 200);
+  std::string handle = json::parse(store->body).at("vectorHandle");
+  auto evaluated = cli.Post("/Evaluate", json{{"name", "analytic"}, {"input", {json::array()}}, {"inputHandles", {handle}}}.dump(), "application/json");
+  assert(evaluated && evaluated->status == 200);
+  is_approx_equal(json::parse(evaluated->body).at("output")[0].get<std::vector<double>>(), {2.0, std::sin(1.0) + 2.0}, 1e-14);
+
+  auto unknown = cli.Post("/Evaluate", json{{"name", "analytic"}, {"input", {json::array()}}, {"inputHandles", {"unknown"}}}.dump(), "application/json");
+  assert(unknown && unknown->status == 400);
+  json error = json::parse(unknown->body).at("error");
+  assert(error.at("type") == "UnknownVectorHandle");
+  assert(error.at("vectorHandle") == "unknown");
+}
+
+// Counts the calls of the current session, returning -1 outside of sessions
+class SessionCountingModel : public umbridge::Model {
+public:
+  SessionCountingModel() : umbridge::Model("counting") {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>&, json) override {
+    umbridge::Session* session = umbridge::CurrentSession();
+    if (!session)
+      return {{-1.0}};
+    return {{static_cast<double>(session->Get<Calls>().count++)}};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+private:
+  struct Calls {
+    int count = 0;
+  };
+};
+
+// Session state persists across the calls of a session, separately per session, until it is closed
+void test_sessions() {
+  SessionCountingModel model;
+  std::string host = serve_locally({&model}, 4253);
+
+  umbridge::HTTPModel client(host, "counting"), other(host, "counting");
+  assert(client.Evaluate({{0.0}})[0][0] == -1.0);
+  client.SetSession("chain-1");
+  other.SetSession("chain-2");
+  for (int call = 0; call < 3; ++call)
+    assert(client.Evaluate({{0.0}})[0][0] == call);
+  assert(other.Evaluate({{0.0}})[0][0] == 0.0);
+
+  client.CloseSession();
+  assert(client.Evaluate({{0.0}})[0][0] == -1.0);
+  client.SetSession("chain-1");
+  assert(client.Evaluate({{0.0}})[0][0] == 0.0);
+  assert(other.Evaluate({{0.0}})[0][0] == 1.0);
+}
+
+// Exposes only the evaluations of another model, recording how many of them ran at once
+class EvaluationOnlyModel : public umbridge::Model {
+public:
+  EvaluationOnlyModel(umbridge::Model& model) : umbridge::Model(model.GetName()), model(model) {}
+
+  std::vector<std::size_t> GetInputSizes(const json& config) const override {
+    return model.GetInputSizes(config);
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json& config) const override {
+    return model.GetOutputSizes(config);
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json config) override {
+    int running = ++active;
+    int previous = max_active.load();
+    while (running > previous && !max_active.compare_exchange_weak(previous, running)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    --active;
+    return model.Evaluate(inputs, config);
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+  std::atomic<int> active{0};
+  std::atomic<int> max_active{0};
+
+private:
+  umbridge::Model& model;
+};
+
+// Finite differences of a single served model match the analytic derivatives, with its evaluations running concurrently
+void test_finite_differences() {
+  AnalyticModel analytic;
+  EvaluationOnlyModel evaluation_only(analytic);
+  std::string host = serve_locally({&evaluation_only}, 4254);
+
+  umbridge::HTTPModel client(host, "analytic");
+  umbridge::FiniteDifferenceModel fd_model(client);
+  std::vector<std::vector<double>> inputs = {{0.7, -1.3}};
+  std::vector<double> sens = {0.5, 2.0}, vec = {1.0, -0.5};
+  is_approx_equal(fd_model.Gradient(0, 0, inputs, sens), analytic.Gradient(0, 0, inputs, sens, json::object()), 1e-7);
+  is_approx_equal(fd_model.ApplyJacobian(0, 0, inputs, vec), analytic.ApplyJacobian(0, 0, inputs, vec, json::object()), 1e-7);
+  is_approx_equal(fd_model.ApplyHessian(0, 0, 0, inputs, sens, vec), analytic.ApplyHessian(0, 0, 0, inputs, sens, vec, json::object()), 1e-4);
+  umbridge::JacobianMatrix jacobian = fd_model.Jacobian(0, 0, inputs);
+  assert(jacobian.rows == 2 && jacobian.cols == 2);
+  for (std::size_t col = 0; col < 2; ++col) {
+    std::vector<double> unit(2, 0.0);
+    unit[col] = 1.0;
+    std::vector<double> expected = analytic.ApplyJacobian(0, 0, inputs, unit, json::object());
+    for (std::size_t row = 0; row < 2; ++row)
+      assert(std::abs(jacobian.At(row, col) - expected[row]) < 1e-7);
+  }
+  if (std::thread::hardware_concurrency() > 1)
+    assert(evaluation_only.max_active > 1);
+
+  for (std::size_t concurrency : {1, 4}) {
+    umbridge::FiniteDifferenceOptions options;
+    options.concurrency = concurrency;
+    evaluation_only.max_active = 0;
+    umbridge::FiniteDifferenceModel limited_model(client, options);
+    is_approx_equal(limited_model.Gradient(0, 0, inputs, sens), analytic.Gradient(0, 0, inputs, sens, json::object()), 1e-7);
+    assert(concurrency == 1 ? evaluation_only.max_active == 1 : evaluation_only.max_active > 1);
+  }
+
+  // Without inputs to perturb, derivatives are empty rather than evaluated
+  umbridge::JacobianMatrix empty = fd_model.Jacobian(0, 0, {{}});
+  assert(empty.rows == 2 && empty.cols == 0);
+  assert(fd_model.ApplyHessian(0, 0, 0, {{}}, sens, {}).empty());
+}
+
+// f_i(x) = x_i^2 + x_{i-1} - x_{i+1}, with a tridiagonal Jacobian, counting its evaluations
+class TridiagonalModel : public umbridge::Model {
+public:
+  TridiagonalModel(std::size_t size) : umbridge::Model("tridiagonal"), size(size) {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {size};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {size};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    evaluations++;
+    const std::vector<double>& x = inputs[0];
+    std::vector<double> f(size);
+    for (std::size_t i = 0; i < size; ++i)
+      f[i] = x[i] * x[i] + (i > 0 ? x[i - 1] : 0.0) - (i + 1 < size ? x[i + 1] : 0.0);
+    return {f};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+  static double Derivative(const std::vector<double>& x, std::size_t row, std::size_t col) {
+    if (col == row)
+      return 2.0 * x[row];
+    if (col + 1 == row)
+      return 1.0;
+    if (col == row + 1)
+      return -1.0;
+    return 0.0;
+  }
+
+  std::atomic<int> evaluations{0};
+
+private:
+  std::size_t size;
+};
+
+// After probing the pattern once, a tridiagonal Jacobian takes three Jacobian actions, whatever its size
+void test_colored_jacobian() {
+  TridiagonalModel model(12);
+  umbridge::FiniteDifferenceModel fd_model(model);
+  umbridge::ColoredJacobianModel colored_model(fd_model);
+  assert(colored_model.NumColors(0, 0) == 0);
+
+  std::vector<double> x(12);
+  for (std::size_t i = 0; i < x.size(); ++i)
+    x[i] = 0.5 + 0.1 * i;
+  umbridge::JacobianMatrix probed = colored_model.Jacobian(0, 0, {x});
+  assert(probed.rows == 12 && probed.cols == 12 && std::abs(probed.At(3, 2) - 1.0) < 1e-7);
+  assert(colored_model.NumColors(0, 0) == 3);
+
+  for (double& value : x)
+    value = -value;
+  model.evaluations = 0;
+  umbridge::JacobianMatrix jacobian = colored_model.Jacobian(0, 0, {x});
+  assert(model.evaluations == 2 * 3);
+  assert(jacobian.sparse && jacobian.rows == 12 && jacobian.cols == 12);
+  for (std::size_t row = 0; row < 12; ++row)
+    for (std::size_t col = 0; col < 12; ++col)
+      assert(std::abs(jacobian.At(row, col) - TridiagonalModel::Derivative(x, row, col)) < 1e-7);
+
+  // Patterns are kept per config
+  json config = {{"variant", 1}};
+  assert(colored_model.NumColors(0, 0, config) == 0);
+  colored_model.Jacobian(0, 0, {x}, config);
+  assert(colored_model.NumColors(0, 0, config) == 3);
+
+  // The diagonal entry 2 x_3 vanishes at x_3 = 0, but is kept in the pattern probed there
+  umbridge::ColoredJacobianModel accidental_zero(fd_model);
+  x[3] = 0.0;
+  assert(accidental_zero.Jacobian(0, 0, {x}).At(3, 3) == 0.0);
+  x[3] = 0.7;
+  jacobian = accidental_zero.Jacobian(0, 0, {x});
+  assert(jacobian.sparse && std::abs(jacobian.At(3, 3) - 1.4) < 1e-7);
+}
+
+// The analytic test model written once over the scalar type, for automatic differentiation
+template <typename Scalar>
+std::vector<std::vector<Scalar>> evaluate_analytic(const std::vector<std::vector<Scalar>>& inputs, const json& config) {
+  using std::sin;
+  const std::vector<Scalar>& x = inputs[0];
+  double scale = config.is_object() ? config.value("scale", 1.0) : 1.0;
+  return {{scale * x[0] * x[0] * x[1], sin(x[0]) + x[1]}};
+}
+
+// One direction per evaluation, so that gradients and Jacobians take several of them
+class ForwardAnalyticModel : public umbridge::ForwardModeModel<ForwardAnalyticModel, 1> {
+public:
+  ForwardAnalyticModel() : umbridge::ForwardModeModel<ForwardAnalyticModel, 1>("analytic") {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {2};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {2};
+  }
+
+  template <typename Scalar>
+  std::vector<std::vector<Scalar>> EvaluateGeneric(const std::vector<std::vector<Scalar>>& inputs, const json& config) {
+    return evaluate_analytic(inputs, config);
+  }
+};
+
+// Forward mode derivatives match the analytic ones to rounding
+void test_forward_mode() {
+  AnalyticModel analytic;
+  ForwardAnalyticModel forward;
+  json config = {{"scale", 3.0}};
+  std::vector<std::vector<double>> inputs = {{0.7, -1.3}};
+  std::vector<double> sens = {0.5, 2.0}, vec = {1.0, -0.5};
+  is_approx_equal(forward.Evaluate(inputs, config)[0], analytic.Evaluate(inputs, config)[0], 1e-14);
+  is_approx_equal(forward.Gradient(0, 0, inputs, sens, config), analytic.Gradient(0, 0, inputs, sens, config), 1e-14);
+  is_approx_equal(forward.ApplyJacobian(0, 0, inputs, vec, config), analytic.ApplyJacobian(0, 0, inputs, vec, config), 1e-14);
+  umbridge::JacobianMatrix jacobian = forward.Jacobian(0, 0, inputs, config);
+  assert(jacobian.rows == 2 && jacobian.cols == 2);
+  for (std::size_t col = 0; col < 2; ++col) {
+    std::vector<double> unit(2, 0.0);
+    unit[col] = 1.0;
+    std::vector<double> expected = analytic.ApplyJacobian(0, 0, inputs, unit, config);
+    for (std::size_t row = 0; row < 2; ++row)
+      assert(std::abs(jacobian.At(row, col) - expected[row]) < 1e-14);
+  }
+}
+
+class ReverseAnalyticModel : public umbridge::ReverseModeModel<ReverseAnalyticModel> {
+public:
+  ReverseAnalyticModel() : umbridge::ReverseModeModel<ReverseAnalyticModel>("analytic") {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {2};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {2};
+  }
+
+  template <typename Scalar>
+  std::vector<std::vector<Scalar>> EvaluateGeneric(const std::vector<std::vector<Scalar>>& inputs, const json& config) {
+    return evaluate_analytic(inputs, config);
+  }
+};
+
+// Reverse mode gradients and forward-over-reverse Hessian actions match the analytic ones, also once the tape is reused
+void test_reverse_mode() {
+  AnalyticModel analytic;
+  ReverseAnalyticModel reverse;
+  json config = {{"scale", 3.0}};
+  std::vector<double> sens = {0.5, 2.0}, vec = {1.0, -0.5};
+  for (std::vector<std::vector<double>> inputs : {std::vector<std::vector<double>>{{0.7, -1.3}}, std::vector<std::vector<double>>{{-2.0, 0.4}}}) {
+    is_approx_equal(reverse.Gradient(0, 0, inputs, sens, config), analytic.Gradient(0, 0, inputs, sens, config), 1e-14);
+    auto [outputs, gradient] = reverse.EvaluateAndGradient(0, 0, inputs, sens, config);
+    is_approx_equal(outputs[0], analytic.Evaluate(inputs, config)[0], 1e-14);
+    is_approx_equal(gradient, analytic.Gradient(0, 0, inputs, sens, config), 1e-14);
+    is_approx_equal(reverse.ApplyHessian(0, 0, 0, inputs, sens, vec, config), analytic.ApplyHessian(0, 0, 0, inputs, sens, vec, config), 1e-13);
+  }
+}
+
+// Each evaluation inserted into a full cache evicts about one other, even with inputs far larger than outputs, and
+// the memory actually held stays near the bound
+void test_cache_eviction() {
+  ConstantModel model("constant", 1);
+  umbridge::CacheOptions options;
+  options.max_bytes = 10 * (1000 + 64) * sizeof(double);
+  umbridge::CachedModel cached_model(model, options);
+
+  std::vector<double> input(1000, 0.0);
+  for (int i = 0; i < 100; ++i) {
+    input[0] = i;
+    assert(cached_model.Evaluate({input})[0][0] == i);
+  }
+  umbridge::CacheStatistics statistics = cached_model.Statistics();
+  assert(statistics.misses == 100 && statistics.hits == 0);
+  assert(statistics.entries == 10);
+  assert(statistics.evictions == 90);
+  assert(statistics.bytes <= options.max_bytes);
+  // Evicted inputs are freed right away, leaving only spare capacity of the containers beyond the bound
+  assert(statistics.footprint > 10 * 1000 * sizeof(double) && statistics.footprint <= options.max_bytes + options.max_bytes / 10);
+
+  assert(cached_model.Evaluate({input})[0][0] == 99);
+  input[0] = 0;
+  assert(cached_model.Evaluate({input})[0][0] == 0);
+  statistics = cached_model.Statistics();
+  assert(statistics.hits == 1 && statistics.evictions == 91);
+}
+
+// f(x) = sin(x)
+class SineModel : public umbridge::Model {
+public:
+  SineModel() : umbridge::Model("sine") {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    return {{std::sin(inputs[0][0])}};
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+};
+
+// Once fitted, the surrogate answers within max_error between training points; fits also succeed in high dimension,
+// where kernel values between training points underflow
+void test_surrogate() {
+  SineModel model;
+  umbridge::SurrogateOptions options;
+  umbridge::SurrogateModel surrogate_model(model, options);
+  for (int i = 0; i < 10; ++i)
+    assert(surrogate_model.Evaluate({{0.025 * i}})[0][0] == std::sin(0.025 * i));
+  surrogate_model.WaitForRefits();
+  assert(surrogate_model.Statistics().refits == 1);
+
+  double x = 0.1125;
+  assert(std::abs(surrogate_model.Evaluate({{x}})[0][0] - std::sin(x)) < options.max_error);
+  umbridge::SurrogateStatistics statistics = surrogate_model.Statistics();
+  assert(statistics.surrogate_evaluations == 1 && statistics.model_evaluations == 10);
+
+  // Also extrapolating, where the emulator is least accurate, answers stay within max_error
+  for (int i = -40; i <= 80; ++i) {
+    x = 0.005 * i;
+    assert(std::abs(surrogate_model.Evaluate({{x}})[0][0] - std::sin(x)) < options.max_error);
+  }
+  surrogate_model.WaitForRefits();
+  statistics = surrogate_model.Statistics();
+  assert(statistics.surrogate_evaluations > 1 && statistics.model_evaluations > 10);
+  assert(statistics.failed_refits == 0 && statistics.last_refit_error.empty());
+  assert(!umbridge::SurrogateModel(model).IsDeterministic());
+
+  const std::size_t dimension = 2000;
+  std::mt19937 generator(42);
+  std::normal_distribution<double> normal;
+  std::vector<std::vector<double>> points(20, std::vector<double>(dimension)), values;
+  for (auto& point : points) {
+    for (double& entry : point)
+      entry = normal(generator);
+    values.push_back({std::accumulate(point.begin(), point.end(), 0.0)});
+  }
+  umbridge::GaussianProcess process(points, values);
+  std::vector<double> mean, deviation;
+  process.Predict(points[3], mean, deviation);
+  assert(std::abs(mean[0] - values[3][0]) < 1e-3 * std::abs(values[3][0]) + 1e-3);
+}
+
+#ifdef SUPPORT_POSIX_SHMEM
+// Evaluations survive reopening the store, a torn record at the end of the log is dropped, a damaged index is rebuilt
+// from the log, and concurrent lookups see evaluations as they are put
+void test_evaluation_store() {
+  std::string path = "/tmp/umbridge_test_store_" + std::to_string(getpid());
+  std::remove(path.c_str());
+  std::remove((path + ".index").c_str());
+
+  TridiagonalModel model(3);
+  for (int i = 0; i < 3; ++i) {
+    umbridge::EvaluationStore store(path);
+    umbridge::StoredModel stored_model(model, store);
+    for (int j = 0; j <= i; ++j)
+      stored_model.Evaluate({{1.0 * j, 2.0, 3.0}});
+    store.Flush();
+    assert(store.Size() == static_cast<std::size_t>(i + 1));
+  }
+  assert(model.evaluations == 3);
+
+  struct stat status;
+  stat(path.c_str(), &status);
+  assert(truncate(path.c_str(), status.st_size - 5) == 0);
+  {
+    umbridge::EvaluationStore store(path);
+    assert(store.Size() == 2);
+    umbridge::StoreStatistics statistics = store.Statistics();
+    assert(statistics.evaluations == 2 && statistics.discarded_bytes > 0 && statistics.failed_writes == 0);
+    std::vector<std::vector<double>> outputs;
+    assert(store.Get("tridiagonal", {{1.0, 2.0, 3.0}}, json::parse("{}"), outputs));
+    is_approx_equal(outputs[0], model.Evaluate({{1.0, 2.0, 3.0}}, json::parse("{}"))[0], 1e-14);
+    assert(!store.Get("tridiagonal", {{2.0, 2.0, 3.0}}, json::parse("{}"), outputs));
+  }
+
+  std::ofstream(path + ".index", std::ios::in | std::ios::out | std::ios::binary).write("\0\0\0\0\0\0\0\0", 8);
+  {
+    umbridge::EvaluationStore store(path);
+    assert(store.Size() == 2);
+    std::vector<std::vector<double>> outputs;
+    assert(store.Get("tridiagonal", {{0.0, 2.0, 3.0}}, json::parse("{}"), outputs));
+    assert(store.Statistics().discarded_bytes == 0);
+
+    // Lookups right after a Put find the evaluation, whether it is still queued or already written
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&store, t]() {
+        std::vector<std::vector<double>> found;
+        for (int i = 0; i < 200; ++i) {
+          std::vector<std::vector<double>> inputs = {{1.0 * t, 1.0 * i}};
+          store.Put("concurrent", inputs, json::parse("{}"), inputs);
+          for (int j = std::max(0, i - 20); j <= i; ++j)
+            assert(store.Get("concurrent", {{1.0 * t, 1.0 * j}}, json::parse("{}"), found) && found[0][1] == j);
+        }
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    store.Flush();
+    assert(store.Size() == 802 && store.Statistics().failed_writes == 0);
+  }
+  std::remove(path.c_str());
+  std::remove((path + ".index").c_str());
+}
+#endif
+
+// Returns its input after a while, counting its evaluations
+class SlowModel : public umbridge::Model {
+public:
+  SlowModel(std::string name, bool deterministic) : umbridge::Model(name), deterministic(deterministic) {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    evaluations++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    return inputs;
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+  bool IsDeterministic() const override {
+    return deterministic;
+  }
+
+  std::atomic<int> evaluations{0};
+
+private:
+  bool deterministic;
+};
+
+// Identical requests in flight are evaluated once for deterministic models, and each on their own otherwise
+void test_coalescing() {
+  SlowModel deterministic("deterministic", true), stochastic("stochastic", false);
+  std::string host = serve_locally({&deterministic, &stochastic}, 4255);
+
+  for (SlowModel* model : {&deterministic, &stochastic}) {
+    umbridge::HTTPModel client(host, model->GetName());
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+      threads.emplace_back([&client]() { assert(client.Evaluate({{1.5}})[0][0] == 1.5); });
+    for (auto& thread : threads)
+      thread.join();
+    assert(model->evaluations == (model->IsDeterministic() ? 1 : 4));
+  }
+
+  // A cache keeps a model deterministic only when it returns exact matches
+  umbridge::CacheOptions options;
+  assert(umbridge::CachedModel(deterministic, options).IsDeterministic());
+  assert(!umbridge::CachedModel(stochastic, options).IsDeterministic());
+  options.tolerance = 1e-6;
+  assert(!umbridge::CachedModel(deterministic, options).IsDeterministic());
+}
+
+// Returns its input, but only while not held, recording the inputs of the evaluations it starts and finishes
+class GatedModel : public umbridge::Model {
+public:
+  GatedModel(std::string name) : umbridge::Model(name) {}
+
+  std::vector<std::size_t> GetInputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::size_t> GetOutputSizes(const json&) const override {
+    return {1};
+  }
+
+  std::vector<std::vector<double>> Evaluate(const std::vector<std::vector<double>>& inputs, json) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    started.push_back(inputs[0][0]);
+    condition.notify_all();
+    condition.wait(lock, [&]() { return !held; });
+    finished++;
+    condition.notify_all();
+    return inputs;
+  }
+
+  bool SupportsEvaluate() override {
+    return true;
+  }
+
+  void Hold() {
+    std::lock_guard<std::mutex> lock(mutex);
+    held = true;
+  }
+
+  void Release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    held = false;
+    condition.notify_all();
+  }
+
+  // Block until count evaluations have started, returning the inputs they started with
+  std::vector<double> WaitStarted(std::size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&]() { return started.size() >= count; });
+    return started;
+  }
+
+  void WaitFinished(std::size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&]() { return finished >= count; });
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool held = false;
+  std::vector<double> started;
+  std::size_t finished = 0;
+};
+
+// Calls past their deadline throw CancelledError, and a serial server drops calls cancelled or past their deadline
+// while queued instead of evaluating them. Malformed deadlines are ignored.
+void test_cancellation() {
+  GatedModel model("gated");
+  std::string host = serve_locally({&model}, 4256, false);
+  umbridge::HTTPModel client(host, "gated"), busy_client(host, "gated");
+
+  model.Hold();
+  client.SetTimeout(std::chrono::milliseconds(100));
+  bool cancelled = false;
+  try {
+    client.Evaluate({{1.0}});
+  } catch (umbridge::CancelledError&) {
+    cancelled = true;
+  }
+  assert(cancelled);
+  model.Release();
+  model.WaitFinished(1); // The server finishes the abandoned evaluation
+  client.SetTimeout(std::chrono::milliseconds(0));
+  assert(client.Evaluate({{2.0}})[0][0] == 2.0);
+
+  // Queued behind a busy model until past its deadline
+  model.Hold();
+  std::thread busy([&]() { busy_client.Evaluate({{3.0}}); });
+  model.WaitStarted(3);
+  client.SetTimeout(std::chrono::milliseconds(100));
+  cancelled = false;
+  try {
+    client.Evaluate({{4.0}});
+  } catch (umbridge::CancelledError&) {
+    cancelled = true;
+  }
+  assert(cancelled);
+  model.Release();
+  busy.join();
+
+  // Queued behind a busy model until cancelled through /Cancel, once the server has registered it
+  model.Hold();
+  busy = std::thread([&]() { busy_client.Evaluate({{5.0}}); });
+  model.WaitStarted(4);
+  int queued_status = 0;
+  std::string queued_body;
+  std::thread caller([&]() {
+    httplib::Client cli(host.c_str());
+    if (auto res = cli.Post("/Evaluate", {{"X-UMBridge-Call", "queued-call"}}, json{{"name", "gated"}, {"input", {{6.0}}}}.dump(), "application/json")) {
+      queued_status = res->status;
+      queued_body = res->body;
+    }
+  });
+  httplib::Client cli(host.c_str());
+  for (int attempt = 0; attempt < 1000; ++attempt) {
+    auto cancel = cli.Post("/Cancel", json{{"call", "queued-call"}}.dump(), "application/json");
+    assert(cancel && cancel->status == 200);
+    if (json::parse(cancel->body).at("cancelled") == 1)
+      break;
+    std::this_thread::yield();
+  }
+  model.Release();
+  caller.join();
+  busy.join();
+  assert(queued_status == 503);
+  assert(json::parse(queued_body).at("error").at("type") == "Cancelled");
+
+  auto malformed = cli.Post("/Evaluate", {{"X-UMBridge-Deadline-Ms", "soon"}}, json{{"name", "gated"}, {"input", {{7.0}}}}.dump(), "application/json");
+  assert(malformed && malformed->status == 200);
+  assert(model.WaitStarted(5) == std::vector<double>({1.0, 2.0, 3.0, 5.0, 7.0}));
+}
+
+// Checks that its Jacobian actions are served for the expected call
+class ContextCheckingModel : public AnalyticModel {
+public:
+  std::vector<double> ApplyJacobian(unsigned int outWrt, unsigned int inWrt, const std::vector<std::vector<double>>& inputs,
+                                    const std::vector<double>& vec, json config) override {
+    assert(&umbridge::CurrentCancellation() == expected_cancellation && umbridge::CurrentSession() == expected_session);
+    return AnalyticModel::ApplyJacobian(outWrt, inWrt, inputs, vec, config);
+  }
+
+  const umbridge::CancellationToken* expected_cancellation = nullptr;
+  umbridge::Session* expected_session = nullptr;
+};
+
+// Threads of parallel_for serve the same call, with its cancellation and session, as the thread starting them
+void test_parallel_call_context() {
+  ContextCheckingModel model;
+  umbridge::CancellationToken token;
+  umbridge::SessionStore sessions;
+  umbridge::current_cancellation() = &token;
+  {
+    umbridge::SessionScope session(json{{"name", "analytic"}, {"session", "block"}}, sessions);
+    umbridge::ParallelCallsScope parallel(4);
+    model.expected_cancellation = &token;
+    model.expected_session = umbridge::CurrentSession();
+    assert(model.expected_session);
+    std::vector<std::vector<double>> vecs(8, std::vector<double>{1.0, 0.5});
+    assert(model.ApplyJacobianBlock(0, 0, {{1.0, 2.0}}, vecs, json{{"scale", 1.0}}).size() == vecs.size());
+  }
+  umbridge::current_cancellation() = nullptr;
+}
+
+#ifdef SUPPORT_POSIX_SHMEM
+// Out of range outWrt and inWrt in shared memory requests are rejected before any output buffer is sized by them
+void test_shmem_wrt_checks() {
+  AnalyticModel model;
+  std::string host = serve_locally({&model}, 4257);
+
+  httplib::Client cli(host.c_str());
+  json request_body = {{"name", "analytic"}, {"shmem_name", "/umbridge_test"}, {"tid", "0"}, {"shmem_num_inputs", 0},
+                       {"inWrt", 0}, {"outWrt", 5}, {"vec", {1.0, 0.0}}, {"sens", {1.0, 0.0}}};
+  auto jacobian = cli.Post("/ApplyJacobianShMem", request_body.dump(), "application/json");
+  assert(jacobian && jacobian->status == 400);
+  request_body["inWrt1"] = request_body["inWrt2"] = 0;
+  auto hessian = cli.Post("/ApplyHessianShMem", request_body.dump(), "application/json");
+  assert(hessian && hessian->status == 400);
+  request_body["outWrt"] = 0;
+  request_body["inWrt"] = 5;
+  auto gradient = cli.Post("/GradientShMem", request_body.dump(), "application/json");
+  assert(gradient && gradient->status == 400);
+}
+#endif
+
+#ifdef SUPPORT_UNIX_SOCKET
+// Models served on a Unix domain socket as well answer clients connecting through unix:// URLs the same way
+void test_unix_socket() {
+  AnalyticModel model;
+  std::string socket_path = "/tmp/umbridge_test_" + std::to_string(getpid()) + ".sock";
+  serve_locally({&model}, 4258, true, socket_path);
+
+  umbridge::HTTPModel client("unix://" + socket_path, "analytic");
+  assert(umbridge::SupportedModels("unix://" + socket_path) == std::vector<std::string>{"analytic"});
+  json config = {{"scale", 3.0}};
+  std::vector<std::vector<double>> inputs = {{0.7, -1.3}};
+  std::vector<double> sens = {0.5, 2.0};
+  is_approx_equal(client.Evaluate(inputs, config)[0], model.Evaluate(inputs, config)[0], 1e-14);
+  is_approx_equal(client.Gradient(0, 0, inputs, sens, config), model.Gradient(0, 0, inputs, sens, config), 1e-14);
+  unlink(socket_path.c_str());
+  unlink((socket_path + ".fd").c_str());
+}
+#endif
+
+#ifdef SUPPORT_MEMFD
+// Shared memory buffers travel as memfds over the side channel of a Unix socket, and buffers nobody claims in time
+// are closed
+void test_memfd() {
+  AnalyticModel model;
+  std::string socket_path = "/tmp/umbridge_test_memfd_" + std::to_string(getpid()) + ".sock";
+  serve_locally({&model}, 4259, true, socket_path);
+  {
+    umbridge::HTTPModel client("unix://" + socket_path, "analytic", true);
+    std::vector<std::vector<double>> inputs = {{0.7, -1.3}};
+    std::vector<double> sens = {0.5, 2.0}, vec = {1.0, -0.5};
+    for (int i = 0; i < 2; ++i) {
+      is_approx_equal(client.Evaluate(inputs)[0], model.Evaluate(inputs, json::object())[0], 1e-14);
+      is_approx_equal(client.Gradient(0, 0, inputs, sens), model.Gradient(0, 0, inputs, sens, json::object()), 1e-14);
+      is_approx_equal(client.ApplyJacobian(0, 0, inputs, vec), model.ApplyJacobian(0, 0, inputs, vec, json::object()), 1e-14);
+    }
+  }
+  unlink(socket_path.c_str());
+  unlink((socket_path + ".fd").c_str());
+
+  auto is_open = [](int fd) { return fcntl(fd, F_GETFD) != -1; };
+  umbridge::FdMailbox mailbox;
+  int kept = memfd_create("umbridge_test", MFD_CLOEXEC);
+  mailbox.Put("kept", {kept}, 0);
+  assert(mailbox.Take("kept") == std::vector<int>{kept} && is_open(kept));
+  close(kept);
+
+  umbridge::FdMailbox expiring_mailbox(std::chrono::seconds(0));
+  int unclaimed = memfd_create("umbridge_test", MFD_CLOEXEC), late = memfd_create("umbridge_test", MFD_CLOEXEC);
+  expiring_mailbox.Put("unclaimed", {unclaimed}, 0);
+  expiring_mailbox.Put("late", {late}, 0);
+  assert(!is_open(unclaimed) && is_open(late));
+  bool rejected = false;
+  try {
+    expiring_mailbox.Take("late");
+  } catch (std::runtime_error&) {
+    rejected = true;
+  }
+  assert(rejected && !is_open(late));
+
+  umbridge::FdMailbox connection_mailbox;
+  int orphaned = memfd_create("umbridge_test", MFD_CLOEXEC);
+  connection_mailbox.Put("orphaned", {orphaned}, 7);
+  connection_mailbox.DiscardConnection(7);
+  assert(!is_open(orphaned));
+}
+#endif
+
+// Bodies written by MessageBodyWriter parse back into the same numeric arrays and fields; malformed ones are rejected
+void test_parse_message_body() {
+  std::vector<std::vector<double>> inputs {{1.0, -2.5}, {}, {3e-300}};
+  std::string text = umbridge::MessageBodyWriter().Field("name", std::string("forward")).Config(json{{"level", 2}})
+      .Vectors("input", inputs).Vector("sens", {0.5}).Str();
+  umbridge::MessageBody body = umbridge::parse_message_body(text);
+  assert(body.Vectors("input") == inputs);
+  assert(body.Vector("sens") == std::vector<double>({0.5}));
+  assert(body.fields["name"] == "forward");
+  assert(body.fields["config"]["level"] == 2);
+
+  for (std::string malformed : {"", "{\"input\":[[1]]", "{\"input\":[[1],2]}", "{\"name\":}", "{} {}"}) {
+    bool rejected = false;
+    try {
+      umbridge::parse_message_body(malformed);
+    } catch (json::parse_error&) {
+      rejected = true;
+    }
+    assert(rejected);
+  }
+}
+
+// The stream parser gives the same result however the body is split into chunks, and rejects malformed or truncated
+// bodies with json::parse_error
+void test_stream_parser() {
+  auto parse = [](const std::string& text, std::size_t chunk_size) {
+    umbridge::MessageBodyStreamParser parser;
+    for (std::size_t i = 0; i < text.size(); i += chunk_size)
+      parser.Feed(text.data() + i, std::min(chunk_size, text.size() - i));
+    return parser.Finish();
+  };
+  auto rejects = [&](const std::string& text, std::size_t chunk_size) {
+    try {
+      parse(text, chunk_size);
+    } catch (json::parse_error&) {
+      return true;
+    }
+    return false;
+  };
+
+  std::string text = R"( { "na\"me" : "a\\\"}b" , "config":{"a":[1,{"b":"]"}],"c":null,"A":"x"},"flag":true,)"
+      R"("n":-1.5e3, "input" : [ [1e-3, -0,2.5E+10 ] ,[-0.0],[]], "sens":[null,12345.678e-2], "vec":[] } )";
+  for (std::size_t chunk_size = 1; chunk_size <= text.size(); chunk_size++) {
+    umbridge::MessageBody body = parse(text, chunk_size);
+    assert(body.fields["na\"me"] == "a\\\"}b");
+    assert(body.fields["config"] == json::parse(R"({"a":[1,{"b":"]"}],"c":null,"A":"x"})"));
+    assert(body.fields["flag"] == true);
+    assert(body.fields["n"] == -1500.0);
+    std::vector<std::vector<double>>& input = body.Vectors("input");
+    assert(input == std::vector<std::vector<double>>({{1e-3, 0.0, 2.5e10}, {0.0}, {}}));
+    assert(std::signbit(input[0][1]) && std::signbit(input[1][0]));
+    std::vector<double>& sens = body.Vector("sens");
+    assert(sens.size() == 2 && std::isnan(sens[0]) && sens[1] == 123.45678);
+    assert(body.Vectors("vec").empty());
+  }
+
+  // Every proper prefix is truncated
+  for (std::size_t length = 0; length < text.find_last_of('}'); length++)
+    assert(rejects(text.substr(0, length), 1) && rejects(text.substr(0, length), text.size()));
+
+  for (std::string malformed : {"[]", "{\"input\":[1e]}", "{\"input\":[1.2.3]}", "{\"input\":[--1]}",
+      "{\"input\":[nul]}", "{\"input\":[1 2]}", "{\"input\":[1,]}", "{\"input\":[,1]}", "{\"input\":[[1]]]}",
+      "{\"input\":[[1],[[2]]]}", "{\"input\":[[1],2]}", "{\"input\":[\"1\"]}", "{\"input\":[{}]}",
+      "{\"config\":{\"a\":}}", "{\"config\" {}}", "{name:1}", "{\"a\\q\":1}", "{\"a\":1,}", "{\"a\":1} x"}) {
+    for (std::size_t chunk_size = 1; chunk_size <= malformed.size(); chunk_size++)
+      assert(rejects(malformed, chunk_size));
+  }
+}
+
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+// The server advertises gzip support; large requests and responses then travel compressed both ways
+void test_compression() {
+  TridiagonalModel model(20000);
+  std::string host = serve_locally({&model}, 4260);
+
+  std::vector<double> x(20000);
+  for (std::size_t i = 0; i < x.size(); ++i)
+    x[i] = std::sin(1.0 + i);
+  std::vector<double> expected = model.Evaluate({x}, json())[0];
+
+  httplib::Client cli(host.c_str());
+  httplib::Result info = cli.Get("/Info");
+  assert(info && info->get_header_value("Accept-Encoding") == "gzip");
+
+  std::string body = umbridge::MessageBodyWriter().Field("name", std::string("tridiagonal")).Config(json())
+      .Vectors("input", std::vector<std::vector<double>>{x}).Str();
+  assert(body.size() >= umbridge::request_compression_min_bytes);
+  std::string compressed;
+  assert(umbridge::gzip_compress(body, compressed) && compressed.size() < body.size());
+  httplib::Headers headers {{"Content-Encoding", "gzip"}, {"Accept-Encoding", "gzip"}};
+  httplib::Result res = cli.Post("/Evaluate", headers, compressed, "application/json");
+  assert(res && res->status == 200 && res->get_header_value("Content-Encoding") == "gzip");
+  is_approx_equal(umbridge::parse_message_body(res->body).Vectors("output")[0], expected, 1e-14);
+
+  umbridge::HTTPModel client(host, "tridiagonal");
+  is_approx_equal(client.Evaluate({x})[0], expected, 1e-14);
+  std::vector<std::vector<double>> outputs;
+  client.EvaluateInto({x}, outputs);
+  is_approx_equal(outputs[0], expected, 1e-14);
+}
+#endif
+
+// Hands out models on local servers in turn, like a job manager whose jobs land on different nodes
+class LocalJobManager : public JobManager {
+public:
+  LocalJobManager(std::vector<std::string> hosts) : hosts(hosts) {}
+
+  std::unique_ptr<umbridge::Model> requestModelAccess(const std::string& model_name) override {
+    return std::make_unique<umbridge::HTTPModel>(hosts[next++ % hosts.size()], model_name);
+  }
+
+  std::vector<std::string> getModelNames() override {
+    return umbridge::SupportedModels(hosts.front());
+  }
+
+private:
+  std::vector<std::string> hosts;
+  std::atomic<std::size_t> next{0};
+};
+
+// The load balancer sends all calls of a session to the same backend and closes the session there along with its own.
+// Sessions serving a call outlive their time to live.
+void test_load_balancer_sessions() {
+  SessionCountingModel first, second;
+  std::vector<std::string> backends = {serve_locally({&first}, 4261), serve_locally({&second}, 4262)};
+  LoadBalancer balancer("counting", std::make_shared<LocalJobManager>(backends));
+  std::string host = serve_locally({&balancer}, 4263);
+
+  umbridge::HTTPModel client(host, "counting");
+  client.SetSession("chain-1");
+  for (int call = 0; call < 4; ++call)
+    assert(client.Evaluate({{0.0}})[0][0] == call);
+  client.CloseSession();
+  for (const std::string& backend : backends) {
+    umbridge::HTTPModel direct(backend, "counting");
+    direct.SetSession("chain-1");
+    assert(direct.Evaluate({{0.0}})[0][0] == 0.0);
+  }
+
+  umbridge::SessionStore sessions(std::chrono::milliseconds(0));
+  std::shared_ptr<umbridge::Session> serving = sessions.Get("counting", "chain-1");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  assert(sessions.Get("counting", "chain-1") == serving);
+  std::weak_ptr<umbridge::Session> released = serving;
+  serving.reset();
+  for (int attempt = 0; attempt < 500 && !released.expired(); attempt++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  assert(released.expired());
+}
+
+// Returns a gradient one entry short, which the server reports rather than passing on
+class ShortGradientModel : public AnalyticModel {
+public:
+  ShortGradientModel() {
+    name = "short-gradient";
+  }
+
+  std::vector<double> Gradient(unsigned int outWrt, unsigned int inWrt, const std::vector<std::vector<double>>& inputs,
+                               const std::vector<double>& sens, json config) override {
+    std::vector<double> gradient = AnalyticModel::Gradient(outWrt, inWrt, inputs, sens, config);
+    gradient.pop_back();
+    return gradient;
+  }
+};
+
+// The fused /EvaluateAndGradient endpoint returns outputs and gradient in one response, checking the gradient's size
+void test_evaluate_and_gradient() {
+  AnalyticModel model;
+  ShortGradientModel short_gradient;
+  std::string host = serve_locally({&model, &short_gradient}, 4264);
+  std::vector<std::vector<double>> inputs = {{1.0, 2.0}};
+  std::vector<double> sens = {1.0, 0.5};
+  std::vector<double> expected_output = model.Evaluate(inputs, json())[0];
+  std::vector<double> expected_gradient = model.Gradient(0, 0, inputs, sens, json());
+
+  httplib::Client cli(host.c_str());
+  json request = {{"name", "analytic"}, {"outWrt", 0}, {"inWrt", 0}, {"input", inputs}, {"sens", sens}, {"config", {{"scale", 2.0}}}};
+  auto fused = cli.Post("/EvaluateAndGradient", request.dump(), "application/json");
+  assert(fused && fused->status == 200);
+  json response = json::parse(fused->body);
+  is_approx_equal(response.at("output")[0].get<std::vector<double>>(), model.Evaluate(inputs, {{"scale", 2.0}})[0], 1e-14);
+  is_approx_equal(response.at("gradient").get<std::vector<double>>(), model.Gradient(0, 0, inputs, sens, {{"scale", 2.0}}), 1e-14);
+
+  umbridge::HTTPModel client(host, "analytic");
+  auto [outputs, gradient] = client.EvaluateAndGradient(0, 0, inputs, sens);
+  is_approx_equal(outputs[0], expected_output, 1e-14);
+  is_approx_equal(gradient, expected_gradient, 1e-14);
+
+  request["name"] = "short-gradient";
+  auto rejected = cli.Post("/EvaluateAndGradient", request.dump(), "application/json");
+  assert(rejected && rejected->status == 500);
+  assert(json::parse(rejected->body).at("error").at("type") == "InvalidOutput");
+  umbridge::HTTPModel short_client(host, "short-gradient");
+  bool thrown = false;
+  try {
+    short_client.EvaluateAndGradient(0, 0, inputs, sens);
+  } catch (std::runtime_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// The block endpoints apply the Jacobian or Hessian to several vectors in one request, with the same results as
+// separate calls per vector
+void test_block_endpoints() {
+  AnalyticModel model;
+  std::string host = serve_locally({&model}, 4265);
+  std::vector<std::vector<double>> inputs = {{1.0, 2.0}};
+  std::vector<double> sens = {1.0, 0.5};
+  std::vector<std::vector<double>> vecs = {{1.0, 0.0}, {0.0, 1.0}, {0.3, -2.0}};
+  json config = {{"scale", 2.0}};
+
+  umbridge::HTTPModel client(host, "analytic");
+  std::vector<std::vector<double>> jacobian_actions = client.ApplyJacobianBlock(0, 0, inputs, vecs, config);
+  std::vector<std::vector<double>> hessian_actions = client.ApplyHessianBlock(0, 0, 0, inputs, sens, vecs, config);
+  assert(jacobian_actions.size() == vecs.size() && hessian_actions.size() == vecs.size());
+  for (std::size_t i = 0; i < vecs.size(); ++i) {
+    is_approx_equal(jacobian_actions[i], model.ApplyJacobian(0, 0, inputs, vecs[i], config), 1e-14);
+    is_approx_equal(hessian_actions[i], model.ApplyHessian(0, 0, 0, inputs, sens, vecs[i], config), 1e-14);
+  }
+  assert(client.ApplyJacobianBlock(0, 0, inputs, {}).empty());
+
+  httplib::Client cli(host.c_str());
+  json request = {{"name", "analytic"}, {"outWrt", 0}, {"inWrt", 0}, {"input", inputs}, {"vecs", vecs}};
+  auto block = cli.Post("/ApplyJacobianBlock", request.dump(), "application/json");
+  assert(block && block->status == 200);
+  assert(json::parse(block->body).at("output").size() == vecs.size());
+
+  request["vecs"] = {{1.0, 0.0}, {1.0}};
+  auto mismatched = cli.Post("/ApplyJacobianBlock", request.dump(), "application/json");
+  assert(mismatched && mismatched->status == 400);
+  request["inWrt1"] = 0;
+  request["inWrt2"] = 0;
+  request["sens"] = sens;
+  mismatched = cli.Post("/ApplyHessianBlock", request.dump(), "application/json");
+  assert(mismatched && mismatched->status == 400);
+}
+
+// Returns its Jacobian in CSR format, or with a column index out of range if the config asks for it
+class SparseJacobianModel : public AnalyticModel {
+public:
+  SparseJacobianModel() {
+    name = "sparse";
+  }
+
+  umbridge::JacobianMatrix Jacobian(unsigned int, unsigned int, const std::vector<std::vector<double>>& inputs, json config) override {
+    const std::vector<double>& x = inputs[0];
+    std::size_t last_column = config.value("broken", false) ? 2 : 1;
+    return umbridge::JacobianMatrix::Sparse(2, 2, {0, 2, 3}, {0, 1, last_column}, {2.0 * x[0] * x[1], x[0] * x[0], 1.0});
+  }
+};
+
+// The /Jacobian endpoint returns dense and sparse Jacobians. Malformed ones are rejected by the server, and by the
+// client when reading a response.
+void test_jacobian_endpoint() {
+  AnalyticModel model;
+  SparseJacobianModel sparse;
+  std::string host = serve_locally({&model, &sparse}, 4266);
+  std::vector<std::vector<double>> inputs = {{1.0, 2.0}};
+  json config = {{"scale", 2.0}};
+
+  umbridge::HTTPModel client(host, "analytic");
+  umbridge::JacobianMatrix dense = client.Jacobian(0, 0, inputs, config);
+  assert(!dense.sparse && dense.rows == 2 && dense.cols == 2);
+  for (std::size_t col = 0; col < 2; ++col) {
+    std::vector<double> unit(2, 0.0);
+    unit[col] = 1.0;
+    std::vector<double> column = model.ApplyJacobian(0, 0, inputs, unit, config);
+    for (std::size_t row = 0; row < 2; ++row)
+      assert(std::abs(dense.At(row, col) - column[row]) < 1e-14);
+  }
+
+  umbridge::HTTPModel sparse_client(host, "sparse");
+  umbridge::JacobianMatrix csr = sparse_client.Jacobian(0, 0, inputs);
+  assert(csr.sparse && csr.values.size() == 3);
+  assert(csr.At(0, 0) == 4.0 && csr.At(0, 1) == 1.0 && csr.At(1, 0) == 0.0 && csr.At(1, 1) == 1.0);
+
+  httplib::Client cli(host.c_str());
+  json request = {{"name", "sparse"}, {"outWrt", 0}, {"inWrt", 0}, {"input", inputs}, {"config", {{"broken", true}}}};
+  auto broken = cli.Post("/Jacobian", request.dump(), "application/json");
+  assert(broken && broken->status == 500);
+  assert(json::parse(broken->body).at("error").at("type") == "InvalidOutput");
+
+  for (std::string malformed : {R"({"rows":2,"cols":2,"format":"dense","values":[1.0,2.0,3.0]})",
+      R"({"rows":2,"cols":2,"format":"csr","values":[1.0],"rowOffsets":[0,1,1],"columnIndices":[2]})",
+      R"({"rows":2,"cols":2,"format":"csr","values":[1.0],"rowOffsets":[0,1,1],"columnIndices":[-1]})",
+      R"({"rows":2,"cols":2,"format":"csr","values":[1.0],"rowOffsets":[0,2,1],"columnIndices":[0]})"}) {
+    umbridge::MessageBody body = umbridge::parse_message_body(malformed);
+    bool rejected = false;
+    try {
+      umbridge::read_jacobian(body);
+    } catch (std::runtime_error&) {
+      rejected = true;
+    }
+    assert(rejected);
+  }
+}
+
 int main(int argc, char** argv) {
+  test_config_handles();
+  test_vector_handles();
+  test_sessions();
+  test_finite_differences();
+  test_colored_jacobian();
+  test_forward_mode();
+  test_reverse_mode();
+  test_cache_eviction();
+  test_surrogate();
+#ifdef SUPPORT_POSIX_SHMEM
+  test_evaluation_store();
+#endif
+  test_coalescing();
+  test_cancellation();
+  test_parallel_call_context();
+#ifdef SUPPORT_POSIX_SHMEM
+  test_shmem_wrt_checks();
+#endif
+#ifdef SUPPORT_UNIX_SOCKET
+  test_unix_socket();
+#endif
+#ifdef SUPPORT_MEMFD
+  test_memfd();
+#endif
+  test_parse_message_body();
+  test_stream_parser();
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+  test_compression();
+#endif
+  test_load_balancer_sessions();
+  test_evaluate_and_gradient();
+  test_block_endpoints();
+  test_jacobian_endpoint();
+  if (argc > 1 && std::string(argv[1]) == "--local-only")
+    return 0;
+
   std::string host = "http://model:4242";
 
   std::vector<std::string> models = umbridge::SupportedModels(host);
@@ -30,15 +1262,51 @@ int main(int argc, char** argv) {
   assert(outputs[0].size() == 31);
   is_approx_equal(outputs[0], {0.0, 0.0010305185555431918, 0.00398769970980497, 0.00874160408504413, 0.015166746593403382, 0.02314208356583947, 0.032550997847455417, 0.04328128359051827, 0.05522514792620459, 0.06827918055460522, 0.08234433711082555, 0.09732597287604661, 0.11313388801901988, 0.12968239140103968, 0.14689035093904412, 0.16468125026385314, 0.18298325080536978, 0.20172927481502115, 0.22085705474775763, 0.24030915679862971, 0.2600329758429953, 0.27998071014804726, 0.3001093096569888, 0.3203804295432889, 0.3407603753967599, 0.36122006238251075, 0.3817349772122309, 0.40228514200337073, 0.4228550774751416, 0.4434337671927345, 0.4640146361299798}, 1e-8);
 
+  std::vector<std::vector<double>> outputs_into;
+  for (int i = 0; i < 2; ++i) {
+    client.EvaluateInto(inputs, outputs_into);
+    assert(outputs_into.size() == 1);
+    is_approx_equal(outputs_into[0], outputs[0], 1e-14);
+  }
+
   std::vector<double> vec = client.ApplyJacobian(0, 0, inputs, std::vector<double>(31, 1.0));
   assert(vec.size() == 31);
   is_approx_equal(vec, {0.0, -3.0446914977063364e-08, -1.1818488276253744e-07, -2.597003348227248e-07, -4.515692855040442e-07, -6.904588653249138e-07, -9.731271881709425e-07, -1.2964248966599779e-06, -1.657298156286886e-06, -2.0527501178826717e-06, -2.479876654181209e-06, -2.935875245668267e-06, -3.418048457652867e-06, -3.923805485632329e-06, -4.450671427482561e-06, -4.996285738093009e-06, -5.558412274239472e-06, -6.134944703361761e-06, -6.7239034128336145e-06, -7.3234509636131675e-06, -7.931898271703147e-06, -8.547701517420774e-06, -9.169451327842432e-06, -9.795886685089096e-06, -1.0425873291215666e-05, -1.1058422112591528e-05, -1.1692714105741337e-05, -1.2328084763694529e-05, -1.2964030297445511e-05, -1.3600207635953668e-05, -1.4236422063222973e-05}, 1e-8);
 
+  umbridge::JacobianMatrix jacobian = client.Jacobian(0, 0, inputs);
+  assert(jacobian.rows == 31 && jacobian.cols == 31);
+  for (std::size_t row = 0; row < jacobian.rows; row++) {
+    double row_sum = 0.0;
+    for (std::size_t col = 0; col < jacobian.cols; col++)
+      row_sum += jacobian.At(row, col);
+    assert(std::abs(row_sum - vec[row]) < 1e-8);
+  }
+
   std::vector<double> gradient = client.Gradient(0, 0, inputs, std::vector<double>(31, 1.0));
   assert(gradient.size() == 31);
   is_approx_equal(gradient, {-2.932648048015185e-06, -3.942168553400238e-06, -9.922565590361754e-06, -4.978897112303815e-06, 5.280485554023939e-06, 1.2261407080632614e-05, 4.342672272131254e-06, 9.696840162429221e-06, 7.451464965890775e-06, 1.1144695669790261e-05, 1.4793245231223273e-05, 6.004705023140988e-06, 7.3415127709725025e-06, 7.205621299286036e-06, 2.207397762840624e-06, 4.0051161172283134e-07, 6.828119666901777e-06, 2.618658328373824e-07, -7.927133602314562e-06, -4.342845224061809e-06, -1.0238633985776291e-05, -1.2865768823575041e-05, -1.2880966215531031e-05, -2.1388419074036547e-05, -2.907481430093617e-05, -2.6377376498298855e-05, -3.0343264619675514e-05, -3.2412301445225444e-05, -3.1031482808710487e-05, -1.8325226232296377e-05, -1.2232707121556663e-05}, 1e-8);
 
+  std::vector<double> gradient_into;
+  for (int i = 0; i < 2; ++i) {
+    client.GradientInto(0, 0, inputs, std::vector<double>(31, 1.0), gradient_into);
+    is_approx_equal(gradient_into, gradient, 1e-14);
+  }
+
+  auto [outputs_fused, gradient_fused] = client.EvaluateAndGradient(0, 0, inputs, std::vector<double>(31, 1.0));
+  assert(outputs_fused.size() == 1);
+  is_approx_equal(outputs_fused[0], outputs[0], 1e-14);
+  is_approx_equal(gradient_fused, gradient, 1e-14);
+
   std::vector<double> hessian = client.ApplyHessian(0, 0, 0, inputs, std::vector<double>(31, 1.0), std::vector<double>(31, 1.0));
   assert(hessian.size() == 31);
   is_approx_equal(hessian, {-0.05703084478240826, -0.041081411519430365, -0.03923659546005669, 0.131668368896658, -0.04156037270730176, 0.007001891628034763, -0.029443119033930133, 0.06283699153266527, -0.0036128076986567214, 0.08859551057154422, 0.0530163077335749, -0.08265840765370176, 0.003603003125921904, -0.02572178165599473, 0.020834648088245616, 0.06771274807405922, 0.09832588987597307, -0.02647388952229578, 0.09248623172236516, -0.058374201269659906, 0.07326977781528919, 0.08593666105981546, -0.13732609321979417, 0.028789132595208627, 0.03538424597591204, -0.0031804955508639614, 0.039060820038245944, 0.06574255886703954, 0.09937518031462472, 0.23824901332782716, 0.11510315507144973}, 1e-8);
+
+  std::vector<std::vector<double>> jacobian_actions = client.ApplyJacobianBlock(0, 0, inputs, {std::vector<double>(31, 1.0), std::vector<double>(31, 1.0)});
+  assert(jacobian_actions.size() == 2);
+  for (const auto& jacobian_action : jacobian_actions)
+    is_approx_equal(jacobian_action, vec, 1e-14);
+
+  std::vector<std::vector<double>> hessian_actions = client.ApplyHessianBlock(0, 0, 0, inputs, std::vector<double>(31, 1.0), {std::vector<double>(31, 1.0)});
+  assert(hessian_actions.size() == 1);
+  is_approx_equal(hessian_actions[0], hessian, 1e-14);
 }